@@ -0,0 +1,285 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that keeps an ordered index of the
+ * names in the secret store.
+ *
+ * Every change the secret store makes passes through its backing store, so
+ * wrapping the backing store is enough to keep the index up to date. The
+ * index supports prefix scans, range scans and pagination through cursors,
+ * without copying the whole store or holding its lock for the duration.
+ * To see changes as they happen, this should be the outermost decorator.
+ *
+ * The secret store is locked while it loads, so the index can't be built
+ * then. Instead it is seeded with the store's names the first time it is
+ * queried after a load.
+ */
+
+#ifndef _NCHAIN_SDK_INDEXED_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_INDEXED_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretNameIndex.h>
+#include <impl/SecretStoreSeed.h>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of IndexedSecretBackingStore pointer type
+class IndexedSecretBackingStore;
+/// Unique pointer type
+using IndexedSecretBackingStorePtr = std::unique_ptr<IndexedSecretBackingStore>;
+/// Shared pointer type
+using IndexedSecretBackingStoreSPtr = std::shared_ptr<IndexedSecretBackingStore>;
+
+/// Name indexing wrapper around another secret backing store.
+class IndexedSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param secretStore The secret store whose names we index.
+    */
+    IndexedSecretBackingStore(const SecretBackingStoreSPtr& store,
+                              SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore)
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Indexed store requires a backing store to wrap");
+        }
+    }
+
+    /// Forbid copying and assignment.
+    IndexedSecretBackingStore(const IndexedSecretBackingStore&) = delete;
+    IndexedSecretBackingStore(IndexedSecretBackingStore&&) = delete;
+    IndexedSecretBackingStore& operator=(const IndexedSecretBackingStore&) = delete;
+    IndexedSecretBackingStore& operator=(IndexedSecretBackingStore&&) = delete;
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        mStore->saveSecret(secret);
+        const std::string name { secret->getName() };
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.touch(name);
+        mIndex->insert(name);
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->saveSecrets(secrets);
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(const SecretSPtr& secret : secrets)
+        {
+            const std::string name { secret->getName() };
+            mSeed.touch(name);
+            mIndex->insert(name);
+        }
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        mStore->updateSecret(name, secret);
+        const std::string newName { secret->getName() };
+        if(newName != name)
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mSeed.touch(name);
+            mSeed.touch(newName);
+            mIndex->rename(name, newName);
+        }
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        mStore->removeSecret(name);
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.touch(name);
+        mIndex->erase(name);
+    }
+
+    /**
+    * Load all stored secrets. The index is seeded from the secret store
+    * when it is next queried.
+    */
+    void loadAll() override
+    {
+        mStore->loadAll();
+        std::lock_guard<std::mutex> lck { mMtx };
+        mIndex->reset({});
+        mSeed.reset();
+    }
+
+    /**
+    * Replace the contents of the backing store.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->replaceAll(secrets);
+        std::set<std::string> names {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            names.insert(secret->getName());
+        }
+        std::lock_guard<std::mutex> lck { mMtx };
+        mIndex->reset(std::move(names));
+        mSeed.replaced();
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        impl::applyBatch(*mStore, batch);
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            mSeed.touch(op.mName);
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE)
+            {
+                mIndex->erase(op.mName);
+            }
+            else
+            {
+                const std::string newName { op.mSecret->getName() };
+                mSeed.touch(newName);
+                mIndex->rename(op.mName, newName);
+            }
+        }
+    }
+
+    /**
+    * Get a cursor over all secret names, in order.
+    * @param pageSize Number of names fetched per page.
+    * @return A cursor over all names.
+    */
+    SecretNameCursor scanAll(size_t pageSize = SecretNameCursor::DEFAULT_PAGE_SIZE) const
+    {
+        ensureSeeded();
+        return SecretNameCursor { mIndex, {}, {}, pageSize };
+    }
+
+    /**
+    * Get a cursor over all secret names starting with a prefix, in order.
+    * @param prefix The prefix to match.
+    * @param pageSize Number of names fetched per page.
+    * @return A cursor over the matching names.
+    */
+    SecretNameCursor scanPrefix(const std::string& prefix, size_t pageSize = SecretNameCursor::DEFAULT_PAGE_SIZE) const
+    {
+        ensureSeeded();
+        return SecretNameCursor { mIndex, prefix, SecretNameCursor::prefixEnd(prefix), pageSize };
+    }
+
+    /**
+    * Get a cursor over a range of secret names, in order.
+    * @param begin First name in the range.
+    * @param end Name to stop before. An empty string means no limit.
+    * @param pageSize Number of names fetched per page.
+    * @return A cursor over the names in the range.
+    */
+    SecretNameCursor scanRange(const std::string& begin, const std::string& end,
+                               size_t pageSize = SecretNameCursor::DEFAULT_PAGE_SIZE) const
+    {
+        ensureSeeded();
+        return SecretNameCursor { mIndex, begin, end, pageSize };
+    }
+
+    /**
+    * Get a cursor that resumes an earlier scan, after the last name it
+    * returned.
+    * @param position The earlier cursor's position().
+    * @param end Name to stop before, as for the earlier scan. An empty
+    * string means no limit.
+    * @param pageSize Number of names fetched per page.
+    * @return A cursor over the rest of the range.
+    */
+    SecretNameCursor resumeScan(const std::string& position, const std::string& end,
+                                size_t pageSize = SecretNameCursor::DEFAULT_PAGE_SIZE) const
+    {
+        ensureSeeded();
+        return SecretNameCursor { mIndex, position, end, pageSize, true };
+    }
+
+    /**
+    * Get a single page of secret names, for stateless pagination.
+    * @param after Return names after this one. Empty to start from the beginning.
+    * @param limit Maximum number of names to return.
+    * @return Up to limit names.
+    */
+    std::vector<std::string> getSecretNames(const std::string& after, size_t limit) const
+    {
+        ensureSeeded();
+        return mIndex->page(after, after.empty(), {}, limit);
+    }
+
+    /**
+    * Get the number of indexed secrets.
+    * @return The number of secrets.
+    */
+    size_t size() const
+    {
+        ensureSeeded();
+        return mIndex->size();
+    }
+
+  private:
+
+    /// Seed the index from the secret store if it hasn't been since the last load.
+    void ensureSeeded() const
+    {
+        mSeed.seed(mMtx,
+            [this]{ return mSecretStore.getAllSecretNames(); },
+            [this](const std::vector<std::string>& names)
+            {
+                for(const std::string& name : names)
+                {
+                    if(!mSeed.stale(name))
+                    {
+                        mIndex->insert(name);
+                    }
+                }
+            });
+    }
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store whose names we index.
+    SecretStore& mSecretStore;
+
+    /// Our ordered index of names.
+    SecretNameIndexSPtr mIndex { std::make_shared<SecretNameIndex>() };
+
+    /// A mutex ordering changes to the index against seeding it.
+    mutable std::mutex mMtx {};
+
+    /// Seeding state for the index.
+    mutable SecretStoreSeed mSeed {};
+};
+
+}}
+
+#endif
@@ -0,0 +1,684 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * An implementation of a secret backing store that appends one JSON record
+ * per mutation to a journal file, rather than rewriting the whole file.
+ *
+ * Each record carries a CRC-32 so a torn or corrupt tail can be detected and
+ * dropped on load. Damage anywhere before the tail stops the load instead,
+ * leaving the file as it is. The journal is replayed by loadAll() and compacted on a
+ * background thread once it grows beyond a configurable multiple of the
+ * size of the live secrets.
+ */
+
+#ifndef _NCHAIN_SDK_JSON_JOURNAL_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_JSON_JOURNAL_SECRET_BACKING_STORE_H_
+
+#include <impl/JSONSecretBackingStore.h>
+#include <impl/JSONSerialiser.h>
+#include <impl/ParallelSecretLoader.h>
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretRecordSource.h>
+#include <interface/SecretStore.h>
+
+#include <boost/crc.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of JSONJournalSecretBackingStore pointer type
+class JSONJournalSecretBackingStore;
+/// Unique pointer type
+using JSONJournalSecretBackingStorePtr = std::unique_ptr<JSONJournalSecretBackingStore>;
+/// Shared pointer type
+using JSONJournalSecretBackingStoreSPtr = std::shared_ptr<JSONJournalSecretBackingStore>;
+
+/// An append-only journal file based secret DB.
+class JSONJournalSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore,
+                                      public SecretRecordSource
+{
+  public:
+
+    /// Initialisation modes for the journal file.
+    using InitialisationMode = JSONSecretBackingStore::InitialisationMode;
+
+    /// Default journal size, as a multiple of the live data size, that triggers compaction.
+    static constexpr double DEFAULT_COMPACTION_RATIO { 2.0 };
+    /// Default journal size below which we never bother compacting.
+    static constexpr size_t DEFAULT_MIN_COMPACTION_BYTES { 1024 * 1024 };
+
+    /**
+    * Constructor.
+    * @param fileName Fully qualified filename of the journal to persist to.
+    * @param init How to initialise the journal file.
+    * @param compactionRatio Compact once the journal is this many times
+    * larger than the live secrets it holds.
+    * @param minCompactionBytes Never compact a journal smaller than this.
+    * @param store The secret store to load secrets into.
+    */
+    JSONJournalSecretBackingStore(const std::string& fileName,
+                                  InitialisationMode init = InitialisationMode::INIT_NONE,
+                                  double compactionRatio = DEFAULT_COMPACTION_RATIO,
+                                  size_t minCompactionBytes = DEFAULT_MIN_COMPACTION_BYTES,
+                                  SecretStore& store = SecretStore::get())
+    : mSecretStore(store), mFileName{fileName}, mCompactionRatio{compactionRatio}, mMinCompactionBytes{minCompactionBytes}
+    {
+        if(mCompactionRatio < 1.0)
+        {
+            throw std::invalid_argument("Journal compaction ratio must be at least 1");
+        }
+
+        if(init == InitialisationMode::INIT_CREATE)
+        {
+            std::ofstream file { mFileName, std::ios::binary | std::ios::trunc };
+            if(!file)
+            {
+                throw std::runtime_error("Failed to create file " + mFileName + " for writing");
+            }
+            file << JOURNAL_HEADER;
+        }
+
+        openJournal();
+    }
+
+    /// Forbid copying and assignment.
+    JSONJournalSecretBackingStore(const JSONJournalSecretBackingStore&) = delete;
+    JSONJournalSecretBackingStore(JSONJournalSecretBackingStore&&) = delete;
+    JSONJournalSecretBackingStore& operator=(const JSONJournalSecretBackingStore&) = delete;
+    JSONJournalSecretBackingStore& operator=(JSONJournalSecretBackingStore&&) = delete;
+
+    /// Destructor. Waits for any background compaction to finish.
+    ~JSONJournalSecretBackingStore() override
+    {
+        std::thread compactor {};
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            compactor.swap(mCompactor);
+        }
+        if(compactor.joinable())
+        {
+            compactor.join();
+        }
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        const std::string& name { secret->getName() };
+        std::string payload { JSONSerialiser::serialise(*secret) };
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        append(makeRecord(OP_SET, name, payload));
+        setRecord(name, std::move(payload));
+        maybeCompact();
+    }
+
+    /**
+    * Save a list of new secrets. All records are appended with a single write.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::vector<std::pair<std::string, std::string>> records {};
+        records.reserve(secrets.size());
+        std::string journal {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            records.emplace_back(secret->getName(), JSONSerialiser::serialise(*secret));
+            journal += makeRecord(OP_SET, records.back().first, records.back().second);
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        append(journal);
+        for(auto& record : records)
+        {
+            setRecord(record.first, std::move(record.second));
+        }
+        maybeCompact();
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret. Note that this parameter is
+    * required because it might be the name itself of the secret that has changed.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        const std::string& newName { secret->getName() };
+        std::string payload { JSONSerialiser::serialise(*secret) };
+        std::string journal {};
+        if(newName != name)
+        {
+            journal += makeRecord(OP_REMOVE, name, {});
+        }
+        journal += makeRecord(OP_SET, newName, payload);
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        append(journal);
+        if(newName != name)
+        {
+            eraseRecord(name);
+        }
+        setRecord(newName, std::move(payload));
+        maybeCompact();
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        if(mRecords.count(name))
+        {
+            append(makeRecord(OP_REMOVE, name, {}));
+            eraseRecord(name);
+            maybeCompact();
+        }
+    }
+
+    /**
+    * Persist a batch of mutations. All records are appended with a single write.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        const std::vector<SecretBackingStoreBatch::Op>& ops { batch.getOps() };
+        std::vector<std::string> payloads {};
+        payloads.reserve(ops.size());
+        for(const SecretBackingStoreBatch::Op& op : ops)
+        {
+            payloads.push_back(op.mSecret ? JSONSerialiser::serialise(*op.mSecret) : std::string {});
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+
+        // Encode everything first, so a failed write leaves our records untouched
+        std::unordered_map<std::string, bool> live {};
+        auto exists = [this, &live](const std::string& name)
+        {
+            const auto it = live.find(name);
+            return it != live.end() ? it->second : mRecords.count(name) > 0;
+        };
+        std::string journal {};
+        for(size_t i = 0; i < ops.size(); ++i)
+        {
+            const SecretBackingStoreBatch::Op& op { ops[i] };
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE)
+            {
+                if(exists(op.mName))
+                {
+                    journal += makeRecord(OP_REMOVE, op.mName, {});
+                    live[op.mName] = false;
+                }
+                continue;
+            }
+
+            const std::string& newName { op.mSecret->getName() };
+            if(newName != op.mName)
+            {
+                journal += makeRecord(OP_REMOVE, op.mName, {});
+                live[op.mName] = false;
+            }
+            journal += makeRecord(OP_SET, newName, payloads[i]);
+            live[newName] = true;
+        }
+        append(journal);
+
+        for(size_t i = 0; i < ops.size(); ++i)
+        {
+            const SecretBackingStoreBatch::Op& op { ops[i] };
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE || op.mSecret->getName() != op.mName)
+            {
+                eraseRecord(op.mName);
+            }
+            if(op.mSecret)
+            {
+                setRecord(op.mSecret->getName(), std::move(payloads[i]));
+            }
+        }
+        maybeCompact();
+    }
+
+    /**
+    * Load all stored secrets by replaying the journal. A torn or corrupt
+    * record at the end of the journal is dropped, and the journal is
+    * rewritten without it. A bad record followed by more of the journal
+    * throws, and the file is left untouched.
+    */
+    void loadAll() override
+    {
+        // Deserialise in parallel
+        ParallelSecretLoader loader { mSecretStore };
+        loader.load([this](const ParallelSecretLoader::EmitFunc& emit)
+        {
+            readAll(emit);
+        });
+    }
+
+    /**
+    * Read all stored secrets by replaying the journal, which is repaired
+    * or rejected just as by loadAll().
+    * @param emit Called for each serialised secret.
+    */
+    void readAll(const EmitFunc& emit) override
+    {
+        RecordMap records {};
+        {
+            std::lock_guard<std::mutex> compactLck { mCompactMtx };
+            std::unique_lock<std::mutex> lck { mMtx };
+            mStream.close();
+
+            try
+            {
+                if(!replay())
+                {
+                    rewrite(mRecords);
+                }
+                records = mRecords;
+            }
+            catch(...)
+            {
+                openJournal();
+                throw;
+            }
+            openJournal();
+        }
+
+        // Emit outside our locks
+        for(auto& record : records)
+        {
+            emit(std::move(record.second));
+        }
+    }
+
+    /**
+    * Remove everything currently in the backing store and replace it with
+    * whatever is currently held by the secret store.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        RecordMap records {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            records[secret->getName()] = JSONSerialiser::serialise(*secret);
+        }
+
+        std::lock_guard<std::mutex> compactLck { mCompactMtx };
+        std::lock_guard<std::mutex> lck { mMtx };
+        mStream.close();
+        rewrite(records);
+        mRecords.swap(records);
+        mLiveBytes = 0;
+        for(const auto& record : mRecords)
+        {
+            mLiveBytes += recordSize(record.first, record.second);
+        }
+        openJournal();
+    }
+
+    /**
+    * Rewrite the journal so it holds a single record per live secret.
+    * Mutations can continue while the bulk of the rewrite is in progress.
+    */
+    void compact()
+    {
+        std::lock_guard<std::mutex> compactLck { mCompactMtx };
+
+        std::unique_lock<std::mutex> lck { mMtx };
+        RecordMap snapshot { mRecords };
+        std::streamoff offset { mJournalBytes };
+        lck.unlock();
+
+        // Write out everything live at the snapshot point
+        const std::string tmpName { mFileName + ".compact" };
+        std::ofstream tmp { tmpName, std::ios::binary | std::ios::trunc };
+        if(!tmp)
+        {
+            throw std::runtime_error("Failed to create file " + tmpName + " for writing");
+        }
+        tmp << JOURNAL_HEADER;
+        for(const auto& record : snapshot)
+        {
+            tmp << makeRecord(OP_SET, record.first, record.second);
+        }
+
+        // Carry over anything appended since the snapshot, then swap files
+        lck.lock();
+        mStream.flush();
+        if(mJournalBytes > offset)
+        {
+            std::ifstream journal { mFileName, std::ios::binary };
+            journal.seekg(offset);
+            tmp << journal.rdbuf();
+        }
+        tmp.close();
+        if(!tmp)
+        {
+            throw std::runtime_error("Failed to write file " + tmpName);
+        }
+
+        mStream.close();
+        try
+        {
+            replaceFile(tmpName);
+        }
+        catch(...)
+        {
+            openJournal();
+            throw;
+        }
+        openJournal();
+    }
+
+  private:
+
+    /// Map of secret names to their serialised form
+    using RecordMap = std::unordered_map<std::string, std::string>;
+
+    /// Journal file header, identifies the format version.
+    static constexpr const char* JOURNAL_HEADER { "NAKASENDO-JOURNAL 1\n" };
+
+    /// Record operation types.
+    static constexpr char OP_SET { 'S' };
+    static constexpr char OP_REMOVE { 'R' };
+
+    /**
+    * Encode a journal record as:
+    *   <op> <name length> <payload length> <crc32 hex>\n<name><payload>\n
+    */
+    static std::string makeRecord(char op, const std::string& name, const std::string& payload)
+    {
+        std::ostringstream record {};
+        record << op << ' ' << name.size() << ' ' << payload.size() << ' '
+               << std::hex << checksum(op, name, payload) << '\n'
+               << name << payload << '\n';
+        return record.str();
+    }
+
+    /// Checksum covering every field of a record.
+    static uint32_t checksum(char op, const std::string& name, const std::string& payload)
+    {
+        boost::crc_32_type crc {};
+        crc.process_byte(static_cast<unsigned char>(op));
+        crc.process_bytes(name.data(), name.size());
+        crc.process_bytes(payload.data(), payload.size());
+        return crc.checksum();
+    }
+
+    /// Approximate on-disk size of a record, used for compaction accounting.
+    static size_t recordSize(const std::string& name, const std::string& payload)
+    {
+        return name.size() + payload.size() + 32;
+    }
+
+    /**
+    * Rebuild our record map from the journal file.
+    * @return False if the journal ended in a torn or corrupt record.
+    * @throw std::runtime_error if a bad record is followed by more of the
+    * journal, since dropping it would lose everything after it too.
+    */
+    bool replay()
+    {
+        std::ifstream journal { mFileName, std::ios::binary };
+        if(!journal)
+        {
+            throw std::runtime_error("Failed to open file " + mFileName + " for reading");
+        }
+
+        std::string line {};
+        if(!std::getline(journal, line) || line + '\n' != JOURNAL_HEADER)
+        {
+            throw std::runtime_error("File " + mFileName + " is not a secret journal");
+        }
+
+        // Only the last record can be torn; a bad one with intact records
+        // after it is damage we mustn't paper over
+        const auto badRecord = [this](std::streamoff offset)
+        {
+            if(intactRecordAfter(offset))
+            {
+                throw std::runtime_error("Journal " + mFileName + " is corrupt at offset " +
+                                         std::to_string(offset) + "; not loading it");
+            }
+            return false;
+        };
+
+        mRecords.clear();
+        mLiveBytes = 0;
+        std::streamoff offset { journal.tellg() };
+        while(std::getline(journal, line))
+        {
+            std::istringstream header { line };
+            char op {};
+            size_t nameLen {};
+            size_t payloadLen {};
+            uint32_t crc {};
+            if(!(header >> op >> nameLen >> payloadLen >> std::hex >> crc))
+            {
+                return badRecord(offset);
+            }
+
+            std::string name(nameLen, '\0');
+            std::string payload(payloadLen, '\0');
+            char terminator {};
+            if(!journal.read(&name[0], nameLen) || !journal.read(&payload[0], payloadLen) ||
+               !journal.get(terminator) || terminator != '\n' || checksum(op, name, payload) != crc)
+            {
+                return badRecord(offset);
+            }
+
+            if(op == OP_SET)
+            {
+                setRecord(name, std::move(payload));
+            }
+            else if(op == OP_REMOVE)
+            {
+                eraseRecord(name);
+            }
+            else
+            {
+                return badRecord(offset);
+            }
+            offset = journal.tellg();
+        }
+
+        return true;
+    }
+
+    /**
+    * Check whether an intact record follows a bad one. A bad record's
+    * lengths can't be trusted, so look for a record starting after any
+    * newline beyond it.
+    * @param offset Where the bad record starts.
+    * @return True if the damage isn't just a torn tail.
+    */
+    bool intactRecordAfter(std::streamoff offset) const
+    {
+        std::ifstream journal { mFileName, std::ios::binary };
+        journal.seekg(offset);
+        const std::string rest { std::istreambuf_iterator<char> { journal }, std::istreambuf_iterator<char> {} };
+
+        for(size_t start = rest.find('\n'); start != std::string::npos; start = rest.find('\n', start + 1))
+        {
+            const size_t headerEnd { rest.find('\n', start + 1) };
+            if(headerEnd == std::string::npos)
+            {
+                break;
+            }
+
+            std::istringstream header { rest.substr(start + 1, headerEnd - start - 1) };
+            char op {};
+            size_t nameLen {};
+            size_t payloadLen {};
+            uint32_t crc {};
+            if(!(header >> op >> nameLen >> payloadLen >> std::hex >> crc) ||
+               nameLen > rest.size() || payloadLen > rest.size() ||
+               headerEnd + 1 + nameLen + payloadLen >= rest.size() ||
+               rest[headerEnd + 1 + nameLen + payloadLen] != '\n')
+            {
+                continue;
+            }
+            if(checksum(op, rest.substr(headerEnd + 1, nameLen), rest.substr(headerEnd + 1 + nameLen, payloadLen)) == crc)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Replace the journal file with one holding just the given records.
+    void rewrite(const RecordMap& records)
+    {
+        const std::string tmpName { mFileName + ".compact" };
+        {
+            std::ofstream tmp { tmpName, std::ios::binary | std::ios::trunc };
+            tmp << JOURNAL_HEADER;
+            for(const auto& record : records)
+            {
+                tmp << makeRecord(OP_SET, record.first, record.second);
+            }
+            if(!tmp.flush())
+            {
+                throw std::runtime_error("Failed to write file " + tmpName);
+            }
+        }
+        replaceFile(tmpName);
+    }
+
+    /// Move a fully written temporary file over our journal.
+    void replaceFile(const std::string& tmpName)
+    {
+        if(std::rename(tmpName.c_str(), mFileName.c_str()) != 0)
+        {
+            // Some platforms won't rename over an existing file
+            std::remove(mFileName.c_str());
+            if(std::rename(tmpName.c_str(), mFileName.c_str()) != 0)
+            {
+                throw std::runtime_error("Failed to replace file " + mFileName);
+            }
+        }
+    }
+
+    /// (Re)open our append stream and note the current journal size.
+    void openJournal()
+    {
+        mStream.open(mFileName, std::ios::binary | std::ios::app);
+        if(!mStream)
+        {
+            throw std::runtime_error("Failed to open file " + mFileName + " for writing");
+        }
+        mStream.seekp(0, std::ios::end);
+        mJournalBytes = mStream.tellp();
+    }
+
+    /// Append encoded records to the journal. Called with our mutex held.
+    void append(const std::string& records)
+    {
+        if(!mStream.write(records.data(), records.size()).flush())
+        {
+            throw std::runtime_error("Failed to append to file " + mFileName);
+        }
+        mJournalBytes += records.size();
+    }
+
+    /// Set a live record, keeping the live size up to date.
+    void setRecord(const std::string& name, std::string&& payload)
+    {
+        eraseRecord(name);
+        mLiveBytes += recordSize(name, payload);
+        mRecords[name] = std::move(payload);
+    }
+
+    /// Drop a live record, keeping the live size up to date.
+    void eraseRecord(const std::string& name)
+    {
+        const auto it = mRecords.find(name);
+        if(it != mRecords.end())
+        {
+            mLiveBytes -= recordSize(it->first, it->second);
+            mRecords.erase(it);
+        }
+    }
+
+    /// Kick off a background compaction if the journal has grown too large.
+    void maybeCompact()
+    {
+        const size_t journalBytes { static_cast<size_t>(mJournalBytes) };
+        if(mCompacting || journalBytes < mMinCompactionBytes ||
+           journalBytes < mLiveBytes * mCompactionRatio)
+        {
+            return;
+        }
+
+        if(mCompactor.joinable())
+        {
+            mCompactor.join();
+        }
+        mCompacting = true;
+        mCompactor = std::thread { [this]()
+        {
+            try
+            {
+                compact();
+            }
+            catch(...)
+            {
+                // The journal is still intact; we'll try again after the next write.
+            }
+            std::lock_guard<std::mutex> lck { mMtx };
+            mCompacting = false;
+        }};
+    }
+
+    /// A mutex for thread safety.
+    mutable std::mutex mMtx {};
+
+    /// Serialises whole-file rewrites.
+    std::mutex mCompactMtx {};
+
+    /// The secret store we load into.
+    SecretStore& mSecretStore;
+
+    /// Filename to use for saving to.
+    std::string mFileName {};
+
+    /// Compaction tuning.
+    double mCompactionRatio {};
+    size_t mMinCompactionBytes {};
+
+    /// Stream we append records through.
+    std::ofstream mStream {};
+
+    /// Current size of the journal file.
+    std::streamoff mJournalBytes {0};
+
+    /// Approximate size of the live records.
+    size_t mLiveBytes {0};
+
+    /// Serialised form of every live secret.
+    RecordMap mRecords {};
+
+    /// Background compaction state.
+    bool mCompacting {false};
+    std::thread mCompactor {};
+};
+
+}}
+
+#endif
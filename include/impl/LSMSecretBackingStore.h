@@ -0,0 +1,1301 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A log-structured secret backing store for high-churn workloads.
+ *
+ * Mutations are appended to a write-ahead log and applied to an in-memory
+ * sorted memtable. Once the memtable is large enough it is written out by a
+ * background thread as an immutable, sorted segment file with a sparse
+ * index and a bloom filter. When there are too many segments they are
+ * merged into one, dropping removed and superseded secrets.
+ *
+ * A secret that is added and removed again before its memtable is written
+ * out never reaches a segment at all, and the bloom filters let removals of
+ * such secrets skip writing a tombstone.
+ *
+ * All files live in a single directory:
+ *   <seq>.wal  Write-ahead log for the memtable that becomes segment <seq>
+ *   <seq>.seg  Segment file
+ *   <seq>.tmp  Segment being written
+ * Binary values are in host byte order.
+ */
+
+#ifndef _NCHAIN_SDK_LSM_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_LSM_SECRET_BACKING_STORE_H_
+
+#include <impl/JSONSecretBackingStore.h>
+#include <impl/JSONSerialiser.h>
+#include <impl/ParallelSecretLoader.h>
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretRecordSource.h>
+#include <interface/SecretStore.h>
+
+#include <boost/crc.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of LSMSecretBackingStore pointer type
+class LSMSecretBackingStore;
+/// Unique pointer type
+using LSMSecretBackingStorePtr = std::unique_ptr<LSMSecretBackingStore>;
+/// Shared pointer type
+using LSMSecretBackingStoreSPtr = std::shared_ptr<LSMSecretBackingStore>;
+
+/// A log-structured merge secret DB.
+class LSMSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore, public SecretRecordSource
+{
+  public:
+
+    /// Initialisation modes for the backing store directory.
+    using InitialisationMode = JSONSecretBackingStore::InitialisationMode;
+
+    /// Default memtable size before it is written out as a segment.
+    static constexpr size_t DEFAULT_MEMTABLE_BYTES { 4 * 1024 * 1024 };
+
+    /// Default number of segments that triggers a compaction.
+    static constexpr size_t DEFAULT_MAX_SEGMENTS { 8 };
+
+    /// Write statistics.
+    struct Stats
+    {
+        /// Bytes of names and serialised secrets handed to us.
+        uint64_t mLogicalBytes {0};
+        /// Bytes written to log and segment files.
+        uint64_t mPhysicalBytes {0};
+        /// Number of memtables written out as segments.
+        uint64_t mFlushes {0};
+        /// Number of compactions.
+        uint64_t mCompactions {0};
+        /// Current number of segments.
+        size_t mNumSegments {0};
+
+        /// Ratio of physical to logical bytes written.
+        double writeAmplification() const
+        {
+            return mLogicalBytes ? static_cast<double>(mPhysicalBytes) / mLogicalBytes : 0;
+        }
+    };
+
+    /**
+    * Constructor.
+    * @param directory Directory to keep our files in.
+    * @param init How to initialise the directory. INIT_CREATE creates it if
+    * required and removes any existing store files from it.
+    * @param memtableBytes Memtable size at which it is written out as a segment.
+    * @param maxSegments Number of segments that triggers a compaction.
+    * @param store The secret store to load secrets into.
+    */
+    LSMSecretBackingStore(const std::string& directory,
+                          InitialisationMode init = InitialisationMode::INIT_NONE,
+                          size_t memtableBytes = DEFAULT_MEMTABLE_BYTES,
+                          size_t maxSegments = DEFAULT_MAX_SEGMENTS,
+                          SecretStore& store = SecretStore::get())
+    : mSecretStore(store), mDirectory{directory}, mMemtableBytes{memtableBytes ? memtableBytes : 1},
+      mMaxSegments{std::max<size_t>(maxSegments, 2)}
+    {
+        if(init == InitialisationMode::INIT_CREATE)
+        {
+            if(mkdir(mDirectory.c_str(), 0700) != 0 && errno != EEXIST)
+            {
+                throw std::runtime_error("Failed to create directory " + mDirectory);
+            }
+            for(const auto& file : listFiles())
+            {
+                std::remove(path(file.first, file.second).c_str());
+            }
+        }
+
+        open();
+        mBackground = std::thread { &LSMSecretBackingStore::backgroundLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    LSMSecretBackingStore(const LSMSecretBackingStore&) = delete;
+    LSMSecretBackingStore(LSMSecretBackingStore&&) = delete;
+    LSMSecretBackingStore& operator=(const LSMSecretBackingStore&) = delete;
+    LSMSecretBackingStore& operator=(LSMSecretBackingStore&&) = delete;
+
+    /// Destructor. Anything not yet in a segment is recovered from the log on reopening.
+    ~LSMSecretBackingStore() override
+    {
+        {
+            boost::unique_lock<boost::shared_mutex> lck { mMtx };
+            mStopping = true;
+        }
+        mWorkCv.notify_all();
+        mFlushedCv.notify_all();
+        mBackground.join();
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        const std::string payload { JSONSerialiser::serialise(*secret) };
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        waitForRoom(lck);
+        put(secret->getName(), payload);
+        log().flush();
+        maybeRotate();
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::vector<std::string> payloads {};
+        payloads.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            payloads.push_back(JSONSerialiser::serialise(*secret));
+        }
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            waitForRoom(lck);
+            put(secrets[i]->getName(), payloads[i]);
+            maybeRotate();
+        }
+        log().flush();
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret. Note that this parameter is
+    * required because it might be the name itself of the secret that has changed.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        const std::string payload { JSONSerialiser::serialise(*secret) };
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        waitForRoom(lck);
+        put(secret->getName(), payload);
+        if(secret->getName() != name)
+        {
+            erase(name);
+        }
+        log().flush();
+        maybeRotate();
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        waitForRoom(lck);
+        erase(name);
+        log().flush();
+        maybeRotate();
+    }
+
+    /**
+    * Persist a batch of mutations, flushing the log once at the end.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        const std::vector<SecretBackingStoreBatch::Op>& ops { batch.getOps() };
+        std::vector<std::string> payloads {};
+        payloads.reserve(ops.size());
+        for(const SecretBackingStoreBatch::Op& op : ops)
+        {
+            payloads.push_back(op.mSecret ? JSONSerialiser::serialise(*op.mSecret) : std::string {});
+        }
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        for(size_t i = 0; i < ops.size(); ++i)
+        {
+            const SecretBackingStoreBatch::Op& op { ops[i] };
+            waitForRoom(lck);
+            if(op.mSecret)
+            {
+                put(op.mSecret->getName(), payloads[i]);
+            }
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE || (op.mSecret && op.mSecret->getName() != op.mName))
+            {
+                erase(op.mName);
+            }
+            maybeRotate();
+        }
+        log().flush();
+    }
+
+    /**
+    * Load all stored secrets.
+    */
+    void loadAll() override
+    {
+        ParallelSecretLoader loader { mSecretStore };
+        loader.load([this](const ParallelSecretLoader::EmitFunc& emit)
+        {
+            readAll(emit);
+        });
+    }
+
+    /**
+    * Read all stored secrets.
+    * @param emit Called for each serialised secret.
+    */
+    void readAll(const EmitFunc& emit) override
+    {
+        // Take a consistent view. Open segment files stay readable even if
+        // a compaction replaces them while we work.
+        Memtable overlay {};
+        std::vector<SegmentReaderPtr> readers {};
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            if(mImmutable)
+            {
+                overlay = *mImmutable;
+            }
+            for(const auto& entry : mMemtable)
+            {
+                overlay[entry.first] = entry.second;
+            }
+            for(const SegmentSPtr& segment : mSegments)
+            {
+                readers.emplace_back(new SegmentReader { *segment });
+            }
+        }
+
+        mergeSegments(readers, [&overlay, &emit](const std::string& name, Entry& entry)
+        {
+            if(entry.mLive && overlay.find(name) == overlay.end())
+            {
+                emit(std::move(entry.mPayload));
+            }
+        });
+
+        for(auto& entry : overlay)
+        {
+            if(entry.second.mLive)
+            {
+                emit(std::move(entry.second.mPayload));
+            }
+        }
+    }
+
+    /**
+    * Remove everything currently in the backing store and replace it with
+    * whatever is currently held by the secret store.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        Memtable contents {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            contents[secret->getName()] = Entry { JSONSerialiser::serialise(*secret), true };
+        }
+
+        std::lock_guard<std::mutex> maintLck { mMaintMtx };
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+
+        // A segment with a base sequence of 0 supersedes everything before it
+        const uint64_t seq { mNextSeq++ };
+        SegmentSPtr segment { writeSegment(seq, 0, [&contents](const EntrySink& sink)
+        {
+            for(auto& entry : contents)
+            {
+                sink(entry.first, entry.second);
+            }
+        }) };
+        installFile(seq, ".tmp", ".seg");
+        mStats.mPhysicalBytes += segment->mFileSize;
+
+        mLog.close();
+        for(const auto& file : listFiles())
+        {
+            if(file.first != seq)
+            {
+                std::remove(path(file.first, file.second).c_str());
+            }
+        }
+
+        mSegments = { segment };
+        mMemtable.clear();
+        mMemtableSize = 0;
+        mImmutable.reset();
+        mImmutableLogs.clear();
+        mMemtableLogs.clear();
+        mFailure = nullptr;
+        startLog();
+        mFlushedCv.notify_all();
+    }
+
+    /**
+    * Point lookup of a single stored secret. The secret is not added to the
+    * secret store.
+    * @param name The name of the secret to lookup.
+    * @return The stored secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name) const
+    {
+        Entry entry {};
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            if(!find(name, entry) || !entry.mLive)
+            {
+                return nullptr;
+            }
+        }
+
+        std::istringstream str { entry.mPayload };
+        return std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str));
+    }
+
+    /**
+    * Write the current memtable out as a segment and wait for it to complete.
+    */
+    void flush()
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        mFlushedCv.wait(lck, [this]{ return !mImmutable || mFailure || mStopping; });
+        rethrowFailure();
+        if(!mMemtable.empty())
+        {
+            rotate();
+        }
+        mFlushedCv.wait(lck, [this]{ return !mImmutable || mFailure || mStopping; });
+        rethrowFailure();
+    }
+
+    /**
+    * Merge all segments into one now, rather than waiting for the background
+    * compaction.
+    */
+    void compact()
+    {
+        std::lock_guard<std::mutex> maintLck { mMaintMtx };
+        compactNL();
+    }
+
+    /**
+    * Get write statistics.
+    * @return Our statistics.
+    */
+    Stats getStats() const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        Stats stats { mStats };
+        stats.mNumSegments = mSegments.size();
+        return stats;
+    }
+
+  private:
+
+    /// A stored value; removed secrets are kept as tombstones until compaction.
+    struct Entry
+    {
+        std::string mPayload {};
+        bool mLive {false};
+    };
+
+    /// An in-memory sorted table of entries.
+    using Memtable = std::map<std::string, Entry>;
+    using MemtableSPtr = std::shared_ptr<const Memtable>;
+
+    /// Receives entries in name order.
+    using EntrySink = std::function<void(const std::string&, const Entry&)>;
+    /// Receives merged entries in name order, and may take their contents.
+    using MergeSink = std::function<void(const std::string&, Entry&)>;
+
+    /// Bloom filter over the names in a segment.
+    struct BloomFilter
+    {
+        uint32_t mNumHashes {0};
+        std::vector<uint8_t> mBits {};
+
+        /// Set up for the given number of names.
+        void init(size_t count)
+        {
+            mNumHashes = BLOOM_HASHES;
+            mBits.assign(std::max<size_t>(8, (count * BLOOM_BITS_PER_KEY + 7) / 8), 0);
+        }
+
+        void add(uint64_t hash)
+        {
+            const uint64_t numBits { mBits.size() * 8 };
+            uint64_t h1 { hash };
+            const uint64_t h2 { (hash >> 32) | 1 };
+            for(uint32_t i = 0; i < mNumHashes; ++i, h1 += h2)
+            {
+                mBits[(h1 % numBits) / 8] |= static_cast<uint8_t>(1u << (h1 % 8));
+            }
+        }
+
+        bool mayContain(const std::string& name) const
+        {
+            if(mBits.empty())
+            {
+                return true;
+            }
+
+            const uint64_t numBits { mBits.size() * 8 };
+            uint64_t h1 { hashName(name) };
+            const uint64_t h2 { (h1 >> 32) | 1 };
+            for(uint32_t i = 0; i < mNumHashes; ++i, h1 += h2)
+            {
+                if(!(mBits[(h1 % numBits) / 8] & (1u << (h1 % 8))))
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    /// An immutable on-disk sorted segment.
+    struct Segment
+    {
+        /// Sequence number, newer segments have higher numbers.
+        uint64_t mSeq {0};
+        /// Lowest sequence number this segment supersedes.
+        uint64_t mBaseSeq {0};
+        /// File name.
+        std::string mPath {};
+        /// End of the entry data in the file.
+        uint64_t mDataEnd {0};
+        /// Total size of the file.
+        uint64_t mFileSize {0};
+        /// Every SPARSE_INTERVAL'th name and its offset.
+        std::vector<std::pair<std::string, uint64_t>> mIndex {};
+        /// Filter over all names in the segment.
+        BloomFilter mBloom {};
+    };
+    using SegmentSPtr = std::shared_ptr<const Segment>;
+
+    /// Fixed trailer at the end of each segment file.
+    struct SegmentTrailer
+    {
+        uint64_t mIndexOffset;
+        uint64_t mBloomOffset;
+        uint64_t mCount;
+        uint64_t mBaseSeq;
+        uint32_t mCrc;          // CRC-32 of the index and bloom filter
+        uint32_t mNumHashes;
+        char mMagic[8];         // SEGMENT_MAGIC
+    };
+
+    /// Sequential reader over the entries in a segment.
+    class SegmentReader
+    {
+      public:
+        SegmentReader(const Segment& segment)
+        : mFile{segment.mPath, std::ios::binary}, mPath{segment.mPath}, mEnd{segment.mDataEnd}
+        {
+            if(!mFile)
+            {
+                throw std::runtime_error("Failed to open file " + mPath + " for reading");
+            }
+        }
+
+        /// Position at an entry offset.
+        void seek(uint64_t offset)
+        {
+            mPos = offset;
+            mFile.seekg(static_cast<std::streamoff>(offset));
+        }
+
+        /// Read the next entry. Returns false at the end of the data.
+        bool next()
+        {
+            if(mPos >= mEnd)
+            {
+                return false;
+            }
+
+            uint8_t live {};
+            uint32_t nameLen {};
+            uint32_t payloadLen {};
+            uint32_t crc {};
+            mFile.read(reinterpret_cast<char*>(&live), sizeof(live));
+            mFile.read(reinterpret_cast<char*>(&nameLen), sizeof(nameLen));
+            mFile.read(reinterpret_cast<char*>(&payloadLen), sizeof(payloadLen));
+            mFile.read(reinterpret_cast<char*>(&crc), sizeof(crc));
+            const uint64_t size { ENTRY_HEADER_SIZE + uint64_t{nameLen} + payloadLen };
+            if(!mFile || size > mEnd - mPos)
+            {
+                throw std::runtime_error("Corrupt segment file " + mPath);
+            }
+
+            mName.resize(nameLen);
+            mEntry.mPayload.resize(payloadLen);
+            mFile.read(&mName[0], nameLen);
+            mFile.read(&mEntry.mPayload[0], payloadLen);
+            mEntry.mLive = live;
+            if(!mFile || entryCrc(mName, mEntry.mPayload) != crc)
+            {
+                throw std::runtime_error("Corrupt segment file " + mPath);
+            }
+
+            mPos += size;
+            return true;
+        }
+
+        std::string mName {};
+        Entry mEntry {};
+
+      private:
+        std::ifstream mFile {};
+        std::string mPath {};
+        uint64_t mPos {0};
+        uint64_t mEnd {0};
+    };
+    using SegmentReaderPtr = std::unique_ptr<SegmentReader>;
+
+    /// File identification.
+    static constexpr const char* SEGMENT_MAGIC { "NKSLSM1" };
+
+    /// Write-ahead log operations.
+    static constexpr char OP_SAVE { 'S' };
+    static constexpr char OP_REMOVE { 'R' };
+
+    /// Size of the fixed part of an entry.
+    static constexpr uint64_t ENTRY_HEADER_SIZE { 1 + 3 * sizeof(uint32_t) };
+
+    /// Size of the fixed part of a log record.
+    static constexpr uint64_t LOG_HEADER_SIZE { 1 + 3 * sizeof(uint32_t) };
+
+    /// Index every this many names in a segment.
+    static constexpr size_t SPARSE_INTERVAL { 16 };
+
+    /// Bloom filter sizing, giving around a 1% false positive rate.
+    static constexpr size_t BLOOM_BITS_PER_KEY { 10 };
+    static constexpr uint32_t BLOOM_HASHES { 7 };
+
+    /// FNV-1a hash of a name.
+    static uint64_t hashName(const std::string& name)
+    {
+        uint64_t hash { 0xcbf29ce484222325ULL };
+        for(char c : name)
+        {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    /// CRC-32 of a name and payload.
+    static uint32_t entryCrc(const std::string& name, const std::string& payload)
+    {
+        boost::crc_32_type crc {};
+        crc.process_bytes(name.data(), name.size());
+        crc.process_bytes(payload.data(), payload.size());
+        return crc.checksum();
+    }
+
+    /// Append a fixed size value to a buffer.
+    template<typename T>
+    static void append(std::string& buffer, T value)
+    {
+        buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+    }
+
+    /// Read a fixed size value from a buffer.
+    template<typename T>
+    static T extract(const std::string& buffer, size_t& pos)
+    {
+        T value {};
+        if(buffer.size() - pos < sizeof(value))
+        {
+            throw std::runtime_error("Truncated segment metadata");
+        }
+        memcpy(&value, buffer.data() + pos, sizeof(value));
+        pos += sizeof(value);
+        return value;
+    }
+
+    /// Visit the merged contents of some segments, given newest first, in name order.
+    static void mergeSegments(std::vector<SegmentReaderPtr>& readers, const MergeSink& sink)
+    {
+        std::vector<bool> valid {};
+        for(SegmentReaderPtr& reader : readers)
+        {
+            valid.push_back(reader->next());
+        }
+
+        while(true)
+        {
+            // Ties go to the newest segment
+            size_t best { readers.size() };
+            for(size_t i = 0; i < readers.size(); ++i)
+            {
+                if(valid[i] && (best == readers.size() || readers[i]->mName < readers[best]->mName))
+                {
+                    best = i;
+                }
+            }
+            if(best == readers.size())
+            {
+                break;
+            }
+
+            const std::string name { readers[best]->mName };
+            sink(name, readers[best]->mEntry);
+            for(size_t i = 0; i < readers.size(); ++i)
+            {
+                if(valid[i] && readers[i]->mName == name)
+                {
+                    valid[i] = readers[i]->next();
+                }
+            }
+        }
+    }
+
+    /// Get the full path of one of our files.
+    std::string path(uint64_t seq, const std::string& suffix) const
+    {
+        char name[32] {};
+        snprintf(name, sizeof(name), "%016llu", static_cast<unsigned long long>(seq));
+        return mDirectory + "/" + name + suffix;
+    }
+
+    /// List our files as sequence number and suffix.
+    std::vector<std::pair<uint64_t, std::string>> listFiles() const
+    {
+        std::vector<std::pair<uint64_t, std::string>> files {};
+        DIR* dir { opendir(mDirectory.c_str()) };
+        if(!dir)
+        {
+            throw std::runtime_error("Failed to open directory " + mDirectory);
+        }
+
+        while(dirent* entry = readdir(dir))
+        {
+            const std::string name { entry->d_name };
+            if(name.size() == 20 && name.find_first_not_of("0123456789") == 16)
+            {
+                const std::string suffix { name.substr(16) };
+                if(suffix == ".seg" || suffix == ".wal" || suffix == ".tmp")
+                {
+                    files.emplace_back(std::stoull(name.substr(0, 16)), suffix);
+                }
+            }
+        }
+        closedir(dir);
+
+        std::sort(files.begin(), files.end());
+        return files;
+    }
+
+    /// Recover our state from the directory.
+    void open()
+    {
+        std::vector<SegmentSPtr> segments {};
+        std::vector<uint64_t> logs {};
+        for(const auto& file : listFiles())
+        {
+            mNextSeq = std::max(mNextSeq, file.first + 1);
+            if(file.second == ".seg")
+            {
+                segments.push_back(readSegment(file.first));
+            }
+            else if(file.second == ".wal")
+            {
+                logs.push_back(file.first);
+            }
+            else
+            {
+                // Interrupted segment write
+                std::remove(path(file.first, file.second).c_str());
+            }
+        }
+
+        // Newest first, dropping anything superseded by an interrupted compaction
+        std::reverse(segments.begin(), segments.end());
+        for(const SegmentSPtr& segment : segments)
+        {
+            if(!mSegments.empty() && segment->mSeq >= mSegments.back()->mBaseSeq)
+            {
+                std::remove(segment->mPath.c_str());
+                continue;
+            }
+            mSegments.push_back(segment);
+        }
+
+        // Replay any logs that weren't yet written out as segments
+        const uint64_t lastSegment { mSegments.empty() ? 0 : mSegments.front()->mSeq };
+        for(uint64_t seq : logs)
+        {
+            if(seq <= lastSegment)
+            {
+                std::remove(path(seq, ".wal").c_str());
+                continue;
+            }
+            replayLog(seq);
+            mMemtableLogs.push_back(seq);
+        }
+
+        startLog();
+    }
+
+    /// Read the metadata for a segment file.
+    SegmentSPtr readSegment(uint64_t seq) const
+    {
+        std::shared_ptr<Segment> segment { std::make_shared<Segment>() };
+        segment->mSeq = seq;
+        segment->mPath = path(seq, ".seg");
+
+        std::ifstream file { segment->mPath, std::ios::binary | std::ios::ate };
+        const std::streamoff size { file ? static_cast<std::streamoff>(file.tellg()) : 0 };
+        SegmentTrailer trailer {};
+        if(size >= static_cast<std::streamoff>(sizeof(trailer)))
+        {
+            file.seekg(size - static_cast<std::streamoff>(sizeof(trailer)));
+            file.read(reinterpret_cast<char*>(&trailer), sizeof(trailer));
+        }
+        if(!file || memcmp(trailer.mMagic, SEGMENT_MAGIC, sizeof(trailer.mMagic)) != 0 ||
+           trailer.mIndexOffset > trailer.mBloomOffset ||
+           trailer.mBloomOffset > static_cast<uint64_t>(size) - sizeof(trailer))
+        {
+            throw std::runtime_error("Corrupt segment file " + segment->mPath);
+        }
+
+        std::string meta (static_cast<size_t>(size - sizeof(trailer) - trailer.mIndexOffset), '\0');
+        file.seekg(static_cast<std::streamoff>(trailer.mIndexOffset));
+        file.read(&meta[0], static_cast<std::streamsize>(meta.size()));
+        boost::crc_32_type crc {};
+        crc.process_bytes(meta.data(), meta.size());
+        if(!file || crc.checksum() != trailer.mCrc)
+        {
+            throw std::runtime_error("Corrupt segment file " + segment->mPath);
+        }
+
+        size_t pos {0};
+        const uint32_t indexCount { extract<uint32_t>(meta, pos) };
+        for(uint32_t i = 0; i < indexCount; ++i)
+        {
+            const uint32_t nameLen { extract<uint32_t>(meta, pos) };
+            if(meta.size() - pos < nameLen)
+            {
+                throw std::runtime_error("Corrupt segment file " + segment->mPath);
+            }
+            std::string name { meta.substr(pos, nameLen) };
+            pos += nameLen;
+            segment->mIndex.emplace_back(std::move(name), extract<uint64_t>(meta, pos));
+        }
+
+        const size_t bloomPos { static_cast<size_t>(trailer.mBloomOffset - trailer.mIndexOffset) };
+        segment->mBloom.mNumHashes = trailer.mNumHashes;
+        segment->mBloom.mBits.assign(meta.begin() + bloomPos, meta.end());
+        segment->mBaseSeq = trailer.mBaseSeq;
+        segment->mDataEnd = trailer.mIndexOffset;
+        segment->mFileSize = static_cast<uint64_t>(size);
+        return segment;
+    }
+
+    /**
+    * Write a new segment to a temporary file.
+    * @param seq Sequence number for the segment.
+    * @param baseSeq Lowest sequence number the segment supersedes.
+    * @param producer Supplies the entries, in name order.
+    * @return The new segment.
+    */
+    SegmentSPtr writeSegment(uint64_t seq, uint64_t baseSeq, const std::function<void(const EntrySink&)>& producer)
+    {
+        std::shared_ptr<Segment> segment { std::make_shared<Segment>() };
+        segment->mSeq = seq;
+        segment->mBaseSeq = baseSeq;
+        segment->mPath = path(seq, ".seg");
+
+        const std::string tmpName { path(seq, ".tmp") };
+        std::ofstream file { tmpName, std::ios::binary | std::ios::trunc };
+        if(!file)
+        {
+            throw std::runtime_error("Failed to create file " + tmpName + " for writing");
+        }
+
+        uint64_t offset {0};
+        std::vector<uint64_t> hashes {};
+        producer([&](const std::string& name, const Entry& entry)
+        {
+            if(hashes.size() % SPARSE_INTERVAL == 0)
+            {
+                segment->mIndex.emplace_back(name, offset);
+            }
+            hashes.push_back(hashName(name));
+
+            std::string header {};
+            append<uint8_t>(header, entry.mLive ? 1 : 0);
+            append<uint32_t>(header, static_cast<uint32_t>(name.size()));
+            append<uint32_t>(header, static_cast<uint32_t>(entry.mPayload.size()));
+            append<uint32_t>(header, entryCrc(name, entry.mPayload));
+            file << header << name << entry.mPayload;
+            offset += header.size() + name.size() + entry.mPayload.size();
+        });
+
+        segment->mBloom.init(hashes.size());
+        for(uint64_t hash : hashes)
+        {
+            segment->mBloom.add(hash);
+        }
+
+        std::string meta {};
+        append<uint32_t>(meta, static_cast<uint32_t>(segment->mIndex.size()));
+        for(const auto& entry : segment->mIndex)
+        {
+            append<uint32_t>(meta, static_cast<uint32_t>(entry.first.size()));
+            meta.append(entry.first);
+            append<uint64_t>(meta, entry.second);
+        }
+        const uint64_t bloomOffset { offset + meta.size() };
+        meta.append(segment->mBloom.mBits.begin(), segment->mBloom.mBits.end());
+
+        SegmentTrailer trailer {};
+        trailer.mIndexOffset = offset;
+        trailer.mBloomOffset = bloomOffset;
+        trailer.mCount = hashes.size();
+        trailer.mBaseSeq = baseSeq;
+        boost::crc_32_type crc {};
+        crc.process_bytes(meta.data(), meta.size());
+        trailer.mCrc = crc.checksum();
+        trailer.mNumHashes = segment->mBloom.mNumHashes;
+        memcpy(trailer.mMagic, SEGMENT_MAGIC, sizeof(trailer.mMagic));
+
+        file << meta;
+        file.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+        if(!file.flush())
+        {
+            file.close();
+            std::remove(tmpName.c_str());
+            throw std::runtime_error("Failed to write segment file " + tmpName);
+        }
+
+        segment->mDataEnd = offset;
+        segment->mFileSize = offset + meta.size() + sizeof(trailer);
+        return segment;
+    }
+
+    /// Rename a file into place.
+    void installFile(uint64_t seq, const std::string& from, const std::string& to) const
+    {
+        if(std::rename(path(seq, from).c_str(), path(seq, to).c_str()) != 0)
+        {
+            throw std::runtime_error("Failed to install file " + path(seq, to));
+        }
+    }
+
+    /// Start a new write-ahead log for the memtable.
+    void startLog()
+    {
+        const uint64_t seq { mNextSeq++ };
+        mLog.close();
+        mLog.clear();
+        mLog.open(path(seq, ".wal"), std::ios::binary | std::ios::trunc);
+        if(!mLog)
+        {
+            throw std::runtime_error("Failed to create file " + path(seq, ".wal") + " for writing");
+        }
+        mMemtableLogs.push_back(seq);
+    }
+
+    /// Replay a write-ahead log into the memtable. A torn record ends the log.
+    void replayLog(uint64_t seq)
+    {
+        std::ifstream file { path(seq, ".wal"), std::ios::binary };
+        while(file)
+        {
+            char op {};
+            uint32_t nameLen {};
+            uint32_t payloadLen {};
+            uint32_t crc {};
+            file.read(&op, sizeof(op));
+            file.read(reinterpret_cast<char*>(&nameLen), sizeof(nameLen));
+            file.read(reinterpret_cast<char*>(&payloadLen), sizeof(payloadLen));
+            file.read(reinterpret_cast<char*>(&crc), sizeof(crc));
+            if(!file)
+            {
+                break;
+            }
+
+            std::string name (nameLen, '\0');
+            std::string payload (payloadLen, '\0');
+            file.read(&name[0], nameLen);
+            file.read(&payload[0], payloadLen);
+            if(!file || entryCrc(name, payload) != crc)
+            {
+                break;
+            }
+
+            Entry& entry { mMemtable[name] };
+            entry.mLive = (op == OP_SAVE);
+            entry.mPayload = entry.mLive ? std::move(payload) : std::string {};
+            mMemtableSize += name.size() + entry.mPayload.size();
+        }
+    }
+
+    /// Get our open write-ahead log, checking it is still usable.
+    std::ofstream& log()
+    {
+        if(!mLog)
+        {
+            throw std::runtime_error("Failed to write to log in " + mDirectory);
+        }
+        return mLog;
+    }
+
+    /// Append a record to the write-ahead log. Called with our mutex held.
+    void logRecord(char op, const std::string& name, const std::string& payload)
+    {
+        std::string header {};
+        append<char>(header, op);
+        append<uint32_t>(header, static_cast<uint32_t>(name.size()));
+        append<uint32_t>(header, static_cast<uint32_t>(payload.size()));
+        append<uint32_t>(header, entryCrc(name, payload));
+        log() << header << name << payload;
+
+        mStats.mLogicalBytes += name.size() + payload.size();
+        mStats.mPhysicalBytes += header.size() + name.size() + payload.size();
+        mMemtableSize += name.size() + payload.size();
+    }
+
+    /// Add or replace a secret. Called with our mutex held.
+    void put(const std::string& name, const std::string& payload)
+    {
+        logRecord(OP_SAVE, name, payload);
+        mMemtable[name] = Entry { payload, true };
+    }
+
+    /// Remove a secret. Called with our mutex held.
+    void erase(const std::string& name)
+    {
+        const bool onDisk { mayBeOnDisk(name) };
+        const auto it = mMemtable.find(name);
+        if(it == mMemtable.end() && !onDisk)
+        {
+            // Never stored
+            return;
+        }
+
+        logRecord(OP_REMOVE, name, {});
+        if(onDisk)
+        {
+            mMemtable[name] = Entry {};
+        }
+        else
+        {
+            // Only ever lived in the memtable, so no tombstone is needed
+            mMemtable.erase(it);
+        }
+    }
+
+    /// Could the name be held anywhere but the mutable memtable?
+    bool mayBeOnDisk(const std::string& name) const
+    {
+        if(mImmutable && mImmutable->count(name))
+        {
+            return true;
+        }
+        for(const SegmentSPtr& segment : mSegments)
+        {
+            if(segment->mBloom.mayContain(name))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Find the newest entry for a name. Called with our mutex held.
+    bool find(const std::string& name, Entry& entry) const
+    {
+        auto it = mMemtable.find(name);
+        if(it != mMemtable.end())
+        {
+            entry = it->second;
+            return true;
+        }
+        if(mImmutable)
+        {
+            it = mImmutable->find(name);
+            if(it != mImmutable->end())
+            {
+                entry = it->second;
+                return true;
+            }
+        }
+
+        for(const SegmentSPtr& segment : mSegments)
+        {
+            if(!segment->mBloom.mayContain(name))
+            {
+                continue;
+            }
+
+            // Scan forward from the closest indexed name
+            auto indexIt = std::upper_bound(segment->mIndex.begin(), segment->mIndex.end(), name,
+                [](const std::string& lhs, const std::pair<std::string, uint64_t>& rhs) { return lhs < rhs.first; });
+            if(indexIt == segment->mIndex.begin())
+            {
+                continue;
+            }
+
+            SegmentReader reader { *segment };
+            reader.seek(std::prev(indexIt)->second);
+            for(size_t i = 0; i < SPARSE_INTERVAL && reader.next() && reader.mName <= name; ++i)
+            {
+                if(reader.mName == name)
+                {
+                    entry = std::move(reader.mEntry);
+                    return true;
+                }
+            }
+        }
+
+        return false;
+    }
+
+    /// Block while the memtable is full and the previous one is still being written out.
+    void waitForRoom(boost::unique_lock<boost::shared_mutex>& lck)
+    {
+        mFlushedCv.wait(lck, [this]{ return !mImmutable || mMemtableSize < mMemtableBytes || mFailure || mStopping; });
+        rethrowFailure();
+    }
+
+    /// Rethrow any failure from the background thread.
+    void rethrowFailure()
+    {
+        if(mFailure)
+        {
+            std::rethrow_exception(mFailure);
+        }
+    }
+
+    /// Hand the memtable to the background thread if it's full.
+    void maybeRotate()
+    {
+        if(mMemtableSize >= mMemtableBytes && !mImmutable)
+        {
+            rotate();
+        }
+    }
+
+    /// Make the memtable immutable and start a new one.
+    void rotate()
+    {
+        mImmutable = std::make_shared<const Memtable>(std::move(mMemtable));
+        mImmutableLogs.swap(mMemtableLogs);
+        mMemtable.clear();
+        mMemtableLogs.clear();
+        mMemtableSize = 0;
+        startLog();
+        mWorkCv.notify_one();
+    }
+
+    /// Body of the background flush and compaction thread.
+    void backgroundLoop()
+    {
+        while(true)
+        {
+            {
+                boost::unique_lock<boost::shared_mutex> lck { mMtx };
+                mWorkCv.wait(lck, [this]{ return mStopping ||
+                    (!mFailure && (mImmutable || mSegments.size() > mMaxSegments)); });
+                if(mStopping)
+                {
+                    break;
+                }
+            }
+
+            try
+            {
+                std::lock_guard<std::mutex> maintLck { mMaintMtx };
+                flushImmutable();
+                bool compact {};
+                {
+                    boost::shared_lock<boost::shared_mutex> lck { mMtx };
+                    compact = mSegments.size() > mMaxSegments;
+                }
+                if(compact)
+                {
+                    compactNL();
+                }
+            }
+            catch(...)
+            {
+                boost::unique_lock<boost::shared_mutex> lck { mMtx };
+                mFailure = std::current_exception();
+                mFlushedCv.notify_all();
+            }
+        }
+    }
+
+    /// Write the immutable memtable out as a segment. Called with the maintenance mutex held.
+    void flushImmutable()
+    {
+        MemtableSPtr memtable {};
+        uint64_t seq {};
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            if(!mImmutable)
+            {
+                return;
+            }
+            memtable = mImmutable;
+            seq = mImmutableLogs.back();
+        }
+
+        // The segment takes the sequence number of the memtable's newest log
+        SegmentSPtr segment { writeSegment(seq, seq, [&memtable](const EntrySink& sink)
+        {
+            for(const auto& entry : *memtable)
+            {
+                sink(entry.first, entry.second);
+            }
+        }) };
+
+        std::vector<uint64_t> logs {};
+        {
+            boost::unique_lock<boost::shared_mutex> lck { mMtx };
+            installFile(seq, ".tmp", ".seg");
+            mSegments.insert(mSegments.begin(), segment);
+            mImmutable.reset();
+            logs.swap(mImmutableLogs);
+            mStats.mPhysicalBytes += segment->mFileSize;
+            ++mStats.mFlushes;
+        }
+        mFlushedCv.notify_all();
+
+        for(uint64_t log : logs)
+        {
+            std::remove(path(log, ".wal").c_str());
+        }
+    }
+
+    /// Merge all segments into one. Called with the maintenance mutex held.
+    void compactNL()
+    {
+        std::vector<SegmentSPtr> inputs {};
+        std::vector<SegmentReaderPtr> readers {};
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            inputs = mSegments;
+            for(const SegmentSPtr& segment : inputs)
+            {
+                readers.emplace_back(new SegmentReader { *segment });
+            }
+        }
+        if(inputs.size() < 2)
+        {
+            return;
+        }
+
+        // Nothing older than these inputs exists, so tombstones can go
+        const uint64_t seq { inputs.front()->mSeq };
+        SegmentSPtr output { writeSegment(seq, inputs.back()->mBaseSeq, [&readers](const EntrySink& sink)
+        {
+            mergeSegments(readers, [&sink](const std::string& name, Entry& entry)
+            {
+                if(entry.mLive)
+                {
+                    sink(name, entry);
+                }
+            });
+        }) };
+        readers.clear();
+
+        {
+            // New flushes only ever add to the front, so the inputs are the tail
+            boost::unique_lock<boost::shared_mutex> lck { mMtx };
+            installFile(seq, ".tmp", ".seg");
+            mSegments.resize(mSegments.size() - inputs.size());
+            mSegments.push_back(output);
+            mStats.mPhysicalBytes += output->mFileSize;
+            ++mStats.mCompactions;
+        }
+
+        for(size_t i = 1; i < inputs.size(); ++i)
+        {
+            std::remove(inputs[i]->mPath.c_str());
+        }
+    }
+
+    /// The secret store we load into.
+    SecretStore& mSecretStore;
+
+    /// Directory holding our files.
+    std::string mDirectory {};
+
+    /// Memtable size at which it is written out.
+    size_t mMemtableBytes {};
+
+    /// Number of segments that triggers a compaction.
+    size_t mMaxSegments {};
+
+    /// A mutex for our in-memory state. Lookups share it.
+    mutable boost::shared_mutex mMtx {};
+
+    /// Serialises flushing, compaction and replacement.
+    std::mutex mMaintMtx {};
+
+    /// Signalled when there is work for the background thread.
+    std::condition_variable_any mWorkCv {};
+    /// Signalled when the background thread has written out a memtable.
+    std::condition_variable_any mFlushedCv {};
+
+    /// The memtable taking writes, and its logs.
+    Memtable mMemtable {};
+    std::vector<uint64_t> mMemtableLogs {};
+    size_t mMemtableSize {0};
+
+    /// The previous memtable while it is being written out, and its logs.
+    MemtableSPtr mImmutable {};
+    std::vector<uint64_t> mImmutableLogs {};
+
+    /// Segments, newest first.
+    std::vector<SegmentSPtr> mSegments {};
+
+    /// Log the memtable writes go to.
+    std::ofstream mLog {};
+
+    /// Next file sequence number.
+    uint64_t mNextSeq {1};
+
+    /// Our statistics.
+    Stats mStats {};
+
+    /// Failure from the background thread.
+    std::exception_ptr mFailure {};
+
+    /// Set when we are shutting down.
+    bool mStopping {false};
+
+    /// The background flush and compaction thread.
+    std::thread mBackground {};
+};
+
+}}
+
+#endif
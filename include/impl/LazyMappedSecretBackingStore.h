@@ -0,0 +1,372 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A memory-mapped secret backing store that loads secrets on demand.
+ *
+ * At startup only the name index is built, from the record headers in the
+ * mapped file; no secret is decoded or handed to the secret store. A secret
+ * is turned into a Secret, decrypted with the master password and added to
+ * the secret store the first time it is asked for through getSecret(), and
+ * names expected to be needed soon can be prefetched on a background thread.
+ *
+ * Secrets that have not been loaded yet are invisible to the secret store,
+ * so they have to be removed through removeStoredSecret() and the master
+ * password changed through setMasterPassword() here, which re-encrypts them
+ * along with everything the secret store holds.
+ */
+
+#ifndef _NCHAIN_SDK_LAZY_MAPPED_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_LAZY_MAPPED_SECRET_BACKING_STORE_H_
+
+#include <impl/MappedSecretBackingStore.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <thread>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of LazyMappedSecretBackingStore pointer type
+class LazyMappedSecretBackingStore;
+/// Unique pointer type
+using LazyMappedSecretBackingStorePtr = std::unique_ptr<LazyMappedSecretBackingStore>;
+/// Shared pointer type
+using LazyMappedSecretBackingStoreSPtr = std::shared_ptr<LazyMappedSecretBackingStore>;
+
+/// A memory-mapped secret DB that materialises secrets on first use.
+class LazyMappedSecretBackingStore : public MappedSecretBackingStore
+{
+  public:
+
+    /**
+    * Constructor.
+    * @param fileName Fully qualified filename of file to persist to.
+    * @param passwd The secret store's master password, needed to decrypt
+    * secrets as they are loaded.
+    * @param init How to initialise the backing file.
+    * @param initialSize Size to create a new file with. The file grows as required.
+    * @param store The secret store to load secrets into.
+    */
+    LazyMappedSecretBackingStore(const std::string& fileName,
+                                 const memory::SecureByteVec& passwd,
+                                 InitialisationMode init = InitialisationMode::INIT_NONE,
+                                 uint64_t initialSize = DEFAULT_INITIAL_SIZE,
+                                 SecretStore& store = SecretStore::get())
+    : MappedSecretBackingStore{fileName, init, initialSize, store}, mPasswd{passwd}
+    {
+        if(mPasswd.empty())
+        {
+            throw std::runtime_error("Lazy mapped store requires the master password");
+        }
+    }
+
+    /// Destructor. Stops any prefetching.
+    ~LazyMappedSecretBackingStore() override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mPrefetchMtx };
+            mStopping = true;
+            mPrefetchQueue.clear();
+        }
+        mPrefetchCv.notify_all();
+        if(mPrefetcher.joinable())
+        {
+            mPrefetcher.join();
+        }
+    }
+
+    /**
+    * Called by the secret store when this backing store is set. Does not
+    * load anything; secrets are loaded when first requested.
+    */
+    void loadAll() override
+    {
+    }
+
+    /**
+    * Save a new secret. Secrets we are ourselves adding to the secret store
+    * are already in the file and are not written again.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        if(secret.get() != mAdmitting.load())
+        {
+            MappedSecretBackingStore::saveSecret(secret);
+        }
+    }
+
+    /**
+    * Replace the contents of the backing store. Secrets not yet loaded are
+    * kept, re-encrypted under the new master password, which is only known
+    * if it is being set through our setMasterPassword().
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::set<std::string> names {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            names.insert(secret->getName());
+        }
+
+        std::vector<SecretSPtr> contents { secrets };
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            for(const auto& entry : mIndex)
+            {
+                if(!names.count(entry.first))
+                {
+                    contents.push_back(readSecret(entry.first, entry.second));
+                }
+            }
+        }
+
+        if(contents.size() > secrets.size())
+        {
+            std::lock_guard<std::mutex> lck { mPasswdMtx };
+            if(mNewPasswd.empty())
+            {
+                throw std::runtime_error("Secrets not yet loaded can't be re-encrypted; "
+                                         "set the master password through the lazy mapped store");
+            }
+            for(size_t i = secrets.size(); i < contents.size(); ++i)
+            {
+                contents[i]->decryptSecret(mPasswd);
+                contents[i]->encryptSecret(mNewPasswd);
+            }
+        }
+
+        MappedSecretBackingStore::replaceAll(contents);
+    }
+
+    /**
+    * Set a new master password on the secret store, re-encrypting the
+    * secrets not yet loaded along with the rest.
+    * @param passwd The new master password.
+    */
+    void setMasterPassword(const memory::SecureByteVec& passwd)
+    {
+        // Nothing is loaded or removed underneath us while we rewrite
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        {
+            std::lock_guard<std::mutex> lck { mPasswdMtx };
+            mNewPasswd = passwd;
+        }
+
+        try
+        {
+            mSecretStore.setMasterPassword(passwd);
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lck { mPasswdMtx };
+            mNewPasswd.clear();
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lck { mPasswdMtx };
+        mPasswd = passwd;
+        mNewPasswd.clear();
+    }
+
+    /**
+    * Remove a secret, whether or not it has been loaded yet.
+    * @param name The name of the secret to remove.
+    */
+    void removeStoredSecret(const std::string& name)
+    {
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        if(mSecretStore.getSecret(name))
+        {
+            mSecretStore.removeSecret(name);
+        }
+        else
+        {
+            MappedSecretBackingStore::removeSecret(name);
+        }
+    }
+
+    /**
+    * Load every secret not yet loaded into the secret store.
+    */
+    void loadRemaining()
+    {
+        for(const std::string& name : getAllSecretNames())
+        {
+            getSecret(name);
+        }
+    }
+
+    /**
+    * Fetch secret by name, loading it from the file into the secret store
+    * if this is the first time it has been asked for. Use this in place of
+    * SecretStore::getSecret() for secrets that may not have been loaded yet.
+    * @param name The name of the secret to lookup.
+    * @return A pointer to the requested secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name)
+    {
+        SecretSPtr secret { mSecretStore.getSecret(name) };
+        if(secret)
+        {
+            return secret;
+        }
+
+        // Only one thread materialises at a time, so a secret is never
+        // loaded twice.
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        secret = mSecretStore.getSecret(name);
+        if(secret)
+        {
+            return secret;
+        }
+
+        {
+            boost::shared_lock<boost::shared_mutex> lck { mMtx };
+            const uint64_t offset { offsetOf(name) };
+            if(!offset)
+            {
+                return nullptr;
+            }
+            secret = readSecret(name, offset);
+        }
+
+        {
+            std::lock_guard<std::mutex> lck { mPasswdMtx };
+            secret->decryptSecret(mPasswd);
+        }
+
+        // Add through the locked API; it hands the secret back to
+        // saveSecret(), which knows not to write it again
+        mAdmitting = secret.get();
+        try
+        {
+            mSecretStore.addSecret(secret);
+        }
+        catch(...)
+        {
+            mAdmitting = nullptr;
+            // Someone else may have added it in the meantime
+            SecretSPtr existing { mSecretStore.getSecret(name) };
+            if(!existing)
+            {
+                throw;
+            }
+            return existing;
+        }
+        mAdmitting = nullptr;
+        return secret;
+    }
+
+    /**
+    * Lookup the names of secrets according to metadata, without loading them.
+    * @param key Metadata key to lookup.
+    * @param value Metadata value to lookup.
+    * @return A list of names of secrets that have metadata key=value.
+    */
+    std::vector<std::string> getAllSecretNamesWhere(const std::string& key, const std::string& value) const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        std::vector<std::string> names {};
+        for(const auto& entry : mIndex)
+        {
+            const MetaDataCollection::MetaMap meta { decodeMetaData(entry.second) };
+            const auto it = meta.find(key);
+            if(it != meta.end() && it->second == value)
+            {
+                names.push_back(entry.first);
+            }
+        }
+        return names;
+    }
+
+    /**
+    * Load the given secrets in the background, ahead of them being asked
+    * for. Names that are unknown or already loaded are ignored.
+    * @param names The names of the secrets to load.
+    */
+    void prefetch(const std::vector<std::string>& names)
+    {
+        std::lock_guard<std::mutex> lck { mPrefetchMtx };
+        if(mStopping)
+        {
+            return;
+        }
+
+        mPrefetchQueue.insert(mPrefetchQueue.end(), names.begin(), names.end());
+        if(!mPrefetcher.joinable())
+        {
+            mPrefetcher = std::thread { &LazyMappedSecretBackingStore::prefetchLoop, this };
+        }
+        mPrefetchCv.notify_one();
+    }
+
+  private:
+
+    /// Body of the background prefetch thread.
+    void prefetchLoop()
+    {
+        std::unique_lock<std::mutex> lck { mPrefetchMtx };
+        while(true)
+        {
+            mPrefetchCv.wait(lck, [this]{ return mStopping || !mPrefetchQueue.empty(); });
+            if(mStopping)
+            {
+                break;
+            }
+
+            const std::string name { std::move(mPrefetchQueue.front()) };
+            mPrefetchQueue.pop_front();
+            lck.unlock();
+            try
+            {
+                getSecret(name);
+            }
+            catch(...)
+            {
+                // Prefetching is best effort, a failure will be reported
+                // again when the secret is actually requested.
+            }
+            lck.lock();
+        }
+    }
+
+    /// Serialises materialisation of secrets.
+    std::mutex mLoadMtx {};
+
+    /// The secret we are currently adding to the secret store.
+    std::atomic<const Secret*> mAdmitting {nullptr};
+
+    /// A mutex for the master passwords.
+    std::mutex mPasswdMtx {};
+
+    /// The master password the file is encrypted under.
+    memory::SecureByteVec mPasswd {};
+
+    /// The master password being set through us, if any.
+    memory::SecureByteVec mNewPasswd {};
+
+    /// A mutex for our prefetch state.
+    std::mutex mPrefetchMtx {};
+
+    /// Signalled when there are names to prefetch.
+    std::condition_variable mPrefetchCv {};
+
+    /// Names waiting to be prefetched.
+    std::deque<std::string> mPrefetchQueue {};
+
+    /// Set when we are shutting down.
+    bool mStopping {false};
+
+    /// The background prefetch thread, started on first use.
+    std::thread mPrefetcher {};
+};
+
+}}
+
+#endif
@@ -0,0 +1,668 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that ships every mutation to a hot
+ * standby process over a Unix domain socket.
+ *
+ * The primary listens on a socket path and accepts one standby at a time.
+ * A newly connected standby is first sent the full contents of the store
+ * and then each mutation as it is persisted, in order. Shipping happens on
+ * a background thread so writers are never held up by the standby. If the
+ * standby falls too far behind it is disconnected, and it resynchronises
+ * from scratch when it reconnects. Secrets are shipped in their serialised,
+ * encrypted form. See SecretStoreStandby for the receiving end.
+ *
+ * When the secret store loads, the copy of its contents we send a standby
+ * is taken later by the shipping thread, outside the store's lock, just
+ * before that copy is needed.
+ */
+
+#ifndef _NCHAIN_SDK_LOG_SHIPPING_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_LOG_SHIPPING_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretStoreSeed.h>
+#include <impl/JSONSerialiser.h>
+#include <interface/SecretStore.h>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+namespace nakasendo { namespace impl {
+
+/// Framing of records in a shipped secret log.
+struct SecretLogRecord
+{
+    /// Record types.
+    static constexpr char OP_SET { 'S' };           // Add or overwrite a secret
+    static constexpr char OP_UPDATE { 'U' };        // Replace a secret, possibly renaming it
+    static constexpr char OP_REMOVE { 'R' };        // Remove a secret
+    static constexpr char OP_SYNC_BEGIN { 'B' };    // A full copy of the store follows
+    static constexpr char OP_SYNC_END { 'E' };      // End of a full copy
+
+    /// Size of the fixed part of a record: length, type and name length.
+    static constexpr size_t HEADER_SIZE { 9 };
+
+    /**
+    * Build a record.
+    * @param op The record type.
+    * @param name The name of the secret the record is about.
+    * @param payload The serialised secret, if any.
+    * @return The framed record.
+    */
+    static std::string make(char op, const std::string& name, const std::string& payload)
+    {
+        std::string record {};
+        record.reserve(HEADER_SIZE + name.size() + payload.size());
+        putUInt32(record, static_cast<uint32_t>(HEADER_SIZE - 4 + name.size() + payload.size()));
+        record.push_back(op);
+        putUInt32(record, static_cast<uint32_t>(name.size()));
+        record.append(name);
+        record.append(payload);
+        return record;
+    }
+
+    /// Append a little-endian 32 bit value.
+    static void putUInt32(std::string& str, uint32_t val)
+    {
+        for(int i = 0; i < 4; ++i)
+        {
+            str.push_back(static_cast<char>((val >> (i * 8)) & 0xff));
+        }
+    }
+
+    /// Read a little-endian 32 bit value.
+    static uint32_t getUInt32(const char* data)
+    {
+        uint32_t val {0};
+        for(int i = 3; i >= 0; --i)
+        {
+            val = (val << 8) | static_cast<unsigned char>(data[i]);
+        }
+        return val;
+    }
+};
+
+/// Forward declaration of LogShippingSecretBackingStore pointer type
+class LogShippingSecretBackingStore;
+/// Unique pointer type
+using LogShippingSecretBackingStorePtr = std::unique_ptr<LogShippingSecretBackingStore>;
+/// Shared pointer type
+using LogShippingSecretBackingStoreSPtr = std::shared_ptr<LogShippingSecretBackingStore>;
+
+/// Log shipping wrapper around another secret backing store.
+class LogShippingSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /// Default number of records a standby can fall behind by before being dropped.
+    static constexpr size_t DEFAULT_MAX_BACKLOG { 64 * 1024 };
+
+    /// Shipping statistics.
+    struct Stats
+    {
+        /// Whether a standby is connected.
+        bool mConnected {false};
+        /// Number of full copies sent.
+        uint64_t mSyncs {0};
+        /// Number of records sent.
+        uint64_t mRecordsShipped {0};
+        /// Number of times a standby was dropped for falling behind.
+        uint64_t mOverflows {0};
+    };
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param socketPath Path of the Unix domain socket to listen on. Any
+    * existing file at this path is replaced.
+    * @param maxBacklog Number of records a standby can fall behind by.
+    * @param secretStore The secret store we ship the contents of.
+    */
+    LogShippingSecretBackingStore(const SecretBackingStoreSPtr& store,
+                                  const std::string& socketPath,
+                                  size_t maxBacklog = DEFAULT_MAX_BACKLOG,
+                                  SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore), mSocketPath{socketPath},
+      mMaxBacklog{maxBacklog ? maxBacklog : 1}
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Log shipping store requires a backing store to wrap");
+        }
+
+        listen();
+        mSender = std::thread { &LogShippingSecretBackingStore::senderLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    LogShippingSecretBackingStore(const LogShippingSecretBackingStore&) = delete;
+    LogShippingSecretBackingStore(LogShippingSecretBackingStore&&) = delete;
+    LogShippingSecretBackingStore& operator=(const LogShippingSecretBackingStore&) = delete;
+    LogShippingSecretBackingStore& operator=(LogShippingSecretBackingStore&&) = delete;
+
+    /// Destructor. Disconnects any standby, dropping whatever it has not
+    /// been sent yet, then stops listening.
+    ~LogShippingSecretBackingStore() override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mStopping = true;
+            if(mStandbyFd >= 0)
+            {
+                ::shutdown(mStandbyFd, SHUT_RDWR);
+            }
+        }
+        mWorkCv.notify_all();
+        if(mSender.joinable())
+        {
+            mSender.join();
+        }
+        ::close(mListenFd);
+        ::unlink(mSocketPath.c_str());
+    }
+
+    /**
+    * Get our shipping statistics.
+    * @return The current statistics.
+    */
+    Stats getStats() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        Stats stats { mStats };
+        stats.mConnected = mConnected;
+        return stats;
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        mStore->saveSecret(secret);
+        std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        set(secret->getName(), std::move(payload));
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->saveSecrets(secrets);
+        std::vector<std::string> payloads { serialiseAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            set(secrets[i]->getName(), std::move(payloads[i]));
+        }
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        mStore->updateSecret(name, secret);
+        std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        update(name, secret->getName(), std::move(payload));
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        mStore->removeSecret(name);
+        std::lock_guard<std::mutex> lck { mMtx };
+        remove(name);
+    }
+
+    /**
+    * Load all stored secrets. A connected standby is sent a fresh copy once
+    * the shipping thread has taken one from the secret store.
+    */
+    void loadAll() override
+    {
+        mStore->loadAll();
+        std::lock_guard<std::mutex> lck { mMtx };
+        mRecords.clear();
+        mSeed.reset();
+        if(mConnected)
+        {
+            mQueue.clear();
+            mBacklog = 0;
+            mWorkCv.notify_one();
+        }
+    }
+
+    /**
+    * Replace the contents of the backing store, and send the standby the
+    * new contents.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->replaceAll(secrets);
+        std::vector<std::string> payloads { serialiseAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.replaced();
+        resetContents(secrets, std::move(payloads));
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        impl::applyBatch(*mStore, batch);
+
+        std::vector<std::string> payloads {};
+        payloads.reserve(batch.size());
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            payloads.push_back(op.mSecret ? JSONSerialiser::serialise(*op.mSecret) : std::string {});
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        auto payload = payloads.begin();
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            switch(op.mType)
+            {
+                case SecretBackingStoreBatch::OpType::SAVE:
+                    set(op.mName, std::move(*payload));
+                    break;
+                case SecretBackingStoreBatch::OpType::UPDATE:
+                    update(op.mName, op.mSecret->getName(), std::move(*payload));
+                    break;
+                case SecretBackingStoreBatch::OpType::REMOVE:
+                    remove(op.mName);
+                    break;
+            }
+            ++payload;
+        }
+    }
+
+  private:
+
+    /// Serialise some secrets.
+    static std::vector<std::string> serialiseAll(const std::vector<SecretSPtr>& secrets)
+    {
+        std::vector<std::string> payloads {};
+        payloads.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            payloads.push_back(JSONSerialiser::serialise(*secret));
+        }
+        return payloads;
+    }
+
+    /// Record and ship an add. Called with our mutex held.
+    void set(const std::string& name, std::string&& payload)
+    {
+        mSeed.touch(name);
+        ship(SecretLogRecord::make(SecretLogRecord::OP_SET, name, payload));
+        mRecords[name] = std::move(payload);
+    }
+
+    /// Record and ship an update. Called with our mutex held.
+    void update(const std::string& name, const std::string& newName, std::string&& payload)
+    {
+        mSeed.touch(name);
+        mSeed.touch(newName);
+        ship(SecretLogRecord::make(SecretLogRecord::OP_UPDATE, name, payload));
+        mRecords.erase(name);
+        mRecords[newName] = std::move(payload);
+    }
+
+    /// Record and ship a removal. Called with our mutex held.
+    void remove(const std::string& name)
+    {
+        mSeed.touch(name);
+        ship(SecretLogRecord::make(SecretLogRecord::OP_REMOVE, name, {}));
+        mRecords.erase(name);
+    }
+
+    /// Replace everything we hold and ship a full copy. Called with our mutex held.
+    void resetContents(const std::vector<SecretSPtr>& secrets, std::vector<std::string>&& payloads)
+    {
+        mRecords.clear();
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            mRecords[secrets[i]->getName()] = std::move(payloads[i]);
+        }
+
+        if(mConnected)
+        {
+            mQueue.clear();
+            mBacklog = 0;
+            queueSync();
+            mWorkCv.notify_one();
+        }
+    }
+
+    /// Queue a record for a connected standby. Called with our mutex held.
+    void ship(std::string&& record)
+    {
+        if(!mConnected || mOverflowed || mSeed.needed())
+        {
+            // A standby that connects later, or is waiting for us to seed
+            // after a load, is sent a full copy
+            return;
+        }
+
+        if(mBacklog >= mMaxBacklog)
+        {
+            // Drop the standby; it resynchronises when it reconnects
+            mOverflowed = true;
+            mQueue.clear();
+            ++mStats.mOverflows;
+        }
+        else
+        {
+            mQueue.push_back(std::move(record));
+            ++mBacklog;
+        }
+        mWorkCv.notify_one();
+    }
+
+    /// Queue a full copy of our contents. Called with our mutex held.
+    void queueSync()
+    {
+        mQueue.push_back(SecretLogRecord::make(SecretLogRecord::OP_SYNC_BEGIN, {}, {}));
+        for(const auto& record : mRecords)
+        {
+            mQueue.push_back(SecretLogRecord::make(SecretLogRecord::OP_SET, record.first, record.second));
+        }
+        mQueue.push_back(SecretLogRecord::make(SecretLogRecord::OP_SYNC_END, {}, {}));
+        ++mStats.mSyncs;
+    }
+
+    /**
+    * Queue a full copy of our contents for a connected standby, first
+    * seeding them from the secret store if a load left them unseeded.
+    * Called with our mutex held by lck, which is released while seeding.
+    * @param lck Our lock.
+    * @return False if seeding failed.
+    */
+    bool syncStandby(std::unique_lock<std::mutex>& lck)
+    {
+        while(mSeed.needed())
+        {
+            lck.unlock();
+            try
+            {
+                ensureSeeded();
+            }
+            catch(...)
+            {
+                lck.lock();
+                return false;
+            }
+            lck.lock();
+        }
+
+        mQueue.clear();
+        mBacklog = 0;
+        queueSync();
+        return true;
+    }
+
+    /// Seed our records from the secret store if a load left them unseeded.
+    /// Called without our mutex, from the sending thread only.
+    void ensureSeeded()
+    {
+        using Payloads = std::vector<std::pair<std::string, std::string>>;
+        mSeed.seed(mMtx,
+            [this]()
+            {
+                Payloads payloads {};
+                for(const SecretSPtr& secret : mSecretStore.getAllSecrets())
+                {
+                    payloads.emplace_back(secret->getName(), JSONSerialiser::serialise(*secret));
+                }
+                return payloads;
+            },
+            [this](const Payloads& payloads)
+            {
+                for(const auto& payload : payloads)
+                {
+                    if(!mSeed.stale(payload.first))
+                    {
+                        mRecords[payload.first] = payload.second;
+                    }
+                }
+            });
+    }
+
+    /// Create our listening socket.
+    void listen()
+    {
+        sockaddr_un addr {};
+        if(mSocketPath.size() >= sizeof(addr.sun_path))
+        {
+            throw std::runtime_error("Socket path " + mSocketPath + " is too long");
+        }
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, mSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+        mListenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if(mListenFd < 0)
+        {
+            throw std::runtime_error("Failed to create socket for " + mSocketPath);
+        }
+
+        // Only our own user may connect. The socket is created with these
+        // permissions, so there is no window in which anyone else can.
+        ::unlink(mSocketPath.c_str());
+        const mode_t oldMask { ::umask(0177) };
+        const int res { ::bind(mListenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) };
+        ::umask(oldMask);
+        if(res != 0 || ::listen(mListenFd, 1) != 0)
+        {
+            ::close(mListenFd);
+            throw std::runtime_error("Failed to listen on " + mSocketPath);
+        }
+    }
+
+    /// Wait for a standby to connect. Returns -1 if we're stopping.
+    int acceptStandby()
+    {
+        while(true)
+        {
+            {
+                std::lock_guard<std::mutex> lck { mMtx };
+                if(mStopping)
+                {
+                    return -1;
+                }
+            }
+
+            pollfd pfd { mListenFd, POLLIN, 0 };
+            if(::poll(&pfd, 1, ACCEPT_POLL_MS) > 0)
+            {
+                const int fd { ::accept(mListenFd, nullptr, nullptr) };
+                if(fd >= 0)
+                {
+                    return fd;
+                }
+            }
+        }
+    }
+
+    /// Write all of a buffer to a standby. Gives up if the standby stops
+    /// reading and falls too far behind, or we're stopping.
+    bool sendAll(int fd, const std::string& buffer)
+    {
+        size_t sent {0};
+        while(sent < buffer.size())
+        {
+            const ssize_t res { ::send(fd, buffer.data() + sent, buffer.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT) };
+            if(res >= 0)
+            {
+                sent += static_cast<size_t>(res);
+                continue;
+            }
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return false;
+            }
+
+            pollfd pfd { fd, POLLOUT, 0 };
+            if(::poll(&pfd, 1, SEND_POLL_MS) <= 0)
+            {
+                std::lock_guard<std::mutex> lck { mMtx };
+                if(mStopping || mOverflowed)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /// Body of the sending thread.
+    void senderLoop()
+    {
+        while(true)
+        {
+            const int fd { acceptStandby() };
+            if(fd < 0)
+            {
+                return;
+            }
+
+            std::unique_lock<std::mutex> lck { mMtx };
+            mStandbyFd = fd;
+            mConnected = true;
+            mOverflowed = false;
+            bool ok { syncStandby(lck) };
+
+            while(ok)
+            {
+                mWorkCv.wait(lck, [this]{ return mStopping || mOverflowed || mSeed.needed() || !mQueue.empty(); });
+                if(mSeed.needed() && !mStopping && !mOverflowed)
+                {
+                    // Reloaded; send a fresh copy
+                    ok = syncStandby(lck);
+                    continue;
+                }
+                if(mStopping || mOverflowed || mQueue.empty())
+                {
+                    break;
+                }
+
+                // Coalesce everything queued into one write
+                std::string buffer {};
+                size_t numRecords { mQueue.size() };
+                for(const std::string& record : mQueue)
+                {
+                    buffer.append(record);
+                }
+                mQueue.clear();
+                mBacklog = 0;
+
+                lck.unlock();
+                ok = sendAll(fd, buffer);
+                lck.lock();
+                if(ok)
+                {
+                    mStats.mRecordsShipped += numRecords;
+                }
+            }
+
+            mConnected = false;
+            mStandbyFd = -1;
+            mQueue.clear();
+            mBacklog = 0;
+            lck.unlock();
+            ::close(fd);
+        }
+    }
+
+    /// How long to wait for a standby before checking whether we're stopping.
+    static constexpr int ACCEPT_POLL_MS { 100 };
+
+    /// How long to wait for a standby to read before checking whether it
+    /// has fallen too far behind or we're stopping.
+    static constexpr int SEND_POLL_MS { 100 };
+
+    /// A mutex for our state.
+    mutable std::mutex mMtx {};
+
+    /// Signalled when there is something to ship, or we're stopping.
+    std::condition_variable mWorkCv {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store we ship the contents of.
+    SecretStore& mSecretStore;
+
+    /// Path of our socket.
+    std::string mSocketPath {};
+
+    /// Records a standby can fall behind by.
+    size_t mMaxBacklog {};
+
+    /// Our listening socket.
+    int mListenFd {-1};
+
+    /// The connected standby's socket, if any.
+    int mStandbyFd {-1};
+
+    /// Serialised secrets by name, for sending to a newly connected standby.
+    std::unordered_map<std::string, std::string> mRecords {};
+
+    /// Seeds our records after a load.
+    SecretStoreSeed mSeed {};
+
+    /// Records waiting to be shipped, in order.
+    std::vector<std::string> mQueue {};
+
+    /// Number of queued records, not counting full copies.
+    size_t mBacklog {0};
+
+    /// Whether a standby is connected, and whether it has fallen too far behind.
+    bool mConnected {false};
+    bool mOverflowed {false};
+
+    /// Set to stop the sending thread.
+    bool mStopping {false};
+
+    /// Our statistics.
+    Stats mStats {};
+
+    /// The sending thread.
+    std::thread mSender {};
+};
+
+}}
+
+#endif
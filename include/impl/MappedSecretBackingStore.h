@@ -0,0 +1,908 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * An implementation of a secret backing store that keeps secrets in a
+ * binary, memory-mapped file.
+ *
+ * The file holds a fixed header followed by length-prefixed records. Each
+ * record carries the secret name, its metadata and the serialised
+ * (encrypted) secret, and can be read straight from the mapping. Removed
+ * and superseded records are put on a free list and reused, so a single
+ * update only touches the bytes of that record. Each call flushes the
+ * records it wrote with a single msync before freeing the ones they
+ * supersede, so a batch of any size costs two flushes rather than one per
+ * record.
+ *
+ * File layout (host byte order, all records 8 byte aligned):
+ *   FileHeader
+ *   RecordHeader | name | metadata | payload | padding
+ *   RecordHeader | name | metadata | payload | padding
+ *   ...
+ * Metadata is encoded as a sequence of (uint32 length, bytes) pairs,
+ * alternating between key and value.
+ */
+
+#ifndef _NCHAIN_SDK_MAPPED_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_MAPPED_SECRET_BACKING_STORE_H_
+
+#include <impl/JSONSecretBackingStore.h>
+#include <impl/JSONSerialiser.h>
+#include <impl/ParallelSecretLoader.h>
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretRecordSource.h>
+#include <interface/SecretStore.h>
+
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of MappedSecretBackingStore pointer type
+class MappedSecretBackingStore;
+/// Unique pointer type
+using MappedSecretBackingStorePtr = std::unique_ptr<MappedSecretBackingStore>;
+/// Shared pointer type
+using MappedSecretBackingStoreSPtr = std::shared_ptr<MappedSecretBackingStore>;
+
+/// A binary memory-mapped file based secret DB.
+class MappedSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore, public SecretRecordSource
+{
+  public:
+
+    /// Initialisation modes for the backing store file.
+    using InitialisationMode = JSONSecretBackingStore::InitialisationMode;
+
+    /// Default size of a newly created file.
+    static constexpr uint64_t DEFAULT_INITIAL_SIZE { 1024 * 1024 };
+
+    /**
+    * Constructor.
+    * @param fileName Fully qualified filename of file to persist to.
+    * @param init How to initialise the backing file.
+    * @param initialSize Size to create a new file with. The file grows as required.
+    * @param store The secret store to load secrets into.
+    */
+    MappedSecretBackingStore(const std::string& fileName,
+                             InitialisationMode init = InitialisationMode::INIT_NONE,
+                             uint64_t initialSize = DEFAULT_INITIAL_SIZE,
+                             SecretStore& store = SecretStore::get())
+    : mSecretStore(store), mFileName{fileName},
+      mInitialSize{std::max<uint64_t>(initialSize, sizeof(FileHeader))}
+    {
+        if(init == InitialisationMode::INIT_CREATE)
+        {
+            createFile(mFileName, mInitialSize);
+        }
+
+        mapFile();
+        scan();
+    }
+
+    /// Forbid copying and assignment.
+    MappedSecretBackingStore(const MappedSecretBackingStore&) = delete;
+    MappedSecretBackingStore(MappedSecretBackingStore&&) = delete;
+    MappedSecretBackingStore& operator=(const MappedSecretBackingStore&) = delete;
+    MappedSecretBackingStore& operator=(MappedSecretBackingStore&&) = delete;
+
+    /// Destructor. Flushes the mapping to disk.
+    ~MappedSecretBackingStore() override
+    {
+        try
+        {
+            sync();
+        }
+        catch(...)
+        {
+            // Nothing more we can do
+        }
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        const Record record { makeRecord(*secret) };
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        putRecord(record);
+        commit();
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::vector<Record> records {};
+        records.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            records.push_back(makeRecord(*secret));
+        }
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        for(const Record& record : records)
+        {
+            putRecord(record);
+        }
+        commit();
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret. Note that this parameter is
+    * required because it might be the name itself of the secret that has changed.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        const Record record { makeRecord(*secret) };
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        putRecord(record);
+        if(record.mName != name)
+        {
+            eraseRecord(name);
+        }
+        commit();
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        eraseRecord(name);
+        commit();
+    }
+
+    /**
+    * Persist a batch of mutations under a single lock.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        const std::vector<SecretBackingStoreBatch::Op>& ops { batch.getOps() };
+        std::vector<Record> records {};
+        records.reserve(ops.size());
+        for(const SecretBackingStoreBatch::Op& op : ops)
+        {
+            records.push_back(op.mSecret ? makeRecord(*op.mSecret) : Record {});
+        }
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        for(size_t i = 0; i < ops.size(); ++i)
+        {
+            const SecretBackingStoreBatch::Op& op { ops[i] };
+            if(op.mSecret)
+            {
+                putRecord(records[i]);
+            }
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE || (op.mSecret && records[i].mName != op.mName))
+            {
+                eraseRecord(op.mName);
+            }
+        }
+        commit();
+    }
+
+    /**
+    * Load all stored secrets. Records are read from the mapping on an I/O
+    * thread and deserialised in parallel.
+    */
+    void loadAll() override
+    {
+        ParallelSecretLoader loader { mSecretStore };
+        loader.load([this](const ParallelSecretLoader::EmitFunc& emit)
+        {
+            readAll(emit);
+        });
+    }
+
+    /**
+    * Read all stored secrets from the mapping.
+    * @param emit Called for each serialised secret.
+    */
+    void readAll(const EmitFunc& emit) override
+    {
+        std::vector<std::string> names { getAllSecretNames() };
+        for(const std::string& name : names)
+        {
+            std::string payload {};
+            {
+                boost::shared_lock<boost::shared_mutex> lck { mMtx };
+                const uint64_t offset { offsetOf(name) };
+                if(!offset)
+                {
+                    // Removed since we started
+                    continue;
+                }
+                payload = readPayload(name, offset);
+            }
+            emit(std::move(payload));
+        }
+    }
+
+    /**
+    * Remove everything currently in the backing store and replace it with
+    * whatever is currently held by the secret store. The new contents are
+    * written to a temporary file which then replaces the old one.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::vector<Record> records {};
+        records.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            records.push_back(makeRecord(*secret));
+        }
+
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        const std::string tmpName { mFileName + ".tmp" };
+        const std::string liveName { mFileName };
+
+        // Build the new contents in a temporary file
+        unmapFile();
+        createFile(tmpName, mInitialSize);
+        mFileName = tmpName;
+        try
+        {
+            mapFile();
+            scan();
+            for(const Record& record : records)
+            {
+                putRecord(record);
+            }
+            commit();
+            unmapFile();
+        }
+        catch(...)
+        {
+            unmapFile();
+            std::remove(tmpName.c_str());
+            mFileName = liveName;
+            mapFile();
+            scan();
+            throw;
+        }
+
+        // Swap it in
+        mFileName = liveName;
+        if(std::rename(tmpName.c_str(), mFileName.c_str()) != 0)
+        {
+            std::remove(mFileName.c_str());
+            if(std::rename(tmpName.c_str(), mFileName.c_str()) != 0)
+            {
+                throw std::runtime_error("Failed to replace file " + mFileName);
+            }
+        }
+        mapFile();
+        scan();
+    }
+
+    /**
+    * Give read-only access to the serialised (encrypted) form of a secret
+    * directly from the mapping, without copying or parsing it. The pointer
+    * is only valid for the duration of the call.
+    * @param name The name of the secret to read.
+    * @param func Called as func(const char* data, size_t size).
+    * @return False if there is no secret with the given name.
+    */
+    template<typename Func>
+    bool withRecord(const std::string& name, Func&& func) const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        const auto it = mIndex.find(name);
+        if(it == mIndex.end())
+        {
+            return false;
+        }
+
+        const RecordHeader& header { recordAt(it->second) };
+        func(payloadOf(it->second), static_cast<size_t>(header.mPayloadLen));
+        return true;
+    }
+
+    /**
+    * Read the metadata for a secret directly from the mapping.
+    * @param name The name of the secret.
+    * @return A copy of the metadata stored with the secret.
+    */
+    MetaDataCollection::MetaMap getMetaData(const std::string& name) const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        const auto it = mIndex.find(name);
+        if(it == mIndex.end())
+        {
+            throw std::runtime_error("Secret named " + name + " not found in the backing store");
+        }
+        return decodeMetaData(it->second);
+    }
+
+    /**
+    * Get the names of all stored secrets.
+    * @return A list of all stored secret names.
+    */
+    std::vector<std::string> getAllSecretNames() const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        std::vector<std::string> names {};
+        names.reserve(mIndex.size());
+        for(const auto& entry : mIndex)
+        {
+            names.push_back(entry.first);
+        }
+        return names;
+    }
+
+    /**
+    * Synchronously flush all changes to disk.
+    */
+    void sync()
+    {
+        if(mRegion.get_address() && !mRegion.flush(0, 0, false))
+        {
+            throw std::runtime_error("Failed to flush file " + mFileName);
+        }
+    }
+
+  protected:
+
+    /// Fixed file header.
+    struct FileHeader
+    {
+        char mMagic[8];         // FILE_MAGIC
+        uint32_t mVersion;      // FILE_VERSION
+        uint32_t mReserved;
+        uint64_t mFileSize;     // Size of the file
+        uint64_t mDataEnd;      // Offset at which the next appended record goes
+        uint64_t mPadding[5];
+    };
+
+    /// Header for each record.
+    struct RecordHeader
+    {
+        uint32_t mState;        // RECORD_LIVE or RECORD_FREE
+        uint32_t mCrc;          // CRC-32 of name, metadata and payload
+        uint64_t mCapacity;     // Total bytes occupied including this header
+        uint64_t mSequence;     // Write sequence, the newest live copy of a name wins
+        uint32_t mNameLen;
+        uint32_t mMetaLen;
+        uint32_t mPayloadLen;
+        uint32_t mPadding;
+    };
+
+    /// A record ready to be written.
+    struct Record
+    {
+        std::string mName;
+        std::string mMetaData;
+        std::string mPayload;
+    };
+
+    /// Build a record for a secret.
+    static Record makeRecord(const Secret& secret)
+    {
+        Record record { secret.getName(), {}, JSONSerialiser::serialise(secret) };
+
+        MetaDataCollectionConstSPtr meta { secret.getMetaDataCollection() };
+        if(meta)
+        {
+            for(const auto& item : meta->getAllMetaData())
+            {
+                appendField(record.mMetaData, item.first);
+                appendField(record.mMetaData, item.second);
+            }
+        }
+
+        if(record.mName.size() > std::numeric_limits<uint32_t>::max() ||
+           record.mMetaData.size() > std::numeric_limits<uint32_t>::max() ||
+           record.mPayload.size() > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::runtime_error("Secret " + record.mName + " is too large to store");
+        }
+        return record;
+    }
+
+    /// Deserialise the secret stored at the given offset.
+    SecretSPtr readSecret(const std::string& name, uint64_t offset) const
+    {
+        std::istringstream str { readPayload(name, offset) };
+        SecretSPtr secret { std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str)) };
+        if(!secret)
+        {
+            throw std::runtime_error("Record for " + name + " is not a Secret");
+        }
+        return secret;
+    }
+
+    /// Copy out the checked payload stored at the given offset.
+    std::string readPayload(const std::string& name, uint64_t offset) const
+    {
+        const RecordHeader& header { recordAt(offset) };
+        if(checksum(offset) != header.mCrc)
+        {
+            throw std::runtime_error("Corrupt record for secret " + name + " in " + mFileName);
+        }
+        return std::string { payloadOf(offset), header.mPayloadLen };
+    }
+
+    /// Decode the metadata stored at the given offset.
+    MetaDataCollection::MetaMap decodeMetaData(uint64_t offset) const
+    {
+        const RecordHeader& header { recordAt(offset) };
+        const char* pos { dataAt(offset) + sizeof(RecordHeader) + header.mNameLen };
+        const char* end { pos + header.mMetaLen };
+
+        MetaDataCollection::MetaMap meta {};
+        while(pos < end)
+        {
+            std::string key { readField(pos, end) };
+            meta[key] = readField(pos, end);
+        }
+        return meta;
+    }
+
+    /// Get the file offset of a named secret, or 0 if we don't have it.
+    uint64_t offsetOf(const std::string& name) const
+    {
+        const auto it = mIndex.find(name);
+        return it == mIndex.end() ? 0 : it->second;
+    }
+
+    /// Access the record header at an offset.
+    const RecordHeader& recordAt(uint64_t offset) const
+    {
+        return *reinterpret_cast<const RecordHeader*>(dataAt(offset));
+    }
+
+    /// Access the payload of the record at an offset.
+    const char* payloadOf(uint64_t offset) const
+    {
+        const RecordHeader& header { recordAt(offset) };
+        return dataAt(offset) + sizeof(RecordHeader) + header.mNameLen + header.mMetaLen;
+    }
+
+    /// The secret store we load into.
+    SecretStore& mSecretStore;
+
+    /// A mutex for thread safety. Readers of the mapping share it.
+    mutable boost::shared_mutex mMtx {};
+
+    /// Index of secret names to record offsets.
+    std::unordered_map<std::string, uint64_t> mIndex {};
+
+  private:
+
+    /// File identification.
+    static constexpr const char* FILE_MAGIC { "NKSBMAP" };
+    static constexpr uint32_t FILE_VERSION { 1 };
+
+    /// Record states.
+    static constexpr uint32_t RECORD_LIVE { 0x4c495645 };
+    static constexpr uint32_t RECORD_FREE { 0x46524545 };
+
+    /// Records are aligned to this many bytes.
+    static constexpr uint64_t RECORD_ALIGNMENT { 8 };
+
+    /// Don't split off free space smaller than this.
+    static constexpr uint64_t MIN_SPLIT_SIZE { 64 };
+
+    /// Append a length-prefixed field to a buffer.
+    static void appendField(std::string& buffer, const std::string& field)
+    {
+        const uint32_t len { static_cast<uint32_t>(field.size()) };
+        buffer.append(reinterpret_cast<const char*>(&len), sizeof(len));
+        buffer.append(field);
+    }
+
+    /// Read a length-prefixed field from a buffer.
+    static std::string readField(const char*& pos, const char* end)
+    {
+        uint32_t len {};
+        if(end - pos < static_cast<std::ptrdiff_t>(sizeof(len)))
+        {
+            throw std::runtime_error("Corrupt metadata in secret record");
+        }
+        memcpy(&len, pos, sizeof(len));
+        pos += sizeof(len);
+        if(end - pos < static_cast<std::ptrdiff_t>(len))
+        {
+            throw std::runtime_error("Corrupt metadata in secret record");
+        }
+        std::string field { pos, len };
+        pos += len;
+        return field;
+    }
+
+    /// Round up to the record alignment.
+    static uint64_t align(uint64_t size)
+    {
+        return (size + RECORD_ALIGNMENT - 1) & ~(RECORD_ALIGNMENT - 1);
+    }
+
+    /// Create a new empty file of the given size.
+    static void createFile(const std::string& fileName, uint64_t size)
+    {
+        FileHeader header {};
+        memcpy(header.mMagic, FILE_MAGIC, sizeof(header.mMagic));
+        header.mVersion = FILE_VERSION;
+        header.mFileSize = size;
+        header.mDataEnd = sizeof(FileHeader);
+
+        std::ofstream file { fileName, std::ios::binary | std::ios::trunc };
+        if(!file)
+        {
+            throw std::runtime_error("Failed to create file " + fileName + " for writing");
+        }
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        extendFile(file, size);
+    }
+
+    /// Extend an open file to the given size.
+    static void extendFile(std::ofstream& file, uint64_t size)
+    {
+        file.seekp(static_cast<std::streamoff>(size) - 1);
+        file.put('\0');
+        if(!file.flush())
+        {
+            throw std::runtime_error("Failed to extend secret store file");
+        }
+    }
+
+    /// Map our file into memory.
+    void mapFile()
+    {
+        try
+        {
+            mMapping = boost::interprocess::file_mapping { mFileName.c_str(), boost::interprocess::read_write };
+            mRegion = boost::interprocess::mapped_region { mMapping, boost::interprocess::read_write };
+        }
+        catch(boost::interprocess::interprocess_exception& e)
+        {
+            throw std::runtime_error("Failed to open file " + mFileName + " for reading: " + e.what());
+        }
+
+        const FileHeader& hdr { header() };
+        if(mRegion.get_size() < sizeof(FileHeader) ||
+           memcmp(hdr.mMagic, FILE_MAGIC, sizeof(hdr.mMagic)) != 0 ||
+           hdr.mVersion != FILE_VERSION ||
+           hdr.mFileSize != mRegion.get_size() ||
+           hdr.mDataEnd > hdr.mFileSize)
+        {
+            unmapFile();
+            throw std::runtime_error("File " + mFileName + " is not a valid secret store");
+        }
+    }
+
+    /// Release our mapping.
+    void unmapFile()
+    {
+        mRegion = boost::interprocess::mapped_region {};
+        mMapping = boost::interprocess::file_mapping {};
+    }
+
+    /// Grow the file (and our mapping) to at least the given size.
+    void grow(uint64_t minSize)
+    {
+        uint64_t newSize { header().mFileSize };
+        while(newSize < minSize)
+        {
+            newSize *= 2;
+        }
+
+        sync();
+        unmapFile();
+        {
+            std::ofstream file { mFileName, std::ios::binary | std::ios::in | std::ios::out };
+            extendFile(file, newSize);
+        }
+        mMapping = boost::interprocess::file_mapping { mFileName.c_str(), boost::interprocess::read_write };
+        mRegion = boost::interprocess::mapped_region { mMapping, boost::interprocess::read_write };
+        header().mFileSize = newSize;
+        markDirty(0, sizeof(FileHeader));
+    }
+
+    /// Rebuild our name index and free list by walking the record headers.
+    void scan()
+    {
+        mIndex.clear();
+        mFree.clear();
+        mSuperseded.clear();
+        mDirtyBegin = mDirtyEnd = 0;
+        mNextSequence = 1;
+
+        uint64_t offset { sizeof(FileHeader) };
+        const uint64_t dataEnd { header().mDataEnd };
+        uint64_t freeStart {0};
+        uint64_t freeSize {0};
+        while(offset < dataEnd)
+        {
+            RecordHeader& record { recordAt(offset) };
+            if(record.mCapacity < sizeof(RecordHeader) || record.mCapacity % RECORD_ALIGNMENT ||
+               record.mCapacity > dataEnd - offset)
+            {
+                throw std::runtime_error("Corrupt record at offset " + std::to_string(offset) + " in " + mFileName);
+            }
+
+            bool live { record.mState == RECORD_LIVE &&
+                        sizeof(RecordHeader) + uint64_t{record.mNameLen} + record.mMetaLen + record.mPayloadLen <= record.mCapacity };
+            if(live)
+            {
+                mNextSequence = std::max(mNextSequence, record.mSequence + 1);
+                std::string name { dataAt(offset) + sizeof(RecordHeader), record.mNameLen };
+                auto it = mIndex.find(name);
+                if(it == mIndex.end())
+                {
+                    mIndex.emplace(std::move(name), offset);
+                }
+                else if(recordAt(it->second).mSequence < record.mSequence)
+                {
+                    // Interrupted update, an older copy survived
+                    releaseRecord(it->second);
+                    it->second = offset;
+                }
+                else
+                {
+                    record.mState = RECORD_FREE;
+                    live = false;
+                }
+            }
+
+            if(live)
+            {
+                addFree(freeStart, freeSize);
+                freeSize = 0;
+            }
+            else
+            {
+                // Merge runs of adjacent free records
+                if(!freeSize)
+                {
+                    freeStart = offset;
+                }
+                freeSize += record.mCapacity;
+            }
+            offset += record.mCapacity;
+        }
+        addFree(freeStart, freeSize);
+    }
+
+    /// Write a record, replacing any existing record with the same name.
+    void putRecord(const Record& record)
+    {
+        const uint64_t needed { align(sizeof(RecordHeader) + record.mName.size() +
+                                      record.mMetaData.size() + record.mPayload.size()) };
+        const uint64_t offset { allocate(needed) };
+
+        RecordHeader& hdr { recordAt(offset) };
+        hdr.mSequence = mNextSequence++;
+        hdr.mNameLen = static_cast<uint32_t>(record.mName.size());
+        hdr.mMetaLen = static_cast<uint32_t>(record.mMetaData.size());
+        hdr.mPayloadLen = static_cast<uint32_t>(record.mPayload.size());
+        char* body { dataAt(offset) + sizeof(RecordHeader) };
+        memcpy(body, record.mName.data(), record.mName.size());
+        memcpy(body + record.mName.size(), record.mMetaData.data(), record.mMetaData.size());
+        memcpy(body + record.mName.size() + record.mMetaData.size(), record.mPayload.data(), record.mPayload.size());
+        hdr.mCrc = checksum(offset);
+
+        // Only mark live once fully written
+        hdr.mState = RECORD_LIVE;
+        markDirty(offset, hdr.mCapacity);
+
+        const auto it = mIndex.find(record.mName);
+        if(it != mIndex.end())
+        {
+            mSuperseded.push_back(it->second);
+            it->second = offset;
+        }
+        else
+        {
+            mIndex.emplace(record.mName, offset);
+        }
+    }
+
+    /// Remove the named record, if we have it.
+    void eraseRecord(const std::string& name)
+    {
+        const auto it = mIndex.find(name);
+        if(it != mIndex.end())
+        {
+            mSuperseded.push_back(it->second);
+            mIndex.erase(it);
+        }
+    }
+
+    /// Note that a range of the mapping has been written.
+    void markDirty(uint64_t offset, uint64_t size)
+    {
+        if(mDirtyBegin == mDirtyEnd)
+        {
+            mDirtyBegin = offset;
+            mDirtyEnd = offset + size;
+        }
+        else
+        {
+            mDirtyBegin = std::min(mDirtyBegin, offset);
+            mDirtyEnd = std::max(mDirtyEnd, offset + size);
+        }
+    }
+
+    /**
+    * Flush everything written since the last commit with a single msync,
+    * then free the records it superseded and flush those. Old records stay
+    * live on disk until their replacements are, and can't be reused before
+    * then.
+    */
+    void commit()
+    {
+        flushDirty();
+        for(uint64_t offset : mSuperseded)
+        {
+            releaseRecord(offset);
+            markDirty(offset, sizeof(RecordHeader));
+        }
+        mSuperseded.clear();
+        flushDirty();
+    }
+
+    /// Synchronously flush the dirty range of the mapping.
+    void flushDirty()
+    {
+        if(mDirtyBegin != mDirtyEnd)
+        {
+            // msync needs a page aligned start
+            const uint64_t begin { mDirtyBegin & ~(uint64_t{boost::interprocess::mapped_region::get_page_size()} - 1) };
+            if(!mRegion.flush(static_cast<size_t>(begin), static_cast<size_t>(mDirtyEnd - begin), false))
+            {
+                throw std::runtime_error("Failed to flush file " + mFileName);
+            }
+            mDirtyBegin = mDirtyEnd = 0;
+        }
+    }
+
+    /// Find space for a record of the given size, reusing free space if possible.
+    uint64_t allocate(uint64_t needed)
+    {
+        auto it = mFree.lower_bound(needed);
+        if(it != mFree.end())
+        {
+            const uint64_t capacity { it->first };
+            const uint64_t offset { it->second };
+            mFree.erase(it);
+
+            // Split off any useful remainder. The remainder's header is written
+            // before we shrink ourselves, so the file is always walkable.
+            if(capacity - needed >= MIN_SPLIT_SIZE)
+            {
+                RecordHeader& rest { recordAt(offset + needed) };
+                rest = RecordHeader {};
+                rest.mState = RECORD_FREE;
+                rest.mCapacity = capacity - needed;
+                recordAt(offset).mCapacity = needed;
+                mFree.emplace(capacity - needed, offset + needed);
+                markDirty(offset + needed, sizeof(RecordHeader));
+            }
+            return offset;
+        }
+
+        // Append to the end, growing if required
+        const uint64_t offset { header().mDataEnd };
+        if(offset + needed > header().mFileSize)
+        {
+            grow(offset + needed);
+        }
+
+        RecordHeader& record { recordAt(offset) };
+        record = RecordHeader {};
+        record.mState = RECORD_FREE;
+        record.mCapacity = needed;
+        header().mDataEnd = offset + needed;
+        markDirty(0, sizeof(FileHeader));
+        return offset;
+    }
+
+    /// Mark a record as free space.
+    void releaseRecord(uint64_t offset)
+    {
+        RecordHeader& record { recordAt(offset) };
+        record.mState = RECORD_FREE;
+        mFree.emplace(record.mCapacity, offset);
+    }
+
+    /// Add a run of free space to the free list.
+    void addFree(uint64_t offset, uint64_t size)
+    {
+        if(size)
+        {
+            RecordHeader& record { recordAt(offset) };
+            record.mState = RECORD_FREE;
+            record.mCapacity = size;
+            mFree.emplace(size, offset);
+        }
+    }
+
+    /// Checksum the body of the record at an offset.
+    uint32_t checksum(uint64_t offset) const
+    {
+        const RecordHeader& record { recordAt(offset) };
+        boost::crc_32_type crc {};
+        crc.process_bytes(dataAt(offset) + sizeof(RecordHeader),
+                          uint64_t{record.mNameLen} + record.mMetaLen + record.mPayloadLen);
+        return crc.checksum();
+    }
+
+    /// Access the file header.
+    FileHeader& header()
+    {
+        return *reinterpret_cast<FileHeader*>(mRegion.get_address());
+    }
+    const FileHeader& header() const
+    {
+        return *reinterpret_cast<const FileHeader*>(mRegion.get_address());
+    }
+
+    /// Access raw bytes at an offset.
+    char* dataAt(uint64_t offset)
+    {
+        return static_cast<char*>(mRegion.get_address()) + offset;
+    }
+    const char* dataAt(uint64_t offset) const
+    {
+        return static_cast<const char*>(mRegion.get_address()) + offset;
+    }
+
+    /// Mutable access to the record header at an offset.
+    RecordHeader& recordAt(uint64_t offset)
+    {
+        return *reinterpret_cast<RecordHeader*>(dataAt(offset));
+    }
+
+    /// Filename to use for saving to.
+    std::string mFileName {};
+
+    /// Size to create new files with.
+    uint64_t mInitialSize {};
+
+    /// Our file mapping and mapped view of it.
+    boost::interprocess::file_mapping mMapping {};
+    boost::interprocess::mapped_region mRegion {};
+
+    /// Free records, by capacity.
+    std::multimap<uint64_t, uint64_t> mFree {};
+
+    /// Records superseded or removed since the last commit.
+    std::vector<uint64_t> mSuperseded {};
+
+    /// Range of the mapping written since the last commit.
+    uint64_t mDirtyBegin {0};
+    uint64_t mDirtyEnd {0};
+
+    /// Sequence number for the next record written.
+    uint64_t mNextSequence {1};
+};
+
+}}
+
+#endif
@@ -0,0 +1,190 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Bulk encryption and decryption of secrets across a pool of threads.
+ *
+ * Each secret only takes its own lock while it is encrypted or decrypted,
+ * so a collection of distinct secrets can be processed in parallel. The
+ * collection is split into chunks which worker threads claim in turn. A
+ * secret that fails doesn't stop the batch; the failures are returned
+ * along with the position and name of each secret that failed.
+ */
+
+#ifndef _NCHAIN_SDK_PARALLEL_SECRET_CRYPTER_H_
+#define _NCHAIN_SDK_PARALLEL_SECRET_CRYPTER_H_
+
+#include <interface/Secret.h>
+#include <impl/memory/SecureVector.h>
+#include <impl/utils/WorkerThreads.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <iterator>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// A secret that couldn't be encrypted or decrypted.
+struct SecretCryptFailure
+{
+    /// Position of the secret in the collection.
+    size_t mIndex {};
+    /// Name of the secret.
+    std::string mName {};
+    /// What went wrong.
+    std::exception_ptr mError {};
+};
+
+/// Failures from a bulk operation, in collection order.
+using SecretCryptFailures = std::vector<SecretCryptFailure>;
+
+/// Parallel encryption and decryption of collections of secrets.
+class ParallelSecretCrypter
+{
+  public:
+
+    /// Default number of secrets a worker claims at a time.
+    static constexpr size_t DEFAULT_CHUNK_SIZE { 64 };
+
+    /**
+    * Constructor.
+    * @param numWorkers Number of threads to use, including the calling
+    * thread. 0 means one per hardware thread.
+    * @param chunkSize Number of secrets a worker claims at a time.
+    */
+    ParallelSecretCrypter(size_t numWorkers = 0, size_t chunkSize = DEFAULT_CHUNK_SIZE)
+    : mNumWorkers{numWorkers ? numWorkers : std::max(1u, std::thread::hardware_concurrency())},
+      mChunkSize{chunkSize ? chunkSize : 1}
+    {}
+
+    /// Forbid copying and assignment.
+    ParallelSecretCrypter(const ParallelSecretCrypter&) = delete;
+    ParallelSecretCrypter(ParallelSecretCrypter&&) = delete;
+    ParallelSecretCrypter& operator=(const ParallelSecretCrypter&) = delete;
+    ParallelSecretCrypter& operator=(ParallelSecretCrypter&&) = delete;
+
+    /**
+    * Encrypt a collection of secrets with the same password.
+    * @param begin Start of the collection, of pointers to secrets.
+    * @param end End of the collection.
+    * @param passwd Password to encrypt with.
+    * @return The secrets that failed, if any.
+    */
+    template<typename Iter>
+    SecretCryptFailures encrypt(Iter begin, Iter end, const memory::SecureByteVec& passwd) const
+    {
+        if(passwd.empty())
+        {
+            throw std::runtime_error("Won't encrypt Secrets with empty password");
+        }
+        return run(begin, end, [&passwd](Secret& secret) { secret.encryptSecret(passwd); });
+    }
+
+    /**
+    * Decrypt a collection of secrets with the same password.
+    * @param begin Start of the collection, of pointers to secrets.
+    * @param end End of the collection.
+    * @param passwd Password the secrets were encrypted with.
+    * @return The secrets that failed, if any.
+    */
+    template<typename Iter>
+    SecretCryptFailures decrypt(Iter begin, Iter end, const memory::SecureByteVec& passwd) const
+    {
+        return run(begin, end, [&passwd](Secret& secret) { secret.decryptSecret(passwd); });
+    }
+
+  private:
+
+    /// Apply an operation to every secret in a collection.
+    template<typename Iter, typename Func>
+    SecretCryptFailures run(Iter begin, Iter end, const Func& func) const
+    {
+        std::vector<Secret*> secrets {};
+        for(; begin != end; ++begin)
+        {
+            secrets.push_back(&**begin);
+        }
+
+        std::atomic<size_t> next {0};
+        std::mutex failuresMtx {};
+        SecretCryptFailures failures {};
+
+        auto worker = [&]()
+        {
+            SecretCryptFailures ourFailures {};
+            size_t start {};
+            while((start = next.fetch_add(mChunkSize)) < secrets.size())
+            {
+                const size_t stop { std::min(start + mChunkSize, secrets.size()) };
+                for(size_t i = start; i < stop; ++i)
+                {
+                    try
+                    {
+                        func(*secrets[i]);
+                    }
+                    catch(...)
+                    {
+                        ourFailures.push_back({ i, secrets[i]->getName(), std::current_exception() });
+                    }
+                }
+            }
+
+            if(!ourFailures.empty())
+            {
+                std::lock_guard<std::mutex> lck { failuresMtx };
+                failures.insert(failures.end(), ourFailures.begin(), ourFailures.end());
+            }
+        };
+
+        // No more threads than there are chunks, and we are one of them
+        const size_t numChunks { (secrets.size() + mChunkSize - 1) / mChunkSize };
+        const size_t numThreads { std::min(mNumWorkers, numChunks) };
+        utils::runOnThreads(numThreads, worker);
+
+        std::sort(failures.begin(), failures.end(),
+            [](const SecretCryptFailure& a, const SecretCryptFailure& b) { return a.mIndex < b.mIndex; });
+        return failures;
+    }
+
+    /// Number of threads to use.
+    size_t mNumWorkers {};
+
+    /// Number of secrets claimed at a time.
+    size_t mChunkSize {};
+};
+
+/**
+* Encrypt a collection of secrets with the same password, in parallel.
+* @param secrets A collection of pointers to secrets.
+* @param passwd Password to encrypt with.
+* @param numWorkers Number of threads to use. 0 means one per hardware thread.
+* @return The secrets that failed, if any.
+*/
+template<typename Range>
+SecretCryptFailures encryptSecrets(const Range& secrets, const memory::SecureByteVec& passwd, size_t numWorkers = 0)
+{
+    return ParallelSecretCrypter { numWorkers }.encrypt(std::begin(secrets), std::end(secrets), passwd);
+}
+
+/**
+* Decrypt a collection of secrets with the same password, in parallel.
+* @param secrets A collection of pointers to secrets.
+* @param passwd Password the secrets were encrypted with.
+* @param numWorkers Number of threads to use. 0 means one per hardware thread.
+* @return The secrets that failed, if any.
+*/
+template<typename Range>
+SecretCryptFailures decryptSecrets(const Range& secrets, const memory::SecureByteVec& passwd, size_t numWorkers = 0)
+{
+    return ParallelSecretCrypter { numWorkers }.decrypt(std::begin(secrets), std::end(secrets), passwd);
+}
+
+}}
+
+#endif
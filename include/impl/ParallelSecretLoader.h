@@ -0,0 +1,307 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A pipelined loader for restoring secrets from a backing store.
+ *
+ * A producer function runs on its own I/O thread and emits serialised
+ * secrets. These are grouped into chunks and handed to a pool of worker
+ * threads which deserialise them in parallel. The calling thread then adds
+ * each deserialised chunk to the secret store as a batch. All queues are
+ * bounded, so memory use does not depend on the size of the store.
+ */
+
+#ifndef _NCHAIN_SDK_PARALLEL_SECRET_LOADER_H_
+#define _NCHAIN_SDK_PARALLEL_SECRET_LOADER_H_
+
+#include <impl/JSONSerialiser.h>
+#include <interface/SecretStore.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Parallel deserialisation pipeline for loading secrets.
+class ParallelSecretLoader
+{
+  public:
+
+    /// Function a producer calls for each serialised secret.
+    using EmitFunc = std::function<void(std::string&&)>;
+    /// A producer of serialised secrets.
+    using Producer = std::function<void(const EmitFunc&)>;
+
+    /// Default number of secrets per chunk.
+    static constexpr size_t DEFAULT_CHUNK_SIZE { 256 };
+
+    /**
+    * Constructor.
+    * @param store The secret store to load into.
+    * @param numWorkers Number of deserialising threads. 0 means one per hardware thread.
+    * @param chunkSize Number of secrets handed to a worker, and added to the
+    * store, at a time.
+    */
+    ParallelSecretLoader(SecretStore& store = SecretStore::get(),
+                         size_t numWorkers = 0, size_t chunkSize = DEFAULT_CHUNK_SIZE)
+    : mStore(store),
+      mNumWorkers{numWorkers ? numWorkers : std::max(1u, std::thread::hardware_concurrency())},
+      mChunkSize{chunkSize ? chunkSize : 1},
+      mMaxQueued{mNumWorkers * 2}
+    {}
+
+    /// Forbid copying and assignment.
+    ParallelSecretLoader(const ParallelSecretLoader&) = delete;
+    ParallelSecretLoader(ParallelSecretLoader&&) = delete;
+    ParallelSecretLoader& operator=(const ParallelSecretLoader&) = delete;
+    ParallelSecretLoader& operator=(ParallelSecretLoader&&) = delete;
+
+    /**
+    * Run the pipeline. Returns once every emitted secret has been loaded
+    * into the secret store, or rethrows the first failure from any stage.
+    * @param producer Called on the I/O thread to emit serialised secrets.
+    * @return The number of secrets loaded.
+    */
+    size_t load(const Producer& producer)
+    {
+        reset();
+
+        std::thread reader { &ParallelSecretLoader::readerBody, this, std::cref(producer) };
+        std::vector<std::thread> workers {};
+        for(size_t i = 0; i < mNumWorkers; ++i)
+        {
+            workers.emplace_back(&ParallelSecretLoader::workerBody, this);
+        }
+
+        size_t numLoaded {0};
+        try
+        {
+            std::vector<SecretSPtr> batch {};
+            while(nextBatch(batch))
+            {
+                for(const SecretSPtr& secret : batch)
+                {
+                    mStore.loadSecret(secret);
+                }
+                numLoaded += batch.size();
+            }
+        }
+        catch(...)
+        {
+            fail(std::current_exception());
+        }
+
+        reader.join();
+        for(std::thread& worker : workers)
+        {
+            worker.join();
+        }
+
+        if(mFailure)
+        {
+            std::rethrow_exception(mFailure);
+        }
+        return numLoaded;
+    }
+
+  private:
+
+    /// A chunk of serialised secrets.
+    using InputChunk = std::vector<std::string>;
+    /// A chunk of deserialised secrets.
+    using OutputChunk = std::vector<SecretSPtr>;
+
+    /// Reset our state ready for a new run.
+    void reset()
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        mInput.clear();
+        mOutput.clear();
+        mReaderDone = false;
+        mActiveWorkers = mNumWorkers;
+        mFailure = nullptr;
+    }
+
+    /// Record a failure and stop all stages.
+    void fail(std::exception_ptr failure)
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            if(!mFailure)
+            {
+                mFailure = failure;
+            }
+            mInput.clear();
+            mOutput.clear();
+        }
+        mInputCv.notify_all();
+        mOutputCv.notify_all();
+        mSpaceCv.notify_all();
+    }
+
+    /// Body of the I/O thread.
+    void readerBody(const Producer& producer)
+    {
+        try
+        {
+            InputChunk chunk {};
+            chunk.reserve(mChunkSize);
+            producer([this, &chunk](std::string&& payload)
+            {
+                chunk.push_back(std::move(payload));
+                if(chunk.size() >= mChunkSize)
+                {
+                    pushInput(chunk);
+                }
+            });
+            if(!chunk.empty())
+            {
+                pushInput(chunk);
+            }
+        }
+        catch(...)
+        {
+            fail(std::current_exception());
+        }
+
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mReaderDone = true;
+        }
+        mInputCv.notify_all();
+    }
+
+    /// Queue a chunk for the workers, waiting for space if required.
+    void pushInput(InputChunk& chunk)
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mSpaceCv.wait(lck, [this]{ return mInput.size() < mMaxQueued || mFailure; });
+        if(mFailure)
+        {
+            // Abandon the producer
+            throw std::runtime_error("Secret load abandoned");
+        }
+        mInput.push_back(std::move(chunk));
+        chunk = InputChunk {};
+        chunk.reserve(mChunkSize);
+        mInputCv.notify_one();
+    }
+
+    /// Body of a worker thread.
+    void workerBody()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(true)
+        {
+            mInputCv.wait(lck, [this]{ return !mInput.empty() || mReaderDone || mFailure; });
+            if(mInput.empty() || mFailure)
+            {
+                break;
+            }
+
+            InputChunk chunk { std::move(mInput.front()) };
+            mInput.pop_front();
+            mSpaceCv.notify_all();
+            lck.unlock();
+
+            OutputChunk secrets {};
+            try
+            {
+                secrets.reserve(chunk.size());
+                for(const std::string& payload : chunk)
+                {
+                    std::istringstream str { payload };
+                    SecretSPtr secret { std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str)) };
+                    if(!secret)
+                    {
+                        throw std::runtime_error("Stored object is not a Secret");
+                    }
+                    secrets.push_back(std::move(secret));
+                }
+            }
+            catch(...)
+            {
+                fail(std::current_exception());
+                lck.lock();
+                break;
+            }
+
+            lck.lock();
+            mSpaceCv.wait(lck, [this]{ return mOutput.size() < mMaxQueued || mFailure; });
+            if(mFailure)
+            {
+                break;
+            }
+            mOutput.push_back(std::move(secrets));
+            mOutputCv.notify_one();
+        }
+
+        --mActiveWorkers;
+        mOutputCv.notify_all();
+    }
+
+    /// Get the next batch of deserialised secrets. Returns false when done.
+    bool nextBatch(OutputChunk& batch)
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mOutputCv.wait(lck, [this]{ return !mOutput.empty() || !mActiveWorkers || mFailure; });
+        if(mOutput.empty() || mFailure)
+        {
+            return false;
+        }
+
+        batch = std::move(mOutput.front());
+        mOutput.pop_front();
+        mSpaceCv.notify_all();
+        return true;
+    }
+
+    /// The secret store we load into.
+    SecretStore& mStore;
+
+    /// Number of worker threads.
+    size_t mNumWorkers {};
+
+    /// Number of secrets per chunk.
+    size_t mChunkSize {};
+
+    /// Maximum number of chunks waiting at each stage.
+    size_t mMaxQueued {};
+
+    /// A mutex for our pipeline state.
+    std::mutex mMtx {};
+
+    /// Signalled when there is input for the workers.
+    std::condition_variable mInputCv {};
+    /// Signalled when there is output for the loading thread.
+    std::condition_variable mOutputCv {};
+    /// Signalled when space becomes available in a queue.
+    std::condition_variable mSpaceCv {};
+
+    /// Chunks waiting to be deserialised.
+    std::deque<InputChunk> mInput {};
+
+    /// Chunks waiting to be loaded.
+    std::deque<OutputChunk> mOutput {};
+
+    /// Set once the producer has finished.
+    bool mReaderDone {false};
+
+    /// Number of workers still running.
+    size_t mActiveWorkers {0};
+
+    /// First failure from any stage.
+    std::exception_ptr mFailure {};
+};
+
+}}
+
+#endif
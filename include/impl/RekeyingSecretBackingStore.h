@@ -0,0 +1,496 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that lets the master password be
+ * rotated without stopping the store while the re-encrypted secrets are
+ * persisted.
+ *
+ * Setting a new master password re-encrypts every secret in memory and then
+ * rewrites the whole backing store. With rotateMasterPassword() the rewrite
+ * runs on a background thread instead. The store keeps serving reads and
+ * writes meanwhile; writes made during the rewrite are held back in order
+ * and persisted in order once the rewrite completes, so they can't be
+ * overwritten by it. Until the rewrite has completed the persisted store is
+ * still entirely under the old password.
+ *
+ * If the rewrite fails, the secrets it was writing and every write held back
+ * are kept, and writes go on being held behind them, until retryRotation()
+ * persists them.
+ */
+
+#ifndef _NCHAIN_SDK_REKEYING_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_REKEYING_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <interface/SecretStore.h>
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of RekeyingSecretBackingStore pointer type
+class RekeyingSecretBackingStore;
+/// Unique pointer type
+using RekeyingSecretBackingStorePtr = std::unique_ptr<RekeyingSecretBackingStore>;
+/// Shared pointer type
+using RekeyingSecretBackingStoreSPtr = std::shared_ptr<RekeyingSecretBackingStore>;
+
+/// Online master password rotation wrapper around another secret backing store.
+class RekeyingSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /// Stages of a rotation.
+    enum class Phase
+    {
+        IDLE,           // No rotation in progress
+        REWRITING,      // Persisting all secrets under the new password
+        CATCHING_UP     // Persisting writes held back during the rewrite
+    };
+
+    /// Progress of the current or last rotation.
+    struct Progress
+    {
+        /// Where we are.
+        Phase mPhase {Phase::IDLE};
+        /// Number of rotations completed.
+        uint64_t mEpoch {0};
+        /// Number of secrets being rewritten, or held back writes being caught up.
+        size_t mTotal {0};
+        /// Number of writes currently held back.
+        size_t mHeld {0};
+    };
+
+    /// Notified when a rotation starts persisting and when it completes.
+    using ProgressCallback = std::function<void(const Progress&)>;
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param secretStore The secret store whose master password we rotate.
+    */
+    RekeyingSecretBackingStore(const SecretBackingStoreSPtr& store,
+                               SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore)
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Rekeying store requires a backing store to wrap");
+        }
+    }
+
+    /// Forbid copying and assignment.
+    RekeyingSecretBackingStore(const RekeyingSecretBackingStore&) = delete;
+    RekeyingSecretBackingStore(RekeyingSecretBackingStore&&) = delete;
+    RekeyingSecretBackingStore& operator=(const RekeyingSecretBackingStore&) = delete;
+    RekeyingSecretBackingStore& operator=(RekeyingSecretBackingStore&&) = delete;
+
+    /// Destructor. Waits for any rotation to be fully persisted.
+    ~RekeyingSecretBackingStore() override
+    {
+        if(mRewriter.joinable())
+        {
+            mRewriter.join();
+        }
+    }
+
+    /**
+    * Rotate the store's master password. The secrets are re-encrypted in
+    * memory before this returns, and are persisted in the background.
+    * @param passwd The new master password.
+    * @param callback Optionally notified as the rotation progresses.
+    */
+    void rotateMasterPassword(const memory::SecureByteVec& passwd,
+                              const ProgressCallback& callback = nullptr)
+    {
+        {
+            std::unique_lock<std::mutex> lck { mMtx };
+            mDoneCv.wait(lck, [this]{ return mProgress.mPhase == Phase::IDLE; });
+            if(mRewriter.joinable())
+            {
+                mRewriter.join();
+            }
+            mCallback = callback;
+            mCapturing = true;
+        }
+
+        // The store re-encrypts everything and hands it to our replaceAll()
+        try
+        {
+            mSecretStore.setMasterPassword(passwd);
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mCapturing = false;
+            throw;
+        }
+
+        std::unique_lock<std::mutex> lck { mMtx };
+        mCapturing = false;
+        if(mProgress.mPhase == Phase::REWRITING)
+        {
+            mRewriter = std::thread { &RekeyingSecretBackingStore::rewrite, this };
+            notify(lck);
+        }
+    }
+
+    /**
+    * Wait for the current rotation to be fully persisted.
+    * Rethrows any failure from the background rewrite, after which writes
+    * are held back until retryRotation() succeeds.
+    */
+    void waitForRotation()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mDoneCv.wait(lck, [this]{ return mProgress.mPhase == Phase::IDLE; });
+        if(mFailure)
+        {
+            std::exception_ptr failure { mFailure };
+            mFailure = nullptr;
+            std::rethrow_exception(failure);
+        }
+    }
+
+    /**
+    * Retry persisting a rotation whose rewrite failed. Does nothing if
+    * there is nothing left to persist.
+    * @param callback Optionally notified as the retry progresses.
+    */
+    void retryRotation(const ProgressCallback& callback = nullptr)
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mDoneCv.wait(lck, [this]{ return mProgress.mPhase == Phase::IDLE; });
+        if(!mRetryPending)
+        {
+            return;
+        }
+        if(mRewriter.joinable())
+        {
+            mRewriter.join();
+        }
+        mCallback = callback;
+        mFailure = nullptr;
+        mProgress.mPhase = Phase::REWRITING;
+        mProgress.mTotal = mSnapshotPending ? mSnapshot.size() : mHeld.size();
+        mRewriter = std::thread { &RekeyingSecretBackingStore::rewrite, this };
+        notify(lck);
+    }
+
+    /**
+    * Get the progress of the current or last rotation.
+    * @return Our progress.
+    */
+    Progress getProgress() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        Progress progress { mProgress };
+        progress.mHeld = mHeld.size();
+        return progress;
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(holding())
+        {
+            mHeld.saveSecret(secret);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->saveSecret(secret);
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(holding())
+        {
+            for(const SecretSPtr& secret : secrets)
+            {
+                mHeld.saveSecret(secret);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->saveSecrets(secrets);
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(holding())
+        {
+            mHeld.updateSecret(name, secret);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->updateSecret(name, secret);
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(holding())
+        {
+            mHeld.removeSecret(name);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->removeSecret(name);
+    }
+
+    /**
+    * Load all stored secrets.
+    */
+    void loadAll() override
+    {
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        mStore->loadAll();
+    }
+
+    /**
+    * Replace the contents of the backing store. During a rotation this
+    * takes a snapshot to be written in the background.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mCapturing)
+        {
+            mCapturing = false;
+            mSnapshot = secrets;
+            mSnapshotPending = true;
+            mHeld.clear();
+            mProgress.mPhase = Phase::REWRITING;
+            mProgress.mTotal = secrets.size();
+            return;
+        }
+        if(holding())
+        {
+            // Supersedes the rotation snapshot and anything held back
+            mSnapshot = secrets;
+            mSnapshotPending = true;
+            mHeld.clear();
+            mProgress.mTotal = secrets.size();
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->replaceAll(secrets);
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(holding())
+        {
+            append(mHeld, batch);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        impl::applyBatch(*mStore, batch);
+    }
+
+  private:
+
+    /// Whether writes must be held back. Called with our mutex held.
+    bool holding() const
+    {
+        return mProgress.mPhase != Phase::IDLE || mRetryPending;
+    }
+
+    /// Add the mutations of one batch to the end of another.
+    static void append(SecretBackingStoreBatch& to, const SecretBackingStoreBatch& from)
+    {
+        for(const SecretBackingStoreBatch::Op& op : from.getOps())
+        {
+            switch(op.mType)
+            {
+                case SecretBackingStoreBatch::OpType::SAVE:
+                    to.saveSecret(op.mSecret);
+                    break;
+                case SecretBackingStoreBatch::OpType::UPDATE:
+                    to.updateSecret(op.mName, op.mSecret);
+                    break;
+                case SecretBackingStoreBatch::OpType::REMOVE:
+                    to.removeSecret(op.mName);
+                    break;
+            }
+        }
+    }
+
+    /// Body of the background rewrite.
+    void rewrite()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        std::vector<SecretSPtr> snapshot {};
+        SecretBackingStoreBatch held {};
+        bool writingSnapshot {false};
+        try
+        {
+            // Write the latest snapshot, then what was held back behind it,
+            // until nothing is left. Writes are held meanwhile, so none can
+            // overtake these, and a replaceAll() supersedes both.
+            while(mSnapshotPending || !mHeld.empty())
+            {
+                if(mSnapshotPending)
+                {
+                    mSnapshotPending = false;
+                    snapshot.clear();
+                    snapshot.swap(mSnapshot);
+                    mProgress.mPhase = Phase::REWRITING;
+                    mProgress.mTotal = snapshot.size();
+                    writingSnapshot = true;
+                    lck.unlock();
+                    {
+                        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+                        mStore->replaceAll(snapshot);
+                    }
+                    writingSnapshot = false;
+                }
+                else
+                {
+                    std::swap(held, mHeld);
+                    mProgress.mPhase = Phase::CATCHING_UP;
+                    mProgress.mTotal = held.size();
+                    lck.unlock();
+                    {
+                        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+                        impl::applyBatch(*mStore, held);
+                    }
+                    held.clear();
+                }
+                lck.lock();
+            }
+            mRetryPending = false;
+            ++mProgress.mEpoch;
+        }
+        catch(...)
+        {
+            // Keep whatever didn't get written, unless a replaceAll() has
+            // superseded it, and go on holding writes behind it
+            if(!lck.owns_lock())
+            {
+                lck.lock();
+            }
+            mFailure = std::current_exception();
+            mRetryPending = true;
+            if(!mSnapshotPending)
+            {
+                if(writingSnapshot)
+                {
+                    mSnapshot.swap(snapshot);
+                    mSnapshotPending = true;
+                }
+                else
+                {
+                    append(held, mHeld);
+                    std::swap(held, mHeld);
+                }
+            }
+        }
+
+        mProgress.mPhase = Phase::IDLE;
+        notify(lck);
+        mDoneCv.notify_all();
+    }
+
+    /// Report progress. Called with our mutex held.
+    void notify(std::unique_lock<std::mutex>& lck)
+    {
+        if(mCallback)
+        {
+            Progress progress { mProgress };
+            progress.mHeld = mHeld.size();
+            ProgressCallback callback { mCallback };
+            lck.unlock();
+            callback(progress);
+            lck.lock();
+        }
+    }
+
+    /// A mutex for our rotation state.
+    mutable std::mutex mMtx {};
+
+    /// Serialises access to the wrapped store.
+    std::mutex mStoreMtx {};
+
+    /// Signalled when a rotation completes.
+    std::condition_variable mDoneCv {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store we rotate, which must be using us as its backing store.
+    SecretStore& mSecretStore;
+
+    /// Set while waiting for the store to hand us its re-encrypted secrets.
+    bool mCapturing {false};
+
+    /// Re-encrypted secrets waiting to be written.
+    std::vector<SecretSPtr> mSnapshot {};
+
+    /// Whether mSnapshot is still to be written. It may legitimately be empty.
+    bool mSnapshotPending {false};
+
+    /// Set while a failed rewrite has left writes to retry.
+    bool mRetryPending {false};
+
+    /// Writes held back during the rewrite, in order.
+    SecretBackingStoreBatch mHeld {};
+
+    /// Our progress.
+    Progress mProgress {};
+
+    /// Progress listener for the current rotation.
+    ProgressCallback mCallback {};
+
+    /// Failure from the last rewrite.
+    std::exception_ptr mFailure {};
+
+    /// The background rewrite thread.
+    std::thread mRewriter {};
+};
+
+}}
+
+#endif
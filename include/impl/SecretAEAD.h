@@ -0,0 +1,369 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Authenticated encryption of secrets.
+ *
+ * Secret::encryptSecret() uses AES without an integrity tag, so a
+ * corrupted or tampered encrypted secret can't be detected. SecretAEAD
+ * seals secret bytes with AES-256-GCM, or ChaCha20-Poly1305 where the CPU
+ * has no AES instructions and the Crypto++ in use provides it. Each sealed
+ * value carries its algorithm, a random nonce and an authentication tag,
+ * and the secret's name is authenticated along with it, so a sealed value
+ * can't be swapped between names either:
+ *
+ *     [algorithm (1)][nonce (12)][ciphertext][tag (16)]
+ *
+ * The batch methods key the cipher once and reuse it for every value,
+ * which is where most of the per-call cost of small secrets goes, so they
+ * should be used for loading or saving many secrets at a time.
+ *
+ * Nonces are random, so no more than around 2^32 values should be sealed
+ * under any one key.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_AEAD_H_
+#define _NCHAIN_SDK_SECRET_AEAD_H_
+
+#include <interface/Secret.h>
+#include <impl/memory/SecureVector.h>
+
+#include <cryptopp/aes.h>
+#include <cryptopp/cpu.h>
+#include <cryptopp/gcm.h>
+#include <cryptopp/osrng.h>
+#if CRYPTOPP_VERSION >= 810
+#include <cryptopp/chachapoly.h>
+#endif
+
+#include <algorithm>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of SecretAEAD pointer type
+class SecretAEAD;
+/// Unique pointer type
+using SecretAEADPtr = std::unique_ptr<SecretAEAD>;
+/// Shared pointer type
+using SecretAEADSPtr = std::shared_ptr<SecretAEAD>;
+
+/// Authenticated encryption of secrets under a single key.
+class SecretAEAD
+{
+  public:
+
+    /// Supported algorithms. Values are stored in sealed data.
+    enum class Algorithm : uint8_t
+    {
+        AES_256_GCM = 1,
+        CHACHA20_POLY1305 = 2
+    };
+
+    /// Sizes in bytes.
+    static constexpr size_t KEY_SIZE { 32 };
+    static constexpr size_t NONCE_SIZE { 12 };
+    static constexpr size_t TAG_SIZE { 16 };
+    static constexpr size_t OVERHEAD { 1 + NONCE_SIZE + TAG_SIZE };
+
+    /**
+    * Is an algorithm available in this build?
+    * @param alg The algorithm.
+    * @return True if it can be used.
+    */
+    static bool isSupported(Algorithm alg)
+    {
+        switch(alg)
+        {
+            case Algorithm::AES_256_GCM:
+                return true;
+            case Algorithm::CHACHA20_POLY1305:
+#if CRYPTOPP_VERSION >= 810
+                return true;
+#else
+                return false;
+#endif
+        }
+        return false;
+    }
+
+    /**
+    * Does this CPU have AES and carry-less multiply instructions?
+    * @return True if AES-256-GCM will be hardware accelerated.
+    */
+    static bool hasAESAcceleration()
+    {
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+        return CryptoPP::HasAESNI() && CryptoPP::HasCLMUL();
+#elif CRYPTOPP_VERSION >= 810 && (CRYPTOPP_BOOL_ARM32 || CRYPTOPP_BOOL_ARMV8)
+        return CryptoPP::HasAES() && CryptoPP::HasPMULL();
+#else
+        return false;
+#endif
+    }
+
+    /**
+    * Pick the fastest supported algorithm for this CPU.
+    * @return AES-256-GCM if accelerated or nothing else is available,
+    * ChaCha20-Poly1305 otherwise.
+    */
+    static Algorithm preferredAlgorithm()
+    {
+        if(hasAESAcceleration() || !isSupported(Algorithm::CHACHA20_POLY1305))
+        {
+            return Algorithm::AES_256_GCM;
+        }
+        return Algorithm::CHACHA20_POLY1305;
+    }
+
+    /**
+    * Constructor.
+    * @param key The 32 byte key to seal with.
+    * @param alg The algorithm to seal with. Anything we support can be opened.
+    */
+    SecretAEAD(const memory::SecureByteVec& key, Algorithm alg = preferredAlgorithm())
+    : mKey{key}, mAlgorithm{alg}
+    {
+        if(mKey.size() != KEY_SIZE)
+        {
+            throw std::runtime_error("Secret AEAD key must be " + std::to_string(KEY_SIZE) + " bytes");
+        }
+        if(!isSupported(mAlgorithm))
+        {
+            throw std::runtime_error("Secret AEAD algorithm not supported by this build");
+        }
+    }
+
+    /// Forbid copying and assignment.
+    SecretAEAD(const SecretAEAD&) = delete;
+    SecretAEAD(SecretAEAD&&) = delete;
+    SecretAEAD& operator=(const SecretAEAD&) = delete;
+    SecretAEAD& operator=(SecretAEAD&&) = delete;
+
+    /**
+    * Get the algorithm we seal with.
+    * @return Our algorithm.
+    */
+    Algorithm getAlgorithm() const { return mAlgorithm; }
+
+    /**
+    * Seal some bytes.
+    * @param plaintext The bytes to seal.
+    * @param name Name to authenticate along with them.
+    * @return The sealed bytes.
+    */
+    memory::SecureByteVec seal(const memory::SecureByteVec& plaintext, const std::string& name) const
+    {
+        return sealAll({ plaintext }, { name })[0];
+    }
+
+    /**
+    * Open some sealed bytes.
+    * @param sealed The sealed bytes.
+    * @param name Name they were sealed with.
+    * @return The original bytes.
+    */
+    memory::SecureByteVec open(const memory::SecureByteVec& sealed, const std::string& name) const
+    {
+        return openAll({ sealed }, { name })[0];
+    }
+
+    /**
+    * Seal many values using a single keyed cipher.
+    * @param plaintexts The values to seal.
+    * @param names Names to authenticate along with each value.
+    * @return The sealed values, in the same order.
+    */
+    std::vector<memory::SecureByteVec> sealAll(const std::vector<memory::SecureByteVec>& plaintexts,
+                                               const std::vector<std::string>& names) const
+    {
+        checkSizes(plaintexts.size(), names.size());
+
+        // One call to the RNG for every nonce
+        memory::SecureByteVec nonces(plaintexts.size() * NONCE_SIZE);
+        if(!nonces.empty())
+        {
+            std::lock_guard<std::mutex> lck { mRngMtx };
+            mRng.GenerateBlock(nonces.data(), nonces.size());
+        }
+
+        std::vector<memory::SecureByteVec> sealed(plaintexts.size());
+        withCipher<true>(mAlgorithm, [&](CryptoPP::AuthenticatedSymmetricCipher& cipher)
+        {
+            for(size_t i = 0; i < plaintexts.size(); ++i)
+            {
+                const memory::SecureByteVec& plaintext { plaintexts[i] };
+                memory::SecureByteVec& out { sealed[i] };
+                out.resize(OVERHEAD + plaintext.size());
+                out[0] = static_cast<uint8_t>(mAlgorithm);
+                std::copy(nonces.begin() + i * NONCE_SIZE, nonces.begin() + (i + 1) * NONCE_SIZE, out.begin() + 1);
+
+                cipher.EncryptAndAuthenticate(
+                    out.data() + 1 + NONCE_SIZE, out.data() + out.size() - TAG_SIZE, TAG_SIZE,
+                    out.data() + 1, NONCE_SIZE,
+                    reinterpret_cast<const uint8_t*>(names[i].data()), names[i].size(),
+                    plaintext.data(), plaintext.size());
+            }
+        });
+        return sealed;
+    }
+
+    /**
+    * Open many sealed values, keying each algorithm's cipher once.
+    * @param sealed The sealed values.
+    * @param names Names each value was sealed with.
+    * @return The original values, in the same order.
+    * @throw std::runtime_error if any value fails authentication.
+    */
+    std::vector<memory::SecureByteVec> openAll(const std::vector<memory::SecureByteVec>& sealed,
+                                               const std::vector<std::string>& names) const
+    {
+        checkSizes(sealed.size(), names.size());
+
+        std::vector<memory::SecureByteVec> opened(sealed.size());
+        for(Algorithm alg : { Algorithm::AES_256_GCM, Algorithm::CHACHA20_POLY1305 })
+        {
+            const bool used { std::any_of(sealed.begin(), sealed.end(),
+                [alg](const memory::SecureByteVec& s) { return !s.empty() && s[0] == static_cast<uint8_t>(alg); }) };
+            if(!used)
+            {
+                continue;
+            }
+
+            withCipher<false>(alg, [&](CryptoPP::AuthenticatedSymmetricCipher& cipher)
+            {
+                for(size_t i = 0; i < sealed.size(); ++i)
+                {
+                    const memory::SecureByteVec& in { sealed[i] };
+                    if(in.size() < OVERHEAD || in[0] != static_cast<uint8_t>(alg))
+                    {
+                        continue;
+                    }
+
+                    memory::SecureByteVec& out { opened[i] };
+                    out.resize(in.size() - OVERHEAD);
+                    const bool ok { cipher.DecryptAndVerify(
+                        out.data(), in.data() + in.size() - TAG_SIZE, TAG_SIZE,
+                        in.data() + 1, NONCE_SIZE,
+                        reinterpret_cast<const uint8_t*>(names[i].data()), names[i].size(),
+                        in.data() + 1 + NONCE_SIZE, out.size()) };
+                    if(!ok)
+                    {
+                        throw std::runtime_error("Sealed secret " + names[i] + " failed authentication");
+                    }
+                }
+            });
+        }
+
+        // Anything left over was malformed or used an unsupported algorithm
+        for(size_t i = 0; i < sealed.size(); ++i)
+        {
+            if(sealed[i].size() < OVERHEAD || !isSupported(static_cast<Algorithm>(sealed[i][0])))
+            {
+                throw std::runtime_error("Sealed secret " + names[i] + " is malformed");
+            }
+        }
+        return opened;
+    }
+
+    /**
+    * Seal the contents of some secrets, authenticating their names.
+    * @param secrets The secrets to seal.
+    * @return The sealed contents, in the same order.
+    */
+    std::vector<memory::SecureByteVec> sealSecrets(const std::vector<SecretSPtr>& secrets) const
+    {
+        std::vector<memory::SecureByteVec> plaintexts {};
+        std::vector<std::string> names {};
+        plaintexts.reserve(secrets.size());
+        names.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            plaintexts.push_back(secret->getSecret());
+            names.push_back(secret->getName());
+        }
+        return sealAll(plaintexts, names);
+    }
+
+    /**
+    * Recreate secrets from sealed contents.
+    * @param names The names of the secrets.
+    * @param sealed The sealed contents of each.
+    * @return The secrets, in the same order.
+    * @throw std::runtime_error if any value fails authentication.
+    */
+    std::vector<SecretSPtr> openSecrets(const std::vector<std::string>& names,
+                                        const std::vector<memory::SecureByteVec>& sealed) const
+    {
+        std::vector<memory::SecureByteVec> opened { openAll(sealed, names) };
+        std::vector<SecretSPtr> secrets {};
+        secrets.reserve(opened.size());
+        for(size_t i = 0; i < opened.size(); ++i)
+        {
+            secrets.push_back(std::make_shared<Secret>(opened[i], names[i]));
+        }
+        return secrets;
+    }
+
+  private:
+
+    /// Check batch argument sizes match.
+    static void checkSizes(size_t values, size_t names)
+    {
+        if(values != names)
+        {
+            throw std::runtime_error("Secret AEAD batch needs a name for every value");
+        }
+    }
+
+    /// Run a function with a cipher keyed for the given algorithm and direction.
+    template<bool Encrypt, typename Func>
+    void withCipher(Algorithm alg, Func&& func) const
+    {
+        // Keying needs a nonce; every message resynchronises with its own
+        const uint8_t zeroNonce[NONCE_SIZE] {};
+
+        switch(alg)
+        {
+            case Algorithm::AES_256_GCM:
+            {
+                typename std::conditional<Encrypt, CryptoPP::GCM<CryptoPP::AES>::Encryption,
+                                                   CryptoPP::GCM<CryptoPP::AES>::Decryption>::type cipher {};
+                cipher.SetKeyWithIV(mKey.data(), mKey.size(), zeroNonce, sizeof(zeroNonce));
+                func(cipher);
+                break;
+            }
+
+            case Algorithm::CHACHA20_POLY1305:
+            {
+#if CRYPTOPP_VERSION >= 810
+                typename std::conditional<Encrypt, CryptoPP::ChaCha20Poly1305::Encryption,
+                                                   CryptoPP::ChaCha20Poly1305::Decryption>::type cipher {};
+                cipher.SetKeyWithIV(mKey.data(), mKey.size(), zeroNonce, sizeof(zeroNonce));
+                func(cipher);
+                break;
+#else
+                throw std::runtime_error("Secret AEAD algorithm not supported by this build");
+#endif
+            }
+        }
+    }
+
+    /// Our key.
+    memory::SecureByteVec mKey {};
+
+    /// Algorithm we seal with.
+    Algorithm mAlgorithm {};
+
+    /// Source of nonces.
+    mutable std::mutex mRngMtx {};
+    mutable CryptoPP::AutoSeededRandomPool mRng {};
+};
+
+}}
+
+#endif
@@ -0,0 +1,150 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Support for persisting a batch of secret mutations with a single call to
+ * a backing store.
+ *
+ * Backing stores that can write a whole batch more cheaply than one
+ * mutation at a time implement BatchSecretBackingStore. Any other backing
+ * store has the batch replayed to it, with consecutive saves grouped into
+ * a single saveSecrets() call.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_BACKING_STORE_BATCH_H_
+#define _NCHAIN_SDK_SECRET_BACKING_STORE_BATCH_H_
+
+#include <interface/SecretBackingStore.h>
+
+#include <string>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// An ordered list of mutations for a backing store.
+class SecretBackingStoreBatch
+{
+  public:
+
+    /// Types of mutation.
+    enum class OpType
+    {
+        SAVE,
+        UPDATE,
+        REMOVE
+    };
+
+    /// A single mutation.
+    struct Op
+    {
+        OpType mType;
+        std::string mName;
+        SecretSPtr mSecret;
+    };
+
+    /**
+    * Add the saving of a new secret to the batch.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret)
+    {
+        mOps.push_back({ OpType::SAVE, secret->getName(), secret });
+    }
+
+    /**
+    * Add the update of a changed secret to the batch.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret)
+    {
+        mOps.push_back({ OpType::UPDATE, name, secret });
+    }
+
+    /**
+    * Add the removal of a secret to the batch.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name)
+    {
+        mOps.push_back({ OpType::REMOVE, name, nullptr });
+    }
+
+    /// Get the mutations, in order.
+    const std::vector<Op>& getOps() const { return mOps; }
+
+    /// Number of mutations in the batch.
+    size_t size() const { return mOps.size(); }
+    bool empty() const { return mOps.empty(); }
+
+    /// Remove all mutations.
+    void clear() { mOps.clear(); }
+
+  private:
+
+    /// Our mutations, in order.
+    std::vector<Op> mOps {};
+};
+
+/// Interface to a backing store that can persist a batch of mutations in one operation.
+class BatchSecretBackingStore
+{
+  public:
+
+    /// Default destructor
+    virtual ~BatchSecretBackingStore() = default;
+
+    /**
+    * Persist all mutations in a batch, in order.
+    * @param batch The mutations to persist.
+    */
+    virtual void applyBatch(const SecretBackingStoreBatch& batch) = 0;
+};
+
+/**
+* Persist a batch of mutations to any backing store.
+* @param store The backing store to persist to.
+* @param batch The mutations to persist.
+*/
+inline void applyBatch(SecretBackingStore& store, const SecretBackingStoreBatch& batch)
+{
+    BatchSecretBackingStore* batchStore { dynamic_cast<BatchSecretBackingStore*>(&store) };
+    if(batchStore)
+    {
+        batchStore->applyBatch(batch);
+        return;
+    }
+
+    std::vector<SecretSPtr> saves {};
+    auto flushSaves = [&store, &saves]()
+    {
+        if(!saves.empty())
+        {
+            store.saveSecrets(saves);
+            saves.clear();
+        }
+    };
+
+    for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+    {
+        switch(op.mType)
+        {
+            case SecretBackingStoreBatch::OpType::SAVE:
+                saves.push_back(op.mSecret);
+                break;
+            case SecretBackingStoreBatch::OpType::UPDATE:
+                flushSaves();
+                store.updateSecret(op.mName, op.mSecret);
+                break;
+            case SecretBackingStoreBatch::OpType::REMOVE:
+                flushSaves();
+                store.removeSecret(op.mName);
+                break;
+        }
+    }
+    flushSaves();
+}
+
+}}
+
+#endif
@@ -0,0 +1,238 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * An ordered index of secret names, with cursors for paging through it.
+ *
+ * Cursors fetch one page at a time, taking the index lock only while a
+ * page is copied out. Each page resumes after the last name returned, so a
+ * cursor stays valid while the index changes underneath it; names added
+ * ahead of the cursor are seen and names removed are skipped.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_NAME_INDEX_H_
+#define _NCHAIN_SDK_SECRET_NAME_INDEX_H_
+
+#include <interface/SecretStore.h>
+
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of SecretNameIndex pointer type
+class SecretNameIndex;
+/// Unique pointer type
+using SecretNameIndexPtr = std::unique_ptr<SecretNameIndex>;
+/// Shared pointer type
+using SecretNameIndexSPtr = std::shared_ptr<SecretNameIndex>;
+
+/// An ordered, thread safe set of secret names.
+class SecretNameIndex
+{
+  public:
+
+    /// Add a name.
+    void insert(const std::string& name)
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        mNames.insert(name);
+    }
+
+    /// Remove a name.
+    void erase(const std::string& name)
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        mNames.erase(name);
+    }
+
+    /// Rename an entry.
+    void rename(const std::string& oldName, const std::string& newName)
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        mNames.erase(oldName);
+        mNames.insert(newName);
+    }
+
+    /// Replace the whole contents of the index.
+    void reset(std::set<std::string>&& names)
+    {
+        boost::unique_lock<boost::shared_mutex> lck { mMtx };
+        mNames.swap(names);
+    }
+
+    /// Number of names held.
+    size_t size() const
+    {
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        return mNames.size();
+    }
+
+    /**
+    * Copy out a page of names in order.
+    * @param from Name to start from.
+    * @param inclusive Whether to include from itself.
+    * @param end Name to stop before. An empty string means no limit.
+    * @param limit Maximum number of names to return.
+    * @return Up to limit names.
+    */
+    std::vector<std::string> page(const std::string& from, bool inclusive,
+                                  const std::string& end, size_t limit) const
+    {
+        std::vector<std::string> names {};
+        names.reserve(limit);
+
+        boost::shared_lock<boost::shared_mutex> lck { mMtx };
+        auto it = inclusive ? mNames.lower_bound(from) : mNames.upper_bound(from);
+        for(; it != mNames.end() && names.size() < limit; ++it)
+        {
+            if(!end.empty() && *it >= end)
+            {
+                break;
+            }
+            names.push_back(*it);
+        }
+        return names;
+    }
+
+  private:
+
+    /// A mutex for thread safety. Readers share it.
+    mutable boost::shared_mutex mMtx {};
+
+    /// Our names, in order.
+    std::set<std::string> mNames {};
+};
+
+/// A cursor over a range of a SecretNameIndex.
+class SecretNameCursor
+{
+  public:
+
+    /// Default number of names fetched per page.
+    static constexpr size_t DEFAULT_PAGE_SIZE { 1000 };
+
+    /**
+    * Constructor.
+    * @param index The index to scan.
+    * @param begin First name in the range.
+    * @param end Name to stop before. An empty string means no limit.
+    * @param pageSize Number of names fetched per page.
+    * @param afterBegin Start after begin rather than at it, to resume from
+    * an earlier cursor's position().
+    */
+    SecretNameCursor(const SecretNameIndexSPtr& index, const std::string& begin,
+                     const std::string& end, size_t pageSize = DEFAULT_PAGE_SIZE,
+                     bool afterBegin = false)
+    : mIndex{index}, mPosition{begin}, mEnd{end}, mPageSize{pageSize ? pageSize : 1}, mStarted{afterBegin}
+    {}
+
+    /**
+    * Fetch the next page of names.
+    * @param names Set to the next page of names.
+    * @return False once the range is exhausted.
+    */
+    bool next(std::vector<std::string>& names)
+    {
+        if(mDone)
+        {
+            names.clear();
+            return false;
+        }
+
+        names = mIndex->page(mPosition, !mStarted, mEnd, mPageSize);
+        mStarted = true;
+        if(names.size() < mPageSize)
+        {
+            mDone = true;
+        }
+        if(!names.empty())
+        {
+            mPosition = names.back();
+        }
+        return !names.empty();
+    }
+
+    /**
+    * Fetch the secrets for the next page of names. Secrets removed from the
+    * store since the page was read are skipped.
+    * @param secrets Set to the next page of secrets.
+    * @param store The secret store to fetch secrets from.
+    * @return False once the range is exhausted.
+    */
+    bool next(std::vector<SecretSPtr>& secrets, const SecretStore& store = SecretStore::get())
+    {
+        secrets.clear();
+        std::vector<std::string> names {};
+        while(secrets.empty() && next(names))
+        {
+            for(const std::string& name : names)
+            {
+                SecretSPtr secret { store.getSecret(name) };
+                if(secret)
+                {
+                    secrets.push_back(std::move(secret));
+                }
+            }
+        }
+        return !secrets.empty();
+    }
+
+    /**
+    * Get the last name returned, for resuming the scan later with a cursor
+    * that starts after it, such as IndexedSecretBackingStore::resumeScan().
+    * Only meaningful once next() has returned some names.
+    * @return The last name returned.
+    */
+    const std::string& position() const { return mPosition; }
+
+    /**
+    * Get the name a prefix scan should stop before.
+    * @param prefix The prefix to scan.
+    * @return The first name after all names with the prefix, or an empty
+    * string if there is no such name.
+    */
+    static std::string prefixEnd(std::string prefix)
+    {
+        while(!prefix.empty())
+        {
+            unsigned char& last { reinterpret_cast<unsigned char&>(prefix.back()) };
+            if(last != 0xff)
+            {
+                ++last;
+                return prefix;
+            }
+            prefix.pop_back();
+        }
+        return prefix;
+    }
+
+  private:
+
+    /// The index we scan.
+    SecretNameIndexSPtr mIndex {};
+
+    /// Where the next page starts.
+    std::string mPosition {};
+
+    /// Name to stop before.
+    std::string mEnd {};
+
+    /// Names per page.
+    size_t mPageSize {};
+
+    /// Whether the next page starts after mPosition rather than at it.
+    bool mStarted {false};
+
+    /// Whether we've reached the end.
+    bool mDone {false};
+};
+
+}}
+
+#endif
@@ -0,0 +1,44 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Support for reading a backing store's records without loading them into
+ * the secret store.
+ *
+ * loadAll() hands every stored secret to the secret store, which decrypts
+ * it. A decorator that only wants some of them decrypted, such as the
+ * tiered store, can instead read the serialised records from a backing
+ * store that implements SecretRecordSource, and load just the ones it
+ * wants.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_RECORD_SOURCE_H_
+#define _NCHAIN_SDK_SECRET_RECORD_SOURCE_H_
+
+#include <functional>
+#include <string>
+
+namespace nakasendo { namespace impl {
+
+/// Interface to a backing store that can read out its serialised records.
+class SecretRecordSource
+{
+  public:
+
+    /// Function called for each serialised secret.
+    using EmitFunc = std::function<void(std::string&&)>;
+
+    /// Default destructor
+    virtual ~SecretRecordSource() = default;
+
+    /**
+    * Read every stored secret, in its serialised and encrypted form, on the
+    * calling thread. Nothing is loaded into the secret store.
+    * @param emit Called for each serialised secret.
+    */
+    virtual void readAll(const EmitFunc& emit) = 0;
+};
+
+}}
+
+#endif
@@ -17,6 +17,13 @@
 namespace nakasendo { namespace impl
 {
 
+/// Forward declaration of SecretStoreImpl pointer type
+class SecretStoreImpl;
+/// Unique pointer type
+using SecretStoreImplPtr = std::unique_ptr<SecretStoreImpl>;
+/// Shared pointer type
+using SecretStoreImplSPtr = std::shared_ptr<SecretStoreImpl>;
+
 /// The implementation for a secret store.
 class SecretStoreImpl final : public SecretStore
 {
@@ -24,7 +31,7 @@ class SecretStoreImpl final : public SecretStore
     friend class SecretStoreTester;
 
   public:
-    /// Default constructor.
+    /// Default constructor. Creates an instance independent of SecretStore::get().
     SecretStoreImpl() = default;
 
     /// Forbid copying and assignment.
@@ -0,0 +1,161 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Seeding a backing store decorator's own view of the secret store.
+ *
+ * Some decorators keep their own view of what the secret store holds, such
+ * as an index or a snapshot. They can't build it in loadAll(), because the
+ * secret store calls that with its lock held, and asking the store for its
+ * contents from there deadlocks. Instead loadAll() marks the view as
+ * needing a seed. The view is seeded later, outside the store's lock, from
+ * a copy of the store's contents. Changes the store makes while the copy
+ * is being taken still reach the decorator as usual. They are recorded, so
+ * the stale entries for those names in the copy can be skipped.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_STORE_SEED_H_
+#define _NCHAIN_SDK_SECRET_STORE_SEED_H_
+
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace nakasendo { namespace impl {
+
+/// Tracks seeding a decorator's view of the secret store after a load.
+class SecretStoreSeed
+{
+  public:
+
+    /// Default constructor.
+    SecretStoreSeed() = default;
+
+    /// Forbid copying and assignment.
+    SecretStoreSeed(const SecretStoreSeed&) = delete;
+    SecretStoreSeed(SecretStoreSeed&&) = delete;
+    SecretStoreSeed& operator=(const SecretStoreSeed&) = delete;
+    SecretStoreSeed& operator=(SecretStoreSeed&&) = delete;
+
+    /**
+    * Mark the view as needing a seed, once the secret store has loaded.
+    * Call with the owner's lock held.
+    */
+    void reset()
+    {
+        mNeeded = true;
+        restart();
+    }
+
+    /**
+    * Mark the view as complete, once it has been replaced wholesale.
+    * Call with the owner's lock held.
+    */
+    void replaced()
+    {
+        mNeeded = false;
+        restart();
+    }
+
+    /**
+    * Find out whether the view still needs seeding. Call with the owner's
+    * lock held.
+    * @return True if the view has not been seeded since the last load.
+    */
+    bool needed() const { return mNeeded; }
+
+    /**
+    * Record that the secret store changed a name. Call with the owner's
+    * lock held, and before applying the change to the view.
+    * @param name The name added, changed or removed.
+    */
+    void touch(const std::string& name)
+    {
+        if(mSeeding)
+        {
+            mTouched.insert(name);
+        }
+    }
+
+    /**
+    * Find out whether a name in the copy being merged is stale. Call from
+    * the merge function.
+    * @param name The name to check.
+    * @return True if the store changed the name while the copy was taken.
+    */
+    bool stale(const std::string& name) const { return mTouched.count(name) != 0; }
+
+    /**
+    * Seed the view if it needs it. Only one seed runs at a time.
+    * @param mtx The owner's mutex, which guards its view and us. The caller
+    * must not hold it, nor the secret store's lock.
+    * @param fetch Called without the owner's lock to copy the secret store's
+    * contents.
+    * @param merge Called with the owner's lock held and the copy, to add to
+    * the view everything in the copy that is not stale.
+    */
+    template<typename Mutex, typename Fetch, typename Merge>
+    void seed(Mutex& mtx, const Fetch& fetch, const Merge& merge)
+    {
+        std::lock_guard<std::mutex> seedLck { mSeedMtx };
+        while(true)
+        {
+            uint64_t generation {};
+            {
+                std::lock_guard<Mutex> lck { mtx };
+                if(!mNeeded)
+                {
+                    return;
+                }
+                mSeeding = true;
+                mTouched.clear();
+                generation = mGeneration;
+            }
+
+            const auto contents = fetch();
+
+            std::lock_guard<Mutex> lck { mtx };
+            if(generation == mGeneration)
+            {
+                merge(contents);
+                mNeeded = false;
+                mSeeding = false;
+                mTouched.clear();
+                return;
+            }
+
+            // Reloaded or replaced while we were copying; start again if
+            // a seed is still needed
+        }
+    }
+
+  private:
+
+    /// Abandon any seed in progress.
+    void restart()
+    {
+        ++mGeneration;
+        mSeeding = false;
+        mTouched.clear();
+    }
+
+    /// Serialises seeds.
+    std::mutex mSeedMtx {};
+
+    /// Set when the view needs seeding.
+    bool mNeeded {false};
+
+    /// Set while a copy of the store is being taken and merged.
+    bool mSeeding {false};
+
+    /// Bumped on every load or replacement, to spot a seed overtaken by one.
+    uint64_t mGeneration {0};
+
+    /// Names changed by the store since the current seed began.
+    std::set<std::string> mTouched {};
+};
+
+}}
+
+#endif
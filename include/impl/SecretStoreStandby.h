@@ -0,0 +1,416 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * The receiving end of secret store log shipping.
+ *
+ * A standby connects to the socket of a primary using a
+ * LogShippingSecretBackingStore and applies everything it is sent to a
+ * local secret store and its own replica backing store, so the local store
+ * stays warm and fully loaded. If the connection is lost the standby keeps
+ * trying to reconnect, and is sent a full copy when it does. To take over
+ * from the primary, stop() the standby and use the local store as normal.
+ *
+ * Secrets are applied through the secret store's locked API, which persists
+ * them to the replica as usual. The local store must have the same master
+ * password as the primary, and the standby is given it too, to decrypt the
+ * secrets it is sent before handing them to the store.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_STORE_STANDBY_H_
+#define _NCHAIN_SDK_SECRET_STORE_STANDBY_H_
+
+#include <impl/LogShippingSecretBackingStore.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of SecretStoreStandby pointer type
+class SecretStoreStandby;
+/// Unique pointer type
+using SecretStoreStandbyPtr = std::unique_ptr<SecretStoreStandby>;
+/// Shared pointer type
+using SecretStoreStandbySPtr = std::shared_ptr<SecretStoreStandby>;
+
+/// A hot standby for a secret store, fed by log shipping.
+class SecretStoreStandby
+{
+  public:
+
+    /// Default milliseconds between attempts to connect to the primary.
+    static constexpr long DEFAULT_RECONNECT_MS { 500 };
+
+    /// Replication statistics.
+    struct Stats
+    {
+        /// Whether we're connected to the primary.
+        bool mConnected {false};
+        /// Number of full copies received.
+        uint64_t mSyncs {0};
+        /// Number of records applied.
+        uint64_t mRecordsApplied {0};
+    };
+
+    /**
+    * Constructor. Sets the replica as the local store's backing store,
+    * which loads whatever it already holds, and starts replicating.
+    * @param socketPath Path of the primary's socket.
+    * @param replica Backing store to persist replicated secrets to.
+    * @param passwd The master password, to decrypt replicated secrets with.
+    * @param reconnectInterval Time between attempts to connect to the primary.
+    * @param store The local secret store to replicate into.
+    */
+    SecretStoreStandby(const std::string& socketPath,
+                       const SecretBackingStoreSPtr& replica,
+                       const memory::SecureByteVec& passwd,
+                       std::chrono::milliseconds reconnectInterval = std::chrono::milliseconds { DEFAULT_RECONNECT_MS },
+                       SecretStore& store = SecretStore::get())
+    : mSocketPath{socketPath}, mReplica{replica}, mPasswd{passwd}, mReconnectInterval{reconnectInterval}, mStore(store)
+    {
+        if(!mReplica)
+        {
+            throw std::runtime_error("Standby requires a replica backing store");
+        }
+        if(mPasswd.empty())
+        {
+            throw std::runtime_error("Standby requires the master password");
+        }
+
+        mStore.setSecretBackingStore(mReplica);
+        mReceiver = std::thread { &SecretStoreStandby::receiverLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    SecretStoreStandby(const SecretStoreStandby&) = delete;
+    SecretStoreStandby(SecretStoreStandby&&) = delete;
+    SecretStoreStandby& operator=(const SecretStoreStandby&) = delete;
+    SecretStoreStandby& operator=(SecretStoreStandby&&) = delete;
+
+    /// Destructor. Stops replicating.
+    ~SecretStoreStandby()
+    {
+        stop();
+    }
+
+    /**
+    * Stop replicating, for example to take over from the primary. Anything
+    * received but not yet applied is discarded.
+    */
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mStopping = true;
+            if(mFd >= 0)
+            {
+                ::shutdown(mFd, SHUT_RDWR);
+            }
+        }
+        mCv.notify_all();
+        if(mReceiver.joinable())
+        {
+            mReceiver.join();
+        }
+    }
+
+    /**
+    * Wait until a full copy of the primary has been applied.
+    * @param timeout Maximum time to wait.
+    * @return True if we have a full copy.
+    */
+    bool waitForSync(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        return mCv.wait_for(lck, timeout, [this]{ return mStats.mSyncs > 0 || mStopping; }) && mStats.mSyncs > 0;
+    }
+
+    /**
+    * Wait until at least a number of records have been applied in total.
+    * @param numRecords Number of records to wait for.
+    * @param timeout Maximum time to wait.
+    * @return True if that many records have been applied.
+    */
+    bool waitForRecords(uint64_t numRecords, std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        return mCv.wait_for(lck, timeout, [this, numRecords]{ return mStats.mRecordsApplied >= numRecords || mStopping; })
+            && mStats.mRecordsApplied >= numRecords;
+    }
+
+    /**
+    * Get our replication statistics.
+    * @return The current statistics.
+    */
+    Stats getStats() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        return mStats;
+    }
+
+    /**
+    * Get and clear the last failure applying a record, if any. The
+    * connection is dropped and resynchronised after a failure.
+    * @return The last failure, or nullptr.
+    */
+    std::exception_ptr takeFailure()
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        std::exception_ptr failure { mFailure };
+        mFailure = nullptr;
+        return failure;
+    }
+
+  private:
+
+    /// Connect to the primary. Returns -1 if we're stopping.
+    int connect()
+    {
+        sockaddr_un addr {};
+        if(mSocketPath.size() >= sizeof(addr.sun_path))
+        {
+            throw std::runtime_error("Socket path " + mSocketPath + " is too long");
+        }
+        addr.sun_family = AF_UNIX;
+        std::strncpy(addr.sun_path, mSocketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(!mStopping)
+        {
+            const int fd { ::socket(AF_UNIX, SOCK_STREAM, 0) };
+            if(fd >= 0)
+            {
+                if(::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0)
+                {
+                    mFd = fd;
+                    mStats.mConnected = true;
+                    return fd;
+                }
+                ::close(fd);
+            }
+            mCv.wait_for(lck, mReconnectInterval, [this]{ return mStopping; });
+        }
+        return -1;
+    }
+
+    /// Read exactly len bytes. Returns false on end of stream or error.
+    static bool readAll(int fd, char* buffer, size_t len)
+    {
+        size_t got {0};
+        while(got < len)
+        {
+            const ssize_t res { ::recv(fd, buffer + got, len - got, 0) };
+            if(res < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if(res <= 0)
+            {
+                return false;
+            }
+            got += static_cast<size_t>(res);
+        }
+        return true;
+    }
+
+    /// Body of the receiving thread.
+    void receiverLoop()
+    {
+        while(true)
+        {
+            const int fd { connect() };
+            if(fd < 0)
+            {
+                return;
+            }
+
+            try
+            {
+                receive(fd);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> lck { mMtx };
+                mFailure = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lck { mMtx };
+            mFd = -1;
+            mStats.mConnected = false;
+            ::close(fd);
+        }
+    }
+
+    /// Apply records from a connection until it closes.
+    void receive(int fd)
+    {
+        char header[SecretLogRecord::HEADER_SIZE];
+        std::string body {};
+        while(readAll(fd, header, sizeof(header)))
+        {
+            const uint32_t len { SecretLogRecord::getUInt32(header) };
+            const char op { header[4] };
+            const uint32_t nameLen { SecretLogRecord::getUInt32(header + 5) };
+            if(len < SecretLogRecord::HEADER_SIZE - 4 || nameLen > len - (SecretLogRecord::HEADER_SIZE - 4))
+            {
+                throw std::runtime_error("Malformed record from " + mSocketPath);
+            }
+
+            body.resize(len - (SecretLogRecord::HEADER_SIZE - 4));
+            if(!readAll(fd, &body[0], body.size()))
+            {
+                return;
+            }
+            apply(op, body.substr(0, nameLen), body.substr(nameLen));
+
+            std::lock_guard<std::mutex> lck { mMtx };
+            ++mStats.mRecordsApplied;
+            if(op == SecretLogRecord::OP_SYNC_END)
+            {
+                ++mStats.mSyncs;
+            }
+            mCv.notify_all();
+        }
+    }
+
+    /// Apply a single record to the local store.
+    void apply(char op, const std::string& name, const std::string& payload)
+    {
+        switch(op)
+        {
+            case SecretLogRecord::OP_SET:
+            {
+                set(name, payload);
+                if(mSyncing)
+                {
+                    mSyncNames.insert(name);
+                }
+                break;
+            }
+
+            case SecretLogRecord::OP_UPDATE:
+            {
+                set(name, payload);
+                break;
+            }
+
+            case SecretLogRecord::OP_REMOVE:
+            {
+                removeIfPresent(name);
+                break;
+            }
+
+            case SecretLogRecord::OP_SYNC_BEGIN:
+            {
+                mSyncing = true;
+                mSyncNames.clear();
+                break;
+            }
+
+            case SecretLogRecord::OP_SYNC_END:
+            {
+                // Anything the primary no longer has goes
+                for(const std::string& existing : mStore.getAllSecretNames())
+                {
+                    if(!mSyncNames.count(existing))
+                    {
+                        removeIfPresent(existing);
+                    }
+                }
+                mSyncing = false;
+                mSyncNames.clear();
+                break;
+            }
+
+            default:
+                throw std::runtime_error("Unknown record type from " + mSocketPath);
+        }
+    }
+
+    /// Add or overwrite a secret, possibly renaming it, in the local store
+    /// and so the replica.
+    void set(const std::string& name, const std::string& payload)
+    {
+        std::istringstream str { payload };
+        SecretSPtr secret { std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str)) };
+        if(!secret)
+        {
+            throw std::runtime_error("Record for " + name + " is not a Secret");
+        }
+        secret->decryptSecret(mPasswd);
+
+        if(secret->getName() != name)
+        {
+            removeIfPresent(secret->getName());
+        }
+        if(mStore.getSecret(name))
+        {
+            mStore.replaceSecret(name, secret);
+        }
+        else
+        {
+            mStore.addSecret(secret);
+        }
+    }
+
+    /// Remove a secret from the local store, and so from the replica.
+    void removeIfPresent(const std::string& name)
+    {
+        if(mStore.getSecret(name))
+        {
+            mStore.removeSecret(name);
+        }
+    }
+
+    /// A mutex for our state.
+    mutable std::mutex mMtx {};
+
+    /// Signalled as records are applied, or when we're stopping.
+    std::condition_variable mCv {};
+
+    /// Path of the primary's socket.
+    std::string mSocketPath {};
+
+    /// Backing store for the local store.
+    SecretBackingStoreSPtr mReplica {};
+
+    /// The master password.
+    memory::SecureByteVec mPasswd {};
+
+    /// Time between attempts to connect.
+    std::chrono::milliseconds mReconnectInterval {};
+
+    /// The local store we replicate into.
+    SecretStore& mStore;
+
+    /// Our connection to the primary.
+    int mFd {-1};
+
+    /// Whether we're receiving a full copy, and the names in it so far.
+    /// Only used by the receiving thread.
+    bool mSyncing {false};
+    std::unordered_set<std::string> mSyncNames {};
+
+    /// Set to stop replicating.
+    bool mStopping {false};
+
+    /// Our statistics.
+    Stats mStats {};
+
+    /// Last failure applying a record.
+    std::exception_ptr mFailure {};
+
+    /// The receiving thread.
+    std::thread mReceiver {};
+};
+
+}}
+
+#endif
@@ -0,0 +1,312 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A batch of changes to the secret store, applied together and persisted
+ * with a single backing store call.
+ *
+ * Changes are collected with addSecret(), replaceSecret(), removeSecret()
+ * and setMetaData() and nothing happens until commit(). The whole batch is
+ * checked against the store before anything is applied, and if applying a
+ * change still fails, those already applied are undone. The resulting
+ * backing store mutations are persisted together through a
+ * TransactionalSecretBackingStore, which must be the store's backing store.
+ * If persisting them fails, the changes are undone in memory too.
+ *
+ * While a batch commits, changes other threads make to the store are held
+ * back in it as well; see TransactionalSecretBackingStore.
+ */
+
+#ifndef _NCHAIN_SDK_SECRET_WRITE_BATCH_H_
+#define _NCHAIN_SDK_SECRET_WRITE_BATCH_H_
+
+#include <impl/TransactionalSecretBackingStore.h>
+#include <impl/MetaDataCollectionImpl.h>
+#include <interface/SecretStore.h>
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// A batch of changes to the secret store.
+class SecretWriteBatch
+{
+  public:
+
+    /**
+    * Constructor.
+    * @param backingStore The transactional backing store the secret store
+    * has been set up with.
+    * @param store The secret store to apply changes to.
+    */
+    SecretWriteBatch(const TransactionalSecretBackingStoreSPtr& backingStore,
+                     SecretStore& store = SecretStore::get())
+    : mBackingStore{backingStore}, mStore(store)
+    {
+        if(!mBackingStore)
+        {
+            throw std::runtime_error("Write batch requires a transactional backing store");
+        }
+    }
+
+    /**
+    * Add a new secret to the store.
+    * @param secret The new secret to add.
+    */
+    void addSecret(const SecretSPtr& secret)
+    {
+        mChanges.push_back({ ChangeType::ADD, secret->getName(), secret, {} });
+    }
+
+    /**
+    * Replace an existing secret in the store.
+    * @param name The name of the secret currently in the store to replace.
+    * @param secret The new secret to replace the old one with.
+    */
+    void replaceSecret(const std::string& name, const SecretSPtr& secret)
+    {
+        mChanges.push_back({ ChangeType::REPLACE, name, secret, {} });
+    }
+
+    /**
+    * Remove the named secret from the store.
+    * @param name The name of the secret to erase.
+    */
+    void removeSecret(const std::string& name)
+    {
+        mChanges.push_back({ ChangeType::REMOVE, name, nullptr, {} });
+    }
+
+    /**
+    * Set a piece of metadata on a secret in the store.
+    * @param name The name of the secret.
+    * @param meta The metadata to set.
+    */
+    void setMetaData(const std::string& name, const MetaData& meta)
+    {
+        mChanges.push_back({ ChangeType::METADATA, name, nullptr, meta });
+    }
+
+    /// Number of changes in the batch.
+    size_t size() const { return mChanges.size(); }
+
+    /// Discard all changes.
+    void clear() { mChanges.clear(); }
+
+    /**
+    * Apply all changes to the secret store and persist them. Throws without
+    * applying anything if a change would fail, for example because a secret
+    * to replace doesn't exist. If persisting fails, the changes are undone
+    * and the failure is rethrown. The batch is left empty on success.
+    */
+    void commit()
+    {
+        validate();
+
+        std::vector<std::function<void()>> undo {};
+        undo.reserve(mChanges.size());
+
+        mBackingStore->beginBatch();
+        try
+        {
+            for(const Change& change : mChanges)
+            {
+                apply(change, undo);
+            }
+        }
+        catch(...)
+        {
+            // The held back mutations are persisted after the undo, which
+            // leaves the backing store unchanged overall.
+            undoAll(undo);
+            mBackingStore->commitBatch();
+            throw;
+        }
+
+        try
+        {
+            mBackingStore->commitBatch();
+        }
+        catch(...)
+        {
+            // Our mutations are still held back, along with those of other
+            // threads. Undoing ours cancels them out, and the rest are
+            // persisted when this or a later commit succeeds.
+            mBackingStore->beginBatch();
+            undoAll(undo);
+            try
+            {
+                mBackingStore->commitBatch();
+            }
+            catch(...)
+            {
+                // Still held; retried by the next commit
+            }
+            throw;
+        }
+        mChanges.clear();
+    }
+
+  private:
+
+    /// Types of change.
+    enum class ChangeType
+    {
+        ADD,
+        REPLACE,
+        REMOVE,
+        METADATA
+    };
+
+    /// A single change.
+    struct Change
+    {
+        ChangeType mType;
+        std::string mName;
+        SecretSPtr mSecret;
+        MetaData mMeta;
+    };
+
+    /// Check every change will succeed against the current store contents.
+    void validate() const
+    {
+        // Names the batch itself adds (true) or removes (false)
+        std::unordered_map<std::string, bool> names {};
+        auto exists = [this, &names](const std::string& name)
+        {
+            const auto it = names.find(name);
+            return it != names.end() ? it->second : static_cast<bool>(mStore.getSecret(name));
+        };
+
+        for(const Change& change : mChanges)
+        {
+            switch(change.mType)
+            {
+                case ChangeType::ADD:
+                    if(exists(change.mName))
+                    {
+                        throw std::runtime_error("Secret named " + change.mName + " already exists in the store");
+                    }
+                    names[change.mName] = true;
+                    break;
+
+                case ChangeType::REPLACE:
+                    if(!exists(change.mName))
+                    {
+                        throw std::runtime_error("Secret named " + change.mName + " not found in the store");
+                    }
+                    if(change.mSecret->getName() != change.mName && exists(change.mSecret->getName()))
+                    {
+                        throw std::runtime_error("Secret named " + change.mSecret->getName() + " already exists in the store");
+                    }
+                    names[change.mName] = false;
+                    names[change.mSecret->getName()] = true;
+                    break;
+
+                case ChangeType::REMOVE:
+                case ChangeType::METADATA:
+                    if(!exists(change.mName))
+                    {
+                        throw std::runtime_error("Secret named " + change.mName + " not found in the store");
+                    }
+                    names[change.mName] = (change.mType == ChangeType::METADATA);
+                    break;
+            }
+        }
+    }
+
+    /// Run an undo list in reverse, carrying on past failures.
+    static void undoAll(const std::vector<std::function<void()>>& undo)
+    {
+        for(auto it = undo.rbegin(); it != undo.rend(); ++it)
+        {
+            try
+            {
+                (*it)();
+            }
+            catch(...)
+            {
+                // Carry on undoing what we can
+            }
+        }
+    }
+
+    /// Apply a single change, recording how to undo it.
+    void apply(const Change& change, std::vector<std::function<void()>>& undo)
+    {
+        SecretStore& store { mStore };
+        switch(change.mType)
+        {
+            case ChangeType::ADD:
+            {
+                store.addSecret(change.mSecret);
+                const std::string name { change.mName };
+                undo.push_back([&store, name]{ store.removeSecret(name); });
+                break;
+            }
+
+            case ChangeType::REPLACE:
+            {
+                SecretSPtr old { store.getSecret(change.mName) };
+                store.replaceSecret(change.mName, change.mSecret);
+                const std::string name { change.mSecret->getName() };
+                undo.push_back([&store, name, old]{ store.replaceSecret(name, old); });
+                break;
+            }
+
+            case ChangeType::REMOVE:
+            {
+                SecretSPtr old { store.getSecret(change.mName) };
+                store.removeSecret(change.mName);
+                undo.push_back([&store, old]{ store.addSecret(old); });
+                break;
+            }
+
+            case ChangeType::METADATA:
+            {
+                SecretSPtr secret { store.getSecret(change.mName) };
+                if(!secret)
+                {
+                    throw std::runtime_error("Secret named " + change.mName + " not found in the store");
+                }
+                const std::shared_ptr<MetaDataCollectionImpl> meta {
+                    std::dynamic_pointer_cast<MetaDataCollectionImpl>(
+                        std::const_pointer_cast<MetaDataCollection>(secret->getMetaDataCollection())) };
+                if(!meta)
+                {
+                    throw std::runtime_error("Metadata of secret " + change.mName + " can't be changed in a batch");
+                }
+
+                // Change the live secret, so anyone holding it sees the
+                // change, and persist through our store rather than the
+                // default one Secret::setMetaData() uses. Undo restores the
+                // whole collection, since keys can't be removed.
+                const MetaDataCollectionImpl before { *meta };
+                meta->setMetaData(change.mMeta);
+                const std::string name { change.mName };
+                store.secretUpdated(name);
+                undo.push_back([&store, name, meta, before]{
+                    *meta = before;
+                    store.secretUpdated(name);
+                });
+                break;
+            }
+        }
+    }
+
+    /// The backing store our changes are persisted through.
+    TransactionalSecretBackingStoreSPtr mBackingStore {};
+
+    /// The store we change.
+    SecretStore& mStore;
+
+    /// Changes waiting to be committed, in order.
+    std::vector<Change> mChanges {};
+};
+
+}}
+
+#endif
@@ -0,0 +1,923 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Publishing of the secret store into shared memory, for read-only use by
+ * other processes such as pre-forked workers.
+ *
+ * The owning process wraps its backing store in a
+ * SharedMemorySecretBackingStore, which publishes each secret's serialised,
+ * encrypted record into a POSIX shared memory segment. Worker processes
+ * open the segment read-only with a SharedMemorySecretReader and look
+ * secrets up directly, with no IPC round trip, no locking and no copy of
+ * the store of their own.
+ * Segments are created readable only by the owner's user unless the owner
+ * asks for wider permissions.
+ *
+ * A segment holds an open-addressing hash index followed by the records.
+ * Records are never modified once written; an update appends a new record
+ * and then atomically repoints the name's index slot at it, so readers
+ * always see either the old or the new record. When a segment fills up the
+ * live records are copied to a new, larger segment and a generation number
+ * in a small control segment is bumped. Readers notice and switch over on
+ * their next lookup; the old segment stays mapped until they do.
+ *
+ * When the secret store loads, its contents are published by a background
+ * thread, outside the store's lock. Until then readers keep seeing what was
+ * published before, along with any changes made since.
+ */
+
+#ifndef _NCHAIN_SDK_SHARED_MEMORY_SECRET_STORE_H_
+#define _NCHAIN_SDK_SHARED_MEMORY_SECRET_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretStoreSeed.h>
+#include <impl/JSONSerialiser.h>
+#include <interface/SecretStore.h>
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+
+namespace nakasendo { namespace impl {
+
+/// Layout of the shared memory segments.
+struct SharedSecretSegment
+{
+    static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory store requires lock-free 64 bit atomics");
+
+    /// Segment identification.
+    static constexpr const char* CONTROL_MAGIC { "NKSSHMC" };
+    static constexpr const char* DATA_MAGIC { "NKSSHMD" };
+
+    /// Index slot values that aren't record offsets.
+    static constexpr uint64_t SLOT_EMPTY { 0 };
+    static constexpr uint64_t SLOT_REMOVED { 1 };
+
+    /// The control segment, which says which data segment is current.
+    struct ControlBlock
+    {
+        char mMagic[8];
+        std::atomic<uint64_t> mGeneration;
+    };
+
+    /// Start of a data segment. Followed by the index slots, then the records.
+    struct DataHeader
+    {
+        char mMagic[8];
+        uint64_t mSize;
+        uint64_t mNumSlots;
+        uint64_t mDataStart;
+    };
+
+    /// Start of a record. Followed by the name, then the payload.
+    struct RecordHeader
+    {
+        uint64_t mHash;
+        uint32_t mNameLen;
+        uint32_t mPayloadLen;
+    };
+
+    /// Name of the data segment for a generation.
+    static std::string dataName(const std::string& name, uint64_t generation)
+    {
+        return name + "." + std::to_string(generation);
+    }
+
+    /// FNV-1a hash of a name.
+    static uint64_t hashName(const std::string& name)
+    {
+        uint64_t hash { 0xcbf29ce484222325ULL };
+        for(char c : name)
+        {
+            hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+        }
+        return hash;
+    }
+
+    /// Round up to a multiple of 8.
+    static uint64_t align(uint64_t val)
+    {
+        return (val + 7) & ~static_cast<uint64_t>(7);
+    }
+
+    /// The index slots of a mapped data segment.
+    static std::atomic<uint64_t>* slots(void* base)
+    {
+        return reinterpret_cast<std::atomic<uint64_t>*>(static_cast<char*>(base) + sizeof(DataHeader));
+    }
+
+    /**
+    * Look a name up in a mapped data segment.
+    * @param base Start of the mapped segment.
+    * @param size Size of the mapping.
+    * @param name The name to look for.
+    * @param payload Set to the record payload if found.
+    * @return True if found.
+    */
+    static bool find(void* base, uint64_t size, const std::string& name, std::string& payload)
+    {
+        const DataHeader& hdr { *static_cast<const DataHeader*>(base) };
+        const char* data { static_cast<const char*>(base) };
+        std::atomic<uint64_t>* slot { slots(base) };
+        const uint64_t hash { hashName(name) };
+        const uint64_t mask { hdr.mNumSlots - 1 };
+
+        for(uint64_t i = 0, pos = hash & mask; i < hdr.mNumSlots; ++i, pos = (pos + 1) & mask)
+        {
+            const uint64_t offset { slot[pos].load(std::memory_order_acquire) };
+            if(offset == SLOT_EMPTY)
+            {
+                return false;
+            }
+            if(offset == SLOT_REMOVED || offset < hdr.mDataStart || offset + sizeof(RecordHeader) > size)
+            {
+                continue;
+            }
+
+            const RecordHeader& rec { *reinterpret_cast<const RecordHeader*>(data + offset) };
+            if(rec.mHash != hash || rec.mNameLen != name.size() ||
+               offset + sizeof(RecordHeader) + rec.mNameLen + rec.mPayloadLen > size)
+            {
+                continue;
+            }
+            const char* recName { data + offset + sizeof(RecordHeader) };
+            if(name.compare(0, name.size(), recName, rec.mNameLen) == 0)
+            {
+                payload.assign(recName + rec.mNameLen, rec.mPayloadLen);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/// Forward declaration of SharedMemorySecretBackingStore pointer type
+class SharedMemorySecretBackingStore;
+/// Unique pointer type
+using SharedMemorySecretBackingStorePtr = std::unique_ptr<SharedMemorySecretBackingStore>;
+/// Shared pointer type
+using SharedMemorySecretBackingStoreSPtr = std::shared_ptr<SharedMemorySecretBackingStore>;
+
+/// Wrapper around another secret backing store that publishes to shared memory.
+class SharedMemorySecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /// Default minimum size for record space in a segment.
+    static constexpr uint64_t DEFAULT_INITIAL_SIZE { 1024 * 1024 };
+
+    /// Default permissions for our segments; only our own user may read them.
+    static constexpr unsigned DEFAULT_PERMISSIONS { 0600 };
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param name Name of the shared memory to publish to, for example
+    * "/nakasendo-secrets". Anything already published under this name is replaced.
+    * @param initialSize Minimum size for record space in a segment.
+    * @param permissions Permissions for our segments. Readers need read
+    * access, so widen this to a group if they run as a different user.
+    * @param secretStore The secret store we publish the contents of.
+    */
+    SharedMemorySecretBackingStore(const SecretBackingStoreSPtr& store,
+                                   const std::string& name,
+                                   uint64_t initialSize = DEFAULT_INITIAL_SIZE,
+                                   unsigned permissions = DEFAULT_PERMISSIONS,
+                                   SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore), mName{name}, mInitialSize{initialSize},
+      mPermissions{permissions}
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Shared memory store requires a backing store to wrap");
+        }
+
+        try
+        {
+            boost::interprocess::shared_memory_object::remove(mName.c_str());
+            mControlShm = boost::interprocess::shared_memory_object {
+                boost::interprocess::create_only, mName.c_str(), boost::interprocess::read_write, mPermissions };
+            mControlShm.truncate(sizeof(SharedSecretSegment::ControlBlock));
+            mControlRegion = boost::interprocess::mapped_region { mControlShm, boost::interprocess::read_write };
+        }
+        catch(boost::interprocess::interprocess_exception& e)
+        {
+            throw std::runtime_error("Failed to create shared memory " + mName + ": " + e.what());
+        }
+
+        SharedSecretSegment::ControlBlock& control { controlBlock() };
+        control.mGeneration.store(0, std::memory_order_relaxed);
+        std::memcpy(control.mMagic, SharedSecretSegment::CONTROL_MAGIC, sizeof(control.mMagic));
+
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            rebuild(0);
+        }
+        mPublisher = std::thread { &SharedMemorySecretBackingStore::publisherLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    SharedMemorySecretBackingStore(const SharedMemorySecretBackingStore&) = delete;
+    SharedMemorySecretBackingStore(SharedMemorySecretBackingStore&&) = delete;
+    SharedMemorySecretBackingStore& operator=(const SharedMemorySecretBackingStore&) = delete;
+    SharedMemorySecretBackingStore& operator=(SharedMemorySecretBackingStore&&) = delete;
+
+    /// Destructor. Withdraws the published segments; readers keep what they have mapped.
+    ~SharedMemorySecretBackingStore() override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mStopping = true;
+        }
+        mPublishCv.notify_all();
+        if(mPublisher.joinable())
+        {
+            mPublisher.join();
+        }
+
+        boost::interprocess::shared_memory_object::remove(
+            SharedSecretSegment::dataName(mName, mGeneration).c_str());
+        boost::interprocess::shared_memory_object::remove(mName.c_str());
+    }
+
+    /**
+    * Get whether the current segment is locked into RAM.
+    * @return True if locked.
+    */
+    bool isLocked() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        return mLocked;
+    }
+
+    /**
+    * Publish the secret store's contents now, if they haven't been
+    * published since it last loaded. Otherwise that happens in the
+    * background. Must not be called with the secret store's lock held,
+    * such as from within a backing store call.
+    */
+    void publishAll()
+    {
+        ensureSeeded();
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        mStore->saveSecret(secret);
+        const std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        publish(secret->getName(), payload);
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->saveSecrets(secrets);
+        const std::vector<std::string> payloads { serialiseAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            publish(secrets[i]->getName(), payloads[i]);
+        }
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        mStore->updateSecret(name, secret);
+        const std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        if(secret->getName() != name)
+        {
+            withdraw(name);
+        }
+        publish(secret->getName(), payload);
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        mStore->removeSecret(name);
+        std::lock_guard<std::mutex> lck { mMtx };
+        withdraw(name);
+    }
+
+    /**
+    * Load all stored secrets. Everything in the secret store is published
+    * in the background once it has loaded.
+    */
+    void loadAll() override
+    {
+        mStore->loadAll();
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mSeed.reset();
+        }
+        mPublishCv.notify_one();
+    }
+
+    /**
+    * Replace the contents of the backing store, and publish the new contents.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->replaceAll(secrets);
+        republish(secrets, serialiseAll(secrets));
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        impl::applyBatch(*mStore, batch);
+
+        std::vector<std::string> payloads {};
+        payloads.reserve(batch.size());
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            payloads.push_back(op.mSecret ? JSONSerialiser::serialise(*op.mSecret) : std::string {});
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        auto payload = payloads.begin();
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            if(op.mType == SecretBackingStoreBatch::OpType::REMOVE ||
+               (op.mType == SecretBackingStoreBatch::OpType::UPDATE && op.mSecret->getName() != op.mName))
+            {
+                withdraw(op.mName);
+            }
+            if(op.mType != SecretBackingStoreBatch::OpType::REMOVE)
+            {
+                publish(op.mSecret->getName(), *payload);
+            }
+            ++payload;
+        }
+    }
+
+  private:
+
+    /// Where a published name lives.
+    struct Entry
+    {
+        uint64_t mSlot;
+        uint64_t mOffset;
+    };
+
+    /// Serialise some secrets.
+    static std::vector<std::string> serialiseAll(const std::vector<SecretSPtr>& secrets)
+    {
+        std::vector<std::string> payloads {};
+        payloads.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            payloads.push_back(JSONSerialiser::serialise(*secret));
+        }
+        return payloads;
+    }
+
+    /// Our control block.
+    SharedSecretSegment::ControlBlock& controlBlock()
+    {
+        return *static_cast<SharedSecretSegment::ControlBlock*>(mControlRegion.get_address());
+    }
+
+    /// Our current data segment header.
+    SharedSecretSegment::DataHeader& dataHeader()
+    {
+        return *static_cast<SharedSecretSegment::DataHeader*>(mDataRegion.get_address());
+    }
+
+    /// Space taken by a record.
+    static uint64_t recordSize(const std::string& name, const std::string& payload)
+    {
+        return SharedSecretSegment::align(sizeof(SharedSecretSegment::RecordHeader) + name.size() + payload.size());
+    }
+
+    /// Size of the live record at an offset.
+    uint64_t liveRecordSize(uint64_t offset)
+    {
+        const SharedSecretSegment::RecordHeader& rec { *reinterpret_cast<const SharedSecretSegment::RecordHeader*>(
+            static_cast<const char*>(mDataRegion.get_address()) + offset) };
+        return SharedSecretSegment::align(sizeof(rec) + rec.mNameLen + rec.mPayloadLen);
+    }
+
+    /// Append a record to the current segment. Called with our mutex held and space available.
+    uint64_t writeRecord(const std::string& name, const std::string& payload)
+    {
+        const uint64_t offset { mDataEnd };
+        char* data { static_cast<char*>(mDataRegion.get_address()) };
+        SharedSecretSegment::RecordHeader rec { SharedSecretSegment::hashName(name),
+            static_cast<uint32_t>(name.size()), static_cast<uint32_t>(payload.size()) };
+        std::memcpy(data + offset, &rec, sizeof(rec));
+        std::memcpy(data + offset + sizeof(rec), name.data(), name.size());
+        std::memcpy(data + offset + sizeof(rec) + name.size(), payload.data(), payload.size());
+        mDataEnd += recordSize(name, payload);
+        return offset;
+    }
+
+    /// Publish a secret's record. Called with our mutex held.
+    void publish(const std::string& name, const std::string& payload)
+    {
+        mSeed.touch(name);
+        const uint64_t size { recordSize(name, payload) };
+        auto it = mEntries.find(name);
+        const bool needSlot { it == mEntries.end() };
+        if(mDataEnd + size > dataHeader().mSize || (needSlot && (mUsedSlots + 1) * 2 > dataHeader().mNumSlots))
+        {
+            rebuild(size);
+            it = mEntries.find(name);
+        }
+
+        const uint64_t offset { writeRecord(name, payload) };
+        std::atomic<uint64_t>* slots { SharedSecretSegment::slots(mDataRegion.get_address()) };
+        if(it != mEntries.end())
+        {
+            // Readers switch atomically from the old record to the new
+            mLiveBytes -= liveRecordSize(it->second.mOffset);
+            it->second.mOffset = offset;
+            slots[it->second.mSlot].store(offset, std::memory_order_release);
+        }
+        else
+        {
+            const uint64_t slot { freeSlot(name) };
+            mEntries[name] = { slot, offset };
+            ++mUsedSlots;
+            slots[slot].store(offset, std::memory_order_release);
+        }
+        mLiveBytes += size;
+    }
+
+    /// Withdraw a secret's record. Called with our mutex held.
+    void withdraw(const std::string& name)
+    {
+        mSeed.touch(name);
+        const auto it = mEntries.find(name);
+        if(it != mEntries.end())
+        {
+            // The slot stays in use as a marker so later probes carry on past it
+            SharedSecretSegment::slots(mDataRegion.get_address())[it->second.mSlot].store(
+                SharedSecretSegment::SLOT_REMOVED, std::memory_order_release);
+            mLiveBytes -= liveRecordSize(it->second.mOffset);
+            mEntries.erase(it);
+        }
+    }
+
+    /// Find an empty slot for a name. Called with our mutex held.
+    uint64_t freeSlot(const std::string& name)
+    {
+        const std::atomic<uint64_t>* slots { SharedSecretSegment::slots(mDataRegion.get_address()) };
+        const uint64_t mask { dataHeader().mNumSlots - 1 };
+        uint64_t pos { SharedSecretSegment::hashName(name) & mask };
+        while(slots[pos].load(std::memory_order_relaxed) != SharedSecretSegment::SLOT_EMPTY)
+        {
+            pos = (pos + 1) & mask;
+        }
+        return pos;
+    }
+
+    /// Replace everything published.
+    void republish(const std::vector<SecretSPtr>& secrets, const std::vector<std::string>& payloads)
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.replaced();
+        uint64_t bytes {0};
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            bytes += recordSize(secrets[i]->getName(), payloads[i]);
+        }
+
+        mEntries.clear();
+        mLiveBytes = 0;
+        rebuild(bytes, secrets.size());
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            publish(secrets[i]->getName(), payloads[i]);
+        }
+    }
+
+    /**
+    * Publish the secret store's contents if a load left them unpublished.
+    * Names the store changed meanwhile are already published as they are
+    * now; anything else published that the store no longer has is withdrawn.
+    * Called without our mutex.
+    */
+    void ensureSeeded()
+    {
+        using Payloads = std::vector<std::pair<std::string, std::string>>;
+        mSeed.seed(mMtx,
+            [this]
+            {
+                const std::vector<SecretSPtr> secrets { mSecretStore.getAllSecrets() };
+                std::vector<std::string> payloads { serialiseAll(secrets) };
+                Payloads entries {};
+                entries.reserve(secrets.size());
+                for(size_t i = 0; i < secrets.size(); ++i)
+                {
+                    entries.emplace_back(secrets[i]->getName(), std::move(payloads[i]));
+                }
+                return entries;
+            },
+            [this](const Payloads& entries)
+            {
+                std::unordered_set<std::string> names {};
+                for(const auto& entry : entries)
+                {
+                    names.insert(entry.first);
+                }
+                std::vector<std::string> gone {};
+                for(const auto& entry : mEntries)
+                {
+                    if(!names.count(entry.first) && !mSeed.stale(entry.first))
+                    {
+                        gone.push_back(entry.first);
+                    }
+                }
+                for(const std::string& name : gone)
+                {
+                    withdraw(name);
+                }
+
+                for(const auto& entry : entries)
+                {
+                    if(!mSeed.stale(entry.first))
+                    {
+                        publish(entry.first, entry.second);
+                    }
+                }
+            });
+    }
+
+    /// Body of the publishing thread.
+    void publisherLoop()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(true)
+        {
+            mPublishCv.wait(lck, [this]{ return mStopping || mSeed.needed(); });
+            if(mStopping)
+            {
+                return;
+            }
+
+            lck.unlock();
+            try
+            {
+                ensureSeeded();
+            }
+            catch(...)
+            {
+                // Try again shortly
+                lck.lock();
+                mPublishCv.wait_for(lck, std::chrono::seconds {1}, [this]{ return mStopping; });
+                continue;
+            }
+            lck.lock();
+        }
+    }
+
+    /**
+    * Copy the live records to a new, bigger segment and switch readers to it.
+    * Called with our mutex held.
+    * @param extraBytes Record space needed on top of the live records.
+    * @param extraNames Index slots needed on top of the live names.
+    */
+    void rebuild(uint64_t extraBytes, uint64_t extraNames = 1)
+    {
+        const uint64_t needNames { mEntries.size() + extraNames };
+        uint64_t numSlots { 64 };
+        while(numSlots < needNames * 4)
+        {
+            numSlots *= 2;
+        }
+        const uint64_t dataStart { SharedSecretSegment::align(
+            sizeof(SharedSecretSegment::DataHeader) + numSlots * sizeof(std::atomic<uint64_t>)) };
+        const uint64_t size { dataStart + std::max(mInitialSize, 2 * (mLiveBytes + extraBytes)) };
+
+        const uint64_t generation { mGeneration + 1 };
+        const std::string name { SharedSecretSegment::dataName(mName, generation) };
+        boost::interprocess::shared_memory_object shm {};
+        boost::interprocess::mapped_region region {};
+        try
+        {
+            boost::interprocess::shared_memory_object::remove(name.c_str());
+            shm = boost::interprocess::shared_memory_object {
+                boost::interprocess::create_only, name.c_str(), boost::interprocess::read_write, mPermissions };
+            shm.truncate(static_cast<boost::interprocess::offset_t>(size));
+            region = boost::interprocess::mapped_region { shm, boost::interprocess::read_write };
+        }
+        catch(boost::interprocess::interprocess_exception& e)
+        {
+            boost::interprocess::shared_memory_object::remove(name.c_str());
+            throw std::runtime_error("Failed to create shared memory " + name + ": " + e.what());
+        }
+
+        // New segments are zero filled, so every slot starts empty
+        SharedSecretSegment::DataHeader& hdr { *static_cast<SharedSecretSegment::DataHeader*>(region.get_address()) };
+        std::memcpy(hdr.mMagic, SharedSecretSegment::DATA_MAGIC, sizeof(hdr.mMagic));
+        hdr.mSize = size;
+        hdr.mNumSlots = numSlots;
+        hdr.mDataStart = dataStart;
+
+        // Copy the live records across
+        boost::interprocess::mapped_region oldRegion { std::move(mDataRegion) };
+        std::unordered_map<std::string, Entry> oldEntries {};
+        oldEntries.swap(mEntries);
+        mDataRegion = std::move(region);
+        mDataEnd = dataStart;
+        mUsedSlots = 0;
+        mLiveBytes = 0;
+        for(const auto& entry : oldEntries)
+        {
+            const char* rec { static_cast<const char*>(oldRegion.get_address()) + entry.second.mOffset };
+            const SharedSecretSegment::RecordHeader& recHdr { *reinterpret_cast<const SharedSecretSegment::RecordHeader*>(rec) };
+            const std::string payload { rec + sizeof(recHdr) + recHdr.mNameLen, recHdr.mPayloadLen };
+            const uint64_t offset { writeRecord(entry.first, payload) };
+            const uint64_t slot { freeSlot(entry.first) };
+            SharedSecretSegment::slots(mDataRegion.get_address())[slot].store(offset, std::memory_order_relaxed);
+            mEntries[entry.first] = { slot, offset };
+            ++mUsedSlots;
+            mLiveBytes += recordSize(entry.first, payload);
+        }
+
+        // Keep secrets out of swap where we can
+        mLocked = (::mlock(mDataRegion.get_address(), mDataRegion.get_size()) == 0);
+
+        // Switch readers over, then withdraw the old segment's name. Readers
+        // that have it mapped keep it until they switch.
+        controlBlock().mGeneration.store(generation, std::memory_order_release);
+        if(mGeneration)
+        {
+            boost::interprocess::shared_memory_object::remove(
+                SharedSecretSegment::dataName(mName, mGeneration).c_str());
+        }
+        mGeneration = generation;
+    }
+
+    /// A mutex for publishing.
+    mutable std::mutex mMtx {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store we publish the contents of.
+    SecretStore& mSecretStore;
+
+    /// Name of our shared memory.
+    std::string mName {};
+
+    /// Minimum record space in a segment.
+    uint64_t mInitialSize {};
+
+    /// Permissions for our segments.
+    boost::interprocess::permissions mPermissions {};
+
+    /// The control segment.
+    boost::interprocess::shared_memory_object mControlShm {};
+    boost::interprocess::mapped_region mControlRegion {};
+
+    /// The current data segment.
+    boost::interprocess::mapped_region mDataRegion {};
+
+    /// Generation of the current data segment.
+    uint64_t mGeneration {0};
+
+    /// End of the records written to the current segment.
+    uint64_t mDataEnd {0};
+
+    /// Index slots in use, including those of withdrawn records.
+    uint64_t mUsedSlots {0};
+
+    /// Space taken by live records.
+    uint64_t mLiveBytes {0};
+
+    /// Whether the current segment is locked into RAM.
+    bool mLocked {false};
+
+    /// Where each published name lives.
+    std::unordered_map<std::string, Entry> mEntries {};
+
+    /// Seeds what we publish after a load.
+    SecretStoreSeed mSeed {};
+
+    /// Signalled when there is a load to publish, or we're stopping.
+    std::condition_variable mPublishCv {};
+
+    /// Set to stop the publishing thread.
+    bool mStopping {false};
+
+    /// The publishing thread.
+    std::thread mPublisher {};
+};
+
+/// Forward declaration of SharedMemorySecretReader pointer type
+class SharedMemorySecretReader;
+/// Unique pointer type
+using SharedMemorySecretReaderPtr = std::unique_ptr<SharedMemorySecretReader>;
+/// Shared pointer type
+using SharedMemorySecretReaderSPtr = std::shared_ptr<SharedMemorySecretReader>;
+
+/// Read-only access to secrets published by a SharedMemorySecretBackingStore.
+class SharedMemorySecretReader
+{
+  public:
+
+    /**
+    * Constructor.
+    * @param name Name of the shared memory the secrets are published to.
+    */
+    SharedMemorySecretReader(const std::string& name)
+    : mName{name}
+    {
+        try
+        {
+            boost::interprocess::shared_memory_object shm {
+                boost::interprocess::open_only, mName.c_str(), boost::interprocess::read_only };
+            mControlRegion = boost::interprocess::mapped_region { shm, boost::interprocess::read_only };
+        }
+        catch(boost::interprocess::interprocess_exception& e)
+        {
+            throw std::runtime_error("Failed to open shared memory " + mName + ": " + e.what());
+        }
+
+        if(mControlRegion.get_size() < sizeof(SharedSecretSegment::ControlBlock) ||
+           std::memcmp(controlBlock().mMagic, SharedSecretSegment::CONTROL_MAGIC, sizeof(controlBlock().mMagic)) != 0)
+        {
+            throw std::runtime_error("Shared memory " + mName + " is not a published secret store");
+        }
+    }
+
+    /// Forbid copying and assignment.
+    SharedMemorySecretReader(const SharedMemorySecretReader&) = delete;
+    SharedMemorySecretReader(SharedMemorySecretReader&&) = delete;
+    SharedMemorySecretReader& operator=(const SharedMemorySecretReader&) = delete;
+    SharedMemorySecretReader& operator=(SharedMemorySecretReader&&) = delete;
+
+    /**
+    * Fetch the serialised, encrypted record of a secret.
+    * @param name The name of the secret to lookup.
+    * @param payload Set to the serialised secret if found.
+    * @return True if found.
+    */
+    bool getRecord(const std::string& name, std::string& payload)
+    {
+        const std::shared_ptr<const Segment> segment { currentSegment() };
+        return SharedSecretSegment::find(segment->mRegion.get_address(), segment->mRegion.get_size(), name, payload);
+    }
+
+    /**
+    * Fetch a secret by name. The secret is returned encrypted.
+    * @param name The name of the secret to lookup.
+    * @return A pointer to the requested secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name)
+    {
+        std::string payload {};
+        if(!getRecord(name, payload))
+        {
+            return nullptr;
+        }
+
+        std::istringstream str { payload };
+        SecretSPtr secret { std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str)) };
+        if(!secret)
+        {
+            throw std::runtime_error("Record for " + name + " is not a Secret");
+        }
+        return secret;
+    }
+
+    /**
+    * Fetch a secret by name and decrypt it.
+    * @param name The name of the secret to lookup.
+    * @param passwd The master password the secrets were encrypted with.
+    * @return A pointer to the requested secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name, const memory::SecureByteVec& passwd)
+    {
+        SecretSPtr secret { getSecret(name) };
+        if(secret)
+        {
+            secret->decryptSecret(passwd);
+        }
+        return secret;
+    }
+
+  private:
+
+    /// A mapped data segment.
+    struct Segment
+    {
+        uint64_t mGeneration {0};
+        boost::interprocess::mapped_region mRegion {};
+    };
+
+    /// Our control block.
+    const SharedSecretSegment::ControlBlock& controlBlock() const
+    {
+        return *static_cast<const SharedSecretSegment::ControlBlock*>(mControlRegion.get_address());
+    }
+
+    /// Get the current data segment, switching to a new one if it has been replaced.
+    std::shared_ptr<const Segment> currentSegment()
+    {
+        std::shared_ptr<const Segment> segment { std::atomic_load(&mSegment) };
+        uint64_t generation { controlBlock().mGeneration.load(std::memory_order_acquire) };
+        if(segment && segment->mGeneration == generation)
+        {
+            return segment;
+        }
+
+        std::lock_guard<std::mutex> lck { mMapMtx };
+        while(true)
+        {
+            segment = std::atomic_load(&mSegment);
+            if(segment && segment->mGeneration == generation)
+            {
+                return segment;
+            }
+
+            std::shared_ptr<Segment> mapped { std::make_shared<Segment>() };
+            mapped->mGeneration = generation;
+            try
+            {
+                boost::interprocess::shared_memory_object shm { boost::interprocess::open_only,
+                    SharedSecretSegment::dataName(mName, generation).c_str(), boost::interprocess::read_only };
+                mapped->mRegion = boost::interprocess::mapped_region { shm, boost::interprocess::read_only };
+            }
+            catch(boost::interprocess::interprocess_exception&)
+            {
+                // Replaced again before we could open it
+                const uint64_t latest { controlBlock().mGeneration.load(std::memory_order_acquire) };
+                if(latest == generation)
+                {
+                    throw std::runtime_error("Shared memory " + mName + " has been withdrawn");
+                }
+                generation = latest;
+                continue;
+            }
+
+            const SharedSecretSegment::DataHeader& hdr {
+                *static_cast<const SharedSecretSegment::DataHeader*>(mapped->mRegion.get_address()) };
+            if(mapped->mRegion.get_size() < sizeof(hdr) ||
+               std::memcmp(hdr.mMagic, SharedSecretSegment::DATA_MAGIC, sizeof(hdr.mMagic)) != 0 ||
+               hdr.mSize > mapped->mRegion.get_size() ||
+               hdr.mDataStart < sizeof(hdr) + hdr.mNumSlots * sizeof(uint64_t))
+            {
+                throw std::runtime_error("Shared memory " + mName + " is not a published secret store");
+            }
+
+            std::shared_ptr<const Segment> published { std::move(mapped) };
+            std::atomic_store(&mSegment, published);
+            return published;
+        }
+    }
+
+    /// Name of the shared memory.
+    std::string mName {};
+
+    /// The control segment.
+    boost::interprocess::mapped_region mControlRegion {};
+
+    /// Serialises switching segments.
+    std::mutex mMapMtx {};
+
+    /// The current data segment. Accessed atomically.
+    std::shared_ptr<const Segment> mSegment {};
+};
+
+}}
+
+#endif
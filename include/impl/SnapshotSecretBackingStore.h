@@ -0,0 +1,452 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that can take cheap point-in-time
+ * snapshots of the secret store.
+ *
+ * A copy of every secret the store persists is kept in a fixed number of
+ * copy-on-write buckets. Taking a snapshot just copies the bucket pointers,
+ * so it is quick regardless of the size of the store. The first write to a
+ * bucket after a snapshot copies that bucket alone. A snapshot never
+ * changes once taken, so it can be read, serialised or written to another
+ * backing store on any thread without holding up writers.
+ *
+ * The secret store is locked while it loads, so the copies of what it
+ * loaded are taken from it when the first snapshot after the load is
+ * requested.
+ */
+
+#ifndef _NCHAIN_SDK_SNAPSHOT_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_SNAPSHOT_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/SecretStoreSeed.h>
+#include <interface/SecretStore.h>
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of SecretStoreSnapshot pointer type
+class SecretStoreSnapshot;
+/// Unique pointer type
+using SecretStoreSnapshotPtr = std::unique_ptr<SecretStoreSnapshot>;
+/// Shared pointer type
+using SecretStoreSnapshotSPtr = std::shared_ptr<SecretStoreSnapshot>;
+
+/// An immutable point-in-time image of the secret store.
+class SecretStoreSnapshot
+{
+  public:
+
+    /// A bucket of secrets, keyed by name.
+    using Bucket = std::unordered_map<std::string, SecretSPtr>;
+    /// Shared pointer to a bucket.
+    using BucketSPtr = std::shared_ptr<const Bucket>;
+
+    /**
+    * Constructor.
+    * @param buckets The buckets making up the snapshot.
+    * @param size Total number of secrets in the buckets.
+    * @param version Number of changes made to the store before the snapshot.
+    */
+    SecretStoreSnapshot(std::vector<BucketSPtr>&& buckets, size_t size, uint64_t version)
+    : mBuckets{std::move(buckets)}, mSize{size}, mVersion{version}
+    {}
+
+    /**
+    * Get the number of changes made to the store before this snapshot was
+    * taken. Equal versions from the same store mean identical contents.
+    * @return Our version.
+    */
+    uint64_t getVersion() const { return mVersion; }
+
+    /**
+    * Get the number of secrets in the snapshot.
+    * @return The number of secrets.
+    */
+    size_t size() const { return mSize; }
+
+    /**
+    * Fetch secret by name. Secrets in a snapshot are private copies and
+    * must not be modified.
+    * @param name The name of the secret to lookup.
+    * @return A pointer to the requested secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name) const
+    {
+        const Bucket& bucket { *mBuckets[bucketFor(name, mBuckets.size())] };
+        const auto it = bucket.find(name);
+        return it == bucket.end() ? nullptr : it->second;
+    }
+
+    /**
+    * Fetch all secrets.
+    * @return A list of all secrets in the snapshot.
+    */
+    std::vector<SecretSPtr> getAllSecrets() const
+    {
+        std::vector<SecretSPtr> secrets {};
+        secrets.reserve(mSize);
+        forEach([&secrets](const SecretSPtr& secret) { secrets.push_back(secret); });
+        return secrets;
+    }
+
+    /**
+    * Fetch all secret names.
+    * @return A list of all secret names in the snapshot.
+    */
+    std::vector<std::string> getAllSecretNames() const
+    {
+        std::vector<std::string> names {};
+        names.reserve(mSize);
+        for(const BucketSPtr& bucket : mBuckets)
+        {
+            for(const auto& entry : *bucket)
+            {
+                names.push_back(entry.first);
+            }
+        }
+        return names;
+    }
+
+    /**
+    * Call a function for each secret, in no particular order. Useful for
+    * streaming a snapshot out without collecting it first.
+    * @param fn Function to call.
+    */
+    void forEach(const std::function<void(const SecretSPtr&)>& fn) const
+    {
+        for(const BucketSPtr& bucket : mBuckets)
+        {
+            for(const auto& entry : *bucket)
+            {
+                fn(entry.second);
+            }
+        }
+    }
+
+    /**
+    * Write the snapshot out as the entire contents of a backing store, for
+    * example a freshly created backup file.
+    * @param store The backing store to write to.
+    */
+    void saveTo(SecretBackingStore& store) const
+    {
+        store.replaceAll(getAllSecrets());
+    }
+
+    /**
+    * Get the bucket a name belongs in.
+    * @param name The secret name.
+    * @param numBuckets How many buckets there are.
+    * @return The bucket number.
+    */
+    static size_t bucketFor(const std::string& name, size_t numBuckets)
+    {
+        return std::hash<std::string>{}(name) % numBuckets;
+    }
+
+  private:
+
+    /// Our buckets.
+    std::vector<BucketSPtr> mBuckets {};
+
+    /// Number of secrets.
+    size_t mSize {};
+
+    /// Store version we were taken at.
+    uint64_t mVersion {};
+};
+
+/// Forward declaration of SnapshotSecretBackingStore pointer type
+class SnapshotSecretBackingStore;
+/// Unique pointer type
+using SnapshotSecretBackingStorePtr = std::unique_ptr<SnapshotSecretBackingStore>;
+/// Shared pointer type
+using SnapshotSecretBackingStoreSPtr = std::shared_ptr<SnapshotSecretBackingStore>;
+
+/// Snapshotting wrapper around another secret backing store.
+class SnapshotSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /// Default number of copy-on-write buckets.
+    static constexpr size_t DEFAULT_NUM_BUCKETS { 256 };
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param numBuckets Number of copy-on-write buckets. More buckets make
+    * the first write after a snapshot cheaper and snapshots dearer.
+    * @param secretStore The secret store we take snapshots of.
+    */
+    SnapshotSecretBackingStore(const SecretBackingStoreSPtr& store,
+                               size_t numBuckets = DEFAULT_NUM_BUCKETS,
+                               SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore)
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Snapshot store requires a backing store to wrap");
+        }
+
+        resetBuckets(numBuckets ? numBuckets : 1);
+    }
+
+    /// Forbid copying and assignment.
+    SnapshotSecretBackingStore(const SnapshotSecretBackingStore&) = delete;
+    SnapshotSecretBackingStore(SnapshotSecretBackingStore&&) = delete;
+    SnapshotSecretBackingStore& operator=(const SnapshotSecretBackingStore&) = delete;
+    SnapshotSecretBackingStore& operator=(SnapshotSecretBackingStore&&) = delete;
+
+    /**
+    * Take a snapshot of the secret store as last persisted.
+    * @return An immutable snapshot.
+    */
+    SecretStoreSnapshotSPtr snapshot()
+    {
+        mSeed.seed(mMtx,
+            [this]{ return copyAll(mSecretStore.getAllSecrets()); },
+            [this](const std::vector<SecretSPtr>& copies)
+            {
+                for(const SecretSPtr& copy : copies)
+                {
+                    if(!mSeed.stale(copy->getName()))
+                    {
+                        put(SecretSPtr { copy });
+                    }
+                }
+                ++mVersion;
+            });
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        std::vector<SecretStoreSnapshot::BucketSPtr> buckets { mBuckets.begin(), mBuckets.end() };
+        return std::make_shared<SecretStoreSnapshot>(std::move(buckets), mSize, mVersion);
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        mStore->saveSecret(secret);
+        SecretSPtr copy { std::make_shared<Secret>(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        put(std::move(copy));
+        ++mVersion;
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->saveSecrets(secrets);
+        std::vector<SecretSPtr> copies { copyAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(SecretSPtr& copy : copies)
+        {
+            put(std::move(copy));
+        }
+        ++mVersion;
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        mStore->updateSecret(name, secret);
+        SecretSPtr copy { std::make_shared<Secret>(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        erase(name);
+        put(std::move(copy));
+        ++mVersion;
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        mStore->removeSecret(name);
+        std::lock_guard<std::mutex> lck { mMtx };
+        erase(name);
+        ++mVersion;
+    }
+
+    /**
+    * Load all stored secrets. Copies of them are taken from the secret store
+    * when the next snapshot is requested.
+    */
+    void loadAll() override
+    {
+        mStore->loadAll();
+        std::lock_guard<std::mutex> lck { mMtx };
+        replaceContents({});
+        mSeed.reset();
+    }
+
+    /**
+    * Replace the contents of the backing store.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->replaceAll(secrets);
+        std::vector<SecretSPtr> copies { copyAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        replaceContents(std::move(copies));
+        mSeed.replaced();
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        impl::applyBatch(*mStore, batch);
+
+        std::vector<SecretSPtr> copies {};
+        copies.reserve(batch.size());
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            copies.push_back(op.mSecret ? std::make_shared<Secret>(*op.mSecret) : nullptr);
+        }
+
+        // The whole batch appears in snapshots together
+        std::lock_guard<std::mutex> lck { mMtx };
+        auto copy = copies.begin();
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            if(op.mType != SecretBackingStoreBatch::OpType::SAVE)
+            {
+                erase(op.mName);
+            }
+            if(op.mType != SecretBackingStoreBatch::OpType::REMOVE)
+            {
+                put(std::move(*copy));
+            }
+            ++copy;
+        }
+        ++mVersion;
+    }
+
+  private:
+
+    /// A bucket we can modify.
+    using Bucket = SecretStoreSnapshot::Bucket;
+    using BucketSPtr = std::shared_ptr<Bucket>;
+
+    /// Take private copies of some secrets.
+    static std::vector<SecretSPtr> copyAll(const std::vector<SecretSPtr>& secrets)
+    {
+        std::vector<SecretSPtr> copies {};
+        copies.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            copies.push_back(std::make_shared<Secret>(*secret));
+        }
+        return copies;
+    }
+
+    /// Get a bucket for writing, copying it first if a snapshot shares it.
+    /// Called with our mutex held.
+    Bucket& writableBucket(const std::string& name)
+    {
+        BucketSPtr& bucket { mBuckets[SecretStoreSnapshot::bucketFor(name, mBuckets.size())] };
+        if(bucket.use_count() > 1)
+        {
+            bucket = std::make_shared<Bucket>(*bucket);
+        }
+        return *bucket;
+    }
+
+    /// Add or overwrite a secret. Called with our mutex held.
+    void put(SecretSPtr&& secret)
+    {
+        const std::string name { secret->getName() };
+        mSeed.touch(name);
+        Bucket& bucket { writableBucket(name) };
+        const bool added { bucket.find(name) == bucket.end() };
+        bucket[name] = std::move(secret);
+        if(added)
+        {
+            ++mSize;
+        }
+    }
+
+    /// Remove a secret. Called with our mutex held.
+    void erase(const std::string& name)
+    {
+        mSeed.touch(name);
+        const BucketSPtr& bucket { mBuckets[SecretStoreSnapshot::bucketFor(name, mBuckets.size())] };
+        if(bucket->find(name) != bucket->end())
+        {
+            writableBucket(name).erase(name);
+            --mSize;
+        }
+    }
+
+    /// Replace everything we hold. Called with our mutex held.
+    void replaceContents(std::vector<SecretSPtr>&& secrets)
+    {
+        resetBuckets(mBuckets.size());
+        for(SecretSPtr& secret : secrets)
+        {
+            put(std::move(secret));
+        }
+        ++mVersion;
+    }
+
+    /// Start again with empty buckets.
+    void resetBuckets(size_t numBuckets)
+    {
+        // Don't touch the old buckets, snapshots may still hold them
+        std::vector<BucketSPtr> buckets {};
+        buckets.reserve(numBuckets);
+        for(size_t i = 0; i < numBuckets; ++i)
+        {
+            buckets.push_back(std::make_shared<Bucket>());
+        }
+        mBuckets.swap(buckets);
+        mSize = 0;
+    }
+
+    /// A mutex for our buckets.
+    mutable std::mutex mMtx {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store we take snapshots of.
+    SecretStore& mSecretStore;
+
+    /// Seeding state for our buckets.
+    SecretStoreSeed mSeed {};
+
+    /// Our copy-on-write buckets.
+    std::vector<BucketSPtr> mBuckets {};
+
+    /// Number of secrets held.
+    size_t mSize {0};
+
+    /// Number of changes made so far.
+    uint64_t mVersion {0};
+};
+
+}}
+
+#endif
@@ -0,0 +1,763 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that bounds how many secrets are held
+ * decrypted in memory.
+ *
+ * Every secret is kept in a cold tier as its serialised, encrypted form in
+ * ordinary memory. Only a bounded number of recently used secrets are hot,
+ * that is resident in the secret store and so decrypted in locked memory.
+ * When there are too many hot secrets a background thread evicts the least
+ * recently used ones from the secret store without removing them from the
+ * backing store. Evicted secrets are decrypted with the master password and
+ * added back to the secret store when next fetched through getSecret().
+ *
+ * The secret store itself only knows about hot secrets, so lookups and
+ * removals must go through getSecret() and removeStoredSecret() here,
+ * getAllSecretNames() here lists every secret, and the master password must
+ * be changed with setMasterPassword() here, which re-encrypts the cold
+ * secrets along with the hot ones. Adding a secret with the same name as a
+ * cold one replaces it.
+ *
+ * If the wrapped store is a SecretRecordSource, loading reads its records
+ * straight into the cold tier and only loads as many secrets into the
+ * secret store as fit in the hot tier. Otherwise the wrapped store loads
+ * everything into the secret store, which is locked while it loads, so the
+ * cold tier is seeded with what it loaded afterwards, from the eviction
+ * thread, which then evicts down to capacity.
+ */
+
+#ifndef _NCHAIN_SDK_TIERED_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_TIERED_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+#include <impl/JSONSerialiser.h>
+#include <impl/SecretRecordSource.h>
+#include <impl/SecretStoreSeed.h>
+#include <interface/SecretStore.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of TieredSecretBackingStore pointer type
+class TieredSecretBackingStore;
+/// Unique pointer type
+using TieredSecretBackingStorePtr = std::unique_ptr<TieredSecretBackingStore>;
+/// Shared pointer type
+using TieredSecretBackingStoreSPtr = std::shared_ptr<TieredSecretBackingStore>;
+
+/// Hot/cold residency wrapper around another secret backing store.
+class TieredSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /// Default maximum number of hot secrets.
+    static constexpr size_t DEFAULT_HOT_CAPACITY { 1024 };
+
+    /// Residency statistics.
+    struct Stats
+    {
+        /// Number of secrets currently hot.
+        size_t mHot {0};
+        /// Number of secrets held in total.
+        size_t mCold {0};
+        /// Lookups that found the secret hot.
+        uint64_t mHits {0};
+        /// Lookups that had to decrypt a cold secret.
+        uint64_t mMisses {0};
+        /// Secrets evicted from the hot tier.
+        uint64_t mEvictions {0};
+        /// Total and longest time spent making cold secrets hot.
+        uint64_t mDecryptNanos {0};
+        uint64_t mMaxDecryptNanos {0};
+    };
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param passwd The secret store's master password, needed to decrypt
+    * cold secrets.
+    * @param hotCapacity Maximum number of secrets to keep hot.
+    * @param secretStore The secret store whose residency we manage.
+    */
+    TieredSecretBackingStore(const SecretBackingStoreSPtr& store,
+                             const memory::SecureByteVec& passwd,
+                             size_t hotCapacity = DEFAULT_HOT_CAPACITY,
+                             SecretStore& secretStore = SecretStore::get())
+    : mStore{store}, mSecretStore(secretStore), mCapacity{hotCapacity ? hotCapacity : 1}, mPasswd{passwd}
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Tiered store requires a backing store to wrap");
+        }
+        if(mPasswd.empty())
+        {
+            throw std::runtime_error("Tiered store requires the master password");
+        }
+
+        mEvictor = std::thread { &TieredSecretBackingStore::evictorLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    TieredSecretBackingStore(const TieredSecretBackingStore&) = delete;
+    TieredSecretBackingStore(TieredSecretBackingStore&&) = delete;
+    TieredSecretBackingStore& operator=(const TieredSecretBackingStore&) = delete;
+    TieredSecretBackingStore& operator=(TieredSecretBackingStore&&) = delete;
+
+    /// Destructor. Stops the eviction thread.
+    ~TieredSecretBackingStore() override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mStopping = true;
+        }
+        mEvictCv.notify_all();
+        if(mEvictor.joinable())
+        {
+            mEvictor.join();
+        }
+    }
+
+    /**
+    * Fetch secret by name, making it hot if it is cold. Use this in place
+    * of SecretStore::getSecret().
+    * @param name The name of the secret to lookup.
+    * @return A pointer to the requested secret if found, nullptr otherwise.
+    */
+    SecretSPtr getSecret(const std::string& name)
+    {
+        SecretSPtr secret { mSecretStore.getSecret(name) };
+        if(secret)
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            ++mStats.mHits;
+            touch(name);
+            return secret;
+        }
+
+        // Only one thread loads or evicts at a time, so a secret is never
+        // loaded twice or evicted while loading.
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        return fetchSecret(name);
+    }
+
+    /**
+    * Remove a secret, hot or cold, from the secret store. Use this in place
+    * of SecretStore::removeSecret().
+    * @param name The name of the secret to erase.
+    */
+    void removeStoredSecret(const std::string& name)
+    {
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        if(!fetchSecret(name))
+        {
+            throw std::runtime_error("Secret named " + name + " not found in the store");
+        }
+        mSecretStore.removeSecret(name);
+    }
+
+    /**
+    * Fetch the names of all secrets, hot and cold.
+    * @return A list of all stored secret names.
+    */
+    std::vector<std::string> getAllSecretNames()
+    {
+        ensureSeeded();
+        std::lock_guard<std::mutex> lck { mMtx };
+        std::vector<std::string> names {};
+        names.reserve(mCold.size());
+        for(const auto& entry : mCold)
+        {
+            names.push_back(entry.first);
+        }
+        return names;
+    }
+
+    /**
+    * Change the master password. The secret store re-encrypts the hot
+    * secrets, and replaceAll() re-encrypts the cold ones as it rewrites the
+    * backing store.
+    * @param passwd The new master password.
+    */
+    void setMasterPassword(const memory::SecureByteVec& passwd)
+    {
+        // Nothing is made hot or evicted underneath us while we rewrite
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        ensureSeeded();
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mNewPasswd = passwd;
+        }
+
+        try
+        {
+            mSecretStore.setMasterPassword(passwd);
+        }
+        catch(...)
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mNewPasswd.clear();
+            throw;
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        mPasswd = passwd;
+        mNewPasswd.clear();
+    }
+
+    /**
+    * Get our residency statistics.
+    * @return The current statistics.
+    */
+    Stats getStats() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        Stats stats { mStats };
+        stats.mHot = mLru.size();
+        stats.mCold = mCold.size();
+        return stats;
+    }
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        // A cold secret we are making hot is already stored
+        if(secret.get() == mAdmitting.load())
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mSeed.touch(secret->getName());
+            touch(secret->getName());
+            return;
+        }
+
+        mStore->saveSecret(secret);
+        std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.touch(secret->getName());
+        setCold(secret->getName(), std::move(payload));
+        touch(secret->getName());
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        mStore->saveSecrets(secrets);
+        std::vector<std::string> payloads { serialiseAll(secrets) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            mSeed.touch(secrets[i]->getName());
+            setCold(secrets[i]->getName(), std::move(payloads[i]));
+            touch(secrets[i]->getName());
+        }
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        mStore->updateSecret(name, secret);
+        std::string payload { JSONSerialiser::serialise(*secret) };
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.touch(name);
+        mSeed.touch(secret->getName());
+        mCold.erase(name);
+        dropHot(name);
+        setCold(secret->getName(), std::move(payload));
+        touch(secret->getName());
+    }
+
+    /**
+    * Remove a secret. Removals we make ourselves to evict a secret are not
+    * passed on.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mSeed.touch(name);
+            if(mEvicting.erase(name))
+            {
+                // The cold copy stays, so a seed in progress must not
+                // make it hot again
+                dropHot(name);
+                ++mStats.mEvictions;
+                return;
+            }
+        }
+
+        mStore->removeSecret(name);
+        std::lock_guard<std::mutex> lck { mMtx };
+        mSeed.touch(name);
+        mCold.erase(name);
+        dropHot(name);
+    }
+
+    /**
+    * Load all stored secrets. If the wrapped store can read out its records
+    * they all go into the cold tier, and only the first ones up to our
+    * capacity are loaded into the secret store and so decrypted. Otherwise
+    * everything loaded starts off hot; the eviction thread then copies it
+    * into the cold tier and evicts down to our capacity.
+    */
+    void loadAll() override
+    {
+        SecretRecordSource* source { dynamic_cast<SecretRecordSource*>(mStore.get()) };
+        if(!source)
+        {
+            mStore->loadAll();
+            std::lock_guard<std::mutex> lck { mMtx };
+            mCold.clear();
+            mLru.clear();
+            mLruIndex.clear();
+            mSeed.reset();
+            mEvictCv.notify_one();
+            return;
+        }
+
+        std::unordered_map<std::string, std::string> cold {};
+        std::vector<std::string> hot {};
+        source->readAll([this, &cold, &hot](std::string&& payload)
+        {
+            SecretSPtr secret { deserialise(payload) };
+            const std::string name { secret->getName() };
+            if(hot.size() < mCapacity && !cold.count(name))
+            {
+                mSecretStore.loadSecret(secret);
+                hot.push_back(name);
+            }
+            cold[name] = std::move(payload);
+        });
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        mCold.swap(cold);
+        mLru.clear();
+        mLruIndex.clear();
+        for(const std::string& name : hot)
+        {
+            touch(name);
+        }
+        mSeed.replaced();
+    }
+
+    /**
+    * Replace the contents of the backing store. The secret store only
+    * passes in the hot secrets, so the cold ones are added, re-encrypted
+    * under the new master password. That is only known if it is being set
+    * through our setMasterPassword(); otherwise cold secrets can't be kept
+    * and we throw.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unordered_set<std::string> names {};
+        for(const SecretSPtr& secret : secrets)
+        {
+            names.insert(secret->getName());
+        }
+
+        std::vector<std::string> coldPayloads {};
+        memory::SecureByteVec passwd {};
+        memory::SecureByteVec newPasswd {};
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            for(const auto& entry : mCold)
+            {
+                if(!names.count(entry.first))
+                {
+                    coldPayloads.push_back(entry.second);
+                }
+            }
+            passwd = mPasswd;
+            newPasswd = mNewPasswd;
+        }
+
+        std::vector<SecretSPtr> contents { secrets };
+        if(!coldPayloads.empty())
+        {
+            if(newPasswd.empty())
+            {
+                throw std::runtime_error("Cold secrets can't be re-encrypted; "
+                                         "set the master password through the tiered store");
+            }
+            for(const std::string& payload : coldPayloads)
+            {
+                SecretSPtr secret { deserialise(payload) };
+                secret->decryptSecret(passwd);
+                secret->encryptSecret(newPasswd);
+                contents.push_back(secret);
+            }
+        }
+
+        mStore->replaceAll(contents);
+        resetContents(contents, secrets.size(), serialiseAll(contents));
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        impl::applyBatch(*mStore, batch);
+
+        std::vector<std::string> payloads {};
+        payloads.reserve(batch.size());
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            payloads.push_back(op.mSecret ? JSONSerialiser::serialise(*op.mSecret) : std::string {});
+        }
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        auto payload = payloads.begin();
+        for(const SecretBackingStoreBatch::Op& op : batch.getOps())
+        {
+            mSeed.touch(op.mName);
+            if(op.mType != SecretBackingStoreBatch::OpType::SAVE)
+            {
+                mCold.erase(op.mName);
+                dropHot(op.mName);
+            }
+            if(op.mType != SecretBackingStoreBatch::OpType::REMOVE)
+            {
+                mSeed.touch(op.mSecret->getName());
+                setCold(op.mSecret->getName(), std::move(*payload));
+                touch(op.mSecret->getName());
+            }
+            ++payload;
+        }
+    }
+
+  private:
+
+    /// Fetch a secret, making it hot if required. Called with mLoadMtx held.
+    SecretSPtr fetchSecret(const std::string& name)
+    {
+        SecretSPtr secret { mSecretStore.getSecret(name) };
+        if(secret)
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            ++mStats.mHits;
+            touch(name);
+            return secret;
+        }
+
+        std::string payload {};
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            const auto it = mCold.find(name);
+            if(it == mCold.end())
+            {
+                return nullptr;
+            }
+            payload = it->second;
+            ++mStats.mMisses;
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+        secret = makeResident(name, payload);
+        const uint64_t nanos { static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count()) };
+
+        std::lock_guard<std::mutex> lck { mMtx };
+        mStats.mDecryptNanos += nanos;
+        mStats.mMaxDecryptNanos = std::max(mStats.mMaxDecryptNanos, nanos);
+        touch(name);
+        return secret;
+    }
+
+    /// Serialise some secrets.
+    static std::vector<std::string> serialiseAll(const std::vector<SecretSPtr>& secrets)
+    {
+        std::vector<std::string> payloads {};
+        payloads.reserve(secrets.size());
+        for(const SecretSPtr& secret : secrets)
+        {
+            payloads.push_back(JSONSerialiser::serialise(*secret));
+        }
+        return payloads;
+    }
+
+    /// Deserialise a cold secret.
+    static SecretSPtr deserialise(const std::string& payload)
+    {
+        std::istringstream str { payload };
+        SecretSPtr secret { std::dynamic_pointer_cast<Secret>(JSONSerialiser::deserialise(str)) };
+        if(!secret)
+        {
+            throw std::runtime_error("Cold record is not a Secret");
+        }
+        return secret;
+    }
+
+    /// Decrypt a cold secret and add it to the secret store. Called with mLoadMtx held.
+    SecretSPtr makeResident(const std::string& name, const std::string& payload)
+    {
+        SecretSPtr secret { deserialise(payload) };
+        memory::SecureByteVec passwd {};
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            passwd = mPasswd;
+        }
+        secret->decryptSecret(passwd);
+
+        // Add through the locked API; it hands the secret back to
+        // saveSecret(), which knows not to persist it again
+        mAdmitting = secret.get();
+        try
+        {
+            mSecretStore.addSecret(secret);
+        }
+        catch(...)
+        {
+            mAdmitting = nullptr;
+            // Someone else may have added it in the meantime
+            SecretSPtr existing { mSecretStore.getSecret(name) };
+            if(!existing)
+            {
+                throw;
+            }
+            return existing;
+        }
+        mAdmitting = nullptr;
+        return secret;
+    }
+
+    /// Replace everything we hold. The first numHot secrets are hot.
+    void resetContents(const std::vector<SecretSPtr>& secrets, size_t numHot, std::vector<std::string>&& payloads)
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        mCold.clear();
+        mLru.clear();
+        mLruIndex.clear();
+        for(size_t i = 0; i < secrets.size(); ++i)
+        {
+            setCold(secrets[i]->getName(), std::move(payloads[i]));
+            if(i < numHot)
+            {
+                touch(secrets[i]->getName());
+            }
+        }
+        mSeed.replaced();
+    }
+
+    /// Copy what the secret store loaded into the cold tier, if we haven't
+    /// since the last load. Everything it loaded is hot.
+    void ensureSeeded()
+    {
+        mSeed.seed(mMtx,
+            [this]
+            {
+                const std::vector<SecretSPtr> secrets { mSecretStore.getAllSecrets() };
+                std::vector<std::string> payloads { serialiseAll(secrets) };
+                std::vector<std::pair<std::string, std::string>> entries {};
+                entries.reserve(secrets.size());
+                for(size_t i = 0; i < secrets.size(); ++i)
+                {
+                    entries.emplace_back(secrets[i]->getName(), std::move(payloads[i]));
+                }
+                return entries;
+            },
+            [this](const std::vector<std::pair<std::string, std::string>>& entries)
+            {
+                for(const auto& entry : entries)
+                {
+                    if(!mSeed.stale(entry.first))
+                    {
+                        setCold(entry.first, std::string { entry.second });
+                        touch(entry.first);
+                    }
+                }
+            });
+    }
+
+    /// Set the cold copy of a secret. Called with our mutex held.
+    void setCold(const std::string& name, std::string&& payload)
+    {
+        mCold[name] = std::move(payload);
+    }
+
+    /// Mark a secret as hot and most recently used. Called with our mutex held.
+    void touch(const std::string& name)
+    {
+        const auto it = mLruIndex.find(name);
+        if(it != mLruIndex.end())
+        {
+            mLru.splice(mLru.begin(), mLru, it->second);
+            return;
+        }
+
+        mLru.push_front(name);
+        mLruIndex[name] = mLru.begin();
+        if(mLru.size() > mCapacity)
+        {
+            mEvictCv.notify_one();
+        }
+    }
+
+    /// Forget a secret is hot. Called with our mutex held.
+    void dropHot(const std::string& name)
+    {
+        const auto it = mLruIndex.find(name);
+        if(it != mLruIndex.end())
+        {
+            mLru.erase(it->second);
+            mLruIndex.erase(it);
+        }
+    }
+
+    /// Evict least recently used secrets until we're within capacity.
+    void trim()
+    {
+        std::lock_guard<std::mutex> loadLck { mLoadMtx };
+        while(true)
+        {
+            std::string name {};
+            {
+                std::lock_guard<std::mutex> lck { mMtx };
+                if(mStopping || mLru.size() <= mCapacity)
+                {
+                    return;
+                }
+                name = mLru.back();
+                mEvicting.insert(name);
+            }
+
+            // The store calls back into removeSecret(), which drops it from
+            // the hot tier without passing the removal on.
+            try
+            {
+                mSecretStore.removeSecret(name);
+            }
+            catch(...)
+            {
+                bool removedByUser {false};
+                {
+                    std::lock_guard<std::mutex> lck { mMtx };
+                    removedByUser = (mEvicting.erase(name) == 0);
+                    dropHot(name);
+                }
+
+                // If someone else removed it first we swallowed their removal,
+                // so pass it on now.
+                if(removedByUser)
+                {
+                    try
+                    {
+                        mStore->removeSecret(name);
+                    }
+                    catch(...)
+                    {
+                        // Nobody to report to from here
+                    }
+                    std::lock_guard<std::mutex> lck { mMtx };
+                    mCold.erase(name);
+                }
+            }
+        }
+    }
+
+    /// Body of the eviction thread.
+    void evictorLoop()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(true)
+        {
+            mEvictCv.wait(lck, [this]{ return mStopping || mSeed.needed() || mLru.size() > mCapacity; });
+            if(mStopping)
+            {
+                return;
+            }
+
+            lck.unlock();
+            try
+            {
+                ensureSeeded();
+            }
+            catch(...)
+            {
+                // Try again shortly
+                lck.lock();
+                mEvictCv.wait_for(lck, std::chrono::seconds {1}, [this]{ return mStopping; });
+                continue;
+            }
+            trim();
+            lck.lock();
+        }
+    }
+
+    /// A mutex for our tiers and statistics.
+    mutable std::mutex mMtx {};
+
+    /// Serialises making secrets hot and evicting them.
+    std::mutex mLoadMtx {};
+
+    /// Signalled when there are too many hot secrets, or we're stopping.
+    std::condition_variable mEvictCv {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// The secret store whose residency we manage.
+    SecretStore& mSecretStore;
+
+    /// Maximum number of hot secrets.
+    size_t mCapacity {};
+
+    /// Every secret's serialised, encrypted form, by name.
+    std::unordered_map<std::string, std::string> mCold {};
+
+    /// Hot secret names, most recently used first.
+    std::list<std::string> mLru {};
+    std::unordered_map<std::string, std::list<std::string>::iterator> mLruIndex {};
+
+    /// Names we are in the middle of evicting.
+    std::unordered_set<std::string> mEvicting {};
+
+    /// Seeding state for the cold tier.
+    SecretStoreSeed mSeed {};
+
+    /// The cold secret we are currently adding to the secret store.
+    std::atomic<const Secret*> mAdmitting {nullptr};
+
+    /// The master password the cold tier is encrypted under.
+    memory::SecureByteVec mPasswd {};
+
+    /// The master password being set through us, if any.
+    memory::SecureByteVec mNewPasswd {};
+
+    /// Our statistics.
+    Stats mStats {};
+
+    /// Set to stop the eviction thread.
+    bool mStopping {false};
+
+    /// The eviction thread.
+    std::thread mEvictor {};
+};
+
+}}
+
+#endif
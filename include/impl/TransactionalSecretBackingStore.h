@@ -0,0 +1,280 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that can collect mutations into a batch.
+ *
+ * Between beginBatch() and commitBatch() every mutation the secret store
+ * makes, from any thread, is held back in order and then handed to the
+ * wrapped backing store as one batch. Outside a batch, mutations are passed
+ * straight through. Used by SecretWriteBatch.
+ *
+ * Mutations other threads make while a batch is open are held back in that
+ * batch too, although their callers have already returned: they reach the
+ * wrapped store only when the batch is committed. If the commit fails they
+ * stay held, and are persisted by the next commit that succeeds.
+ */
+
+#ifndef _NCHAIN_SDK_TRANSACTIONAL_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_TRANSACTIONAL_SECRET_BACKING_STORE_H_
+
+#include <impl/SecretBackingStoreBatch.h>
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of TransactionalSecretBackingStore pointer type
+class TransactionalSecretBackingStore;
+/// Unique pointer type
+using TransactionalSecretBackingStorePtr = std::unique_ptr<TransactionalSecretBackingStore>;
+/// Shared pointer type
+using TransactionalSecretBackingStoreSPtr = std::shared_ptr<TransactionalSecretBackingStore>;
+
+/// Batching wrapper around another secret backing store.
+class TransactionalSecretBackingStore : public SecretBackingStore, public BatchSecretBackingStore
+{
+  public:
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    */
+    TransactionalSecretBackingStore(const SecretBackingStoreSPtr& store)
+    : mStore{store}
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Transactional store requires a backing store to wrap");
+        }
+    }
+
+    /// Forbid copying and assignment.
+    TransactionalSecretBackingStore(const TransactionalSecretBackingStore&) = delete;
+    TransactionalSecretBackingStore(TransactionalSecretBackingStore&&) = delete;
+    TransactionalSecretBackingStore& operator=(const TransactionalSecretBackingStore&) = delete;
+    TransactionalSecretBackingStore& operator=(TransactionalSecretBackingStore&&) = delete;
+
+    /**
+    * Save a new secret.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mBatching)
+        {
+            mBatch.saveSecret(secret);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->saveSecret(secret);
+    }
+
+    /**
+    * Save a list of new secrets.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mBatching)
+        {
+            for(const SecretSPtr& secret : secrets)
+            {
+                mBatch.saveSecret(secret);
+            }
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->saveSecrets(secrets);
+    }
+
+    /**
+    * Update a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mBatching)
+        {
+            mBatch.updateSecret(name, secret);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->updateSecret(name, secret);
+    }
+
+    /**
+    * Remove a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mBatching)
+        {
+            mBatch.removeSecret(name);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->removeSecret(name);
+    }
+
+    /**
+    * Load all stored secrets.
+    */
+    void loadAll() override
+    {
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        mStore->loadAll();
+    }
+
+    /**
+    * Replace the contents of the backing store. Anything held in a batch is
+    * superseded by the new contents and so is discarded.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mBatch.clear();
+        ++mGeneration;
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->replaceAll(secrets);
+    }
+
+    /**
+    * Persist a batch of mutations through the wrapped store.
+    * @param batch The mutations to persist.
+    */
+    void applyBatch(const SecretBackingStoreBatch& batch) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        if(mBatching)
+        {
+            append(mBatch, batch);
+            return;
+        }
+
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        impl::applyBatch(*mStore, batch);
+    }
+
+    /**
+    * Start holding back mutations. Only one batch can be open at a time;
+    * this blocks until any other batch has been committed.
+    */
+    void beginBatch()
+    {
+        mBatchMtx.lock();
+        std::lock_guard<std::mutex> lck { mMtx };
+        mBatching = true;
+    }
+
+    /**
+    * Persist everything held back since beginBatch() with a single call to
+    * the wrapped store, and stop holding back mutations. If that fails the
+    * exception is rethrown and the batch is closed, but everything in it is
+    * still held back, along with anything held since. It is persisted by
+    * the next commit that succeeds, so call beginBatch() and commitBatch()
+    * again to retry.
+    */
+    void commitBatch()
+    {
+        std::unique_lock<std::mutex> batchLck { mBatchMtx, std::adopt_lock };
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(!mBatch.empty())
+        {
+            // Carry on holding back while we write, so later mutations
+            // neither overtake the batch nor wait for it
+            SecretBackingStoreBatch batch {};
+            std::swap(batch, mBatch);
+            const uint64_t generation { mGeneration };
+            lck.unlock();
+
+            try
+            {
+                std::lock_guard<std::mutex> storeLck { mStoreMtx };
+                impl::applyBatch(*mStore, batch);
+            }
+            catch(...)
+            {
+                // Hold it again, ahead of anything held since, unless the
+                // contents were replaced meanwhile
+                lck.lock();
+                if(generation == mGeneration)
+                {
+                    append(batch, mBatch);
+                    std::swap(batch, mBatch);
+                }
+                batchLck.unlock();
+                throw;
+            }
+
+            lck.lock();
+        }
+        mBatching = false;
+    }
+
+  private:
+
+    /// Add the mutations of one batch to the end of another.
+    static void append(SecretBackingStoreBatch& to, const SecretBackingStoreBatch& from)
+    {
+        for(const SecretBackingStoreBatch::Op& op : from.getOps())
+        {
+            switch(op.mType)
+            {
+                case SecretBackingStoreBatch::OpType::SAVE:
+                    to.saveSecret(op.mSecret);
+                    break;
+                case SecretBackingStoreBatch::OpType::UPDATE:
+                    to.updateSecret(op.mName, op.mSecret);
+                    break;
+                case SecretBackingStoreBatch::OpType::REMOVE:
+                    to.removeSecret(op.mName);
+                    break;
+            }
+        }
+    }
+
+    /// A mutex for our batching state.
+    std::mutex mMtx {};
+
+    /// Held by whoever has a batch open.
+    std::mutex mBatchMtx {};
+
+    /// Serialises access to the wrapped store.
+    std::mutex mStoreMtx {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// Whether a batch is open.
+    bool mBatching {false};
+
+    /// Mutations held back for the open batch, or left by a failed commit.
+    SecretBackingStoreBatch mBatch {};
+
+    /// Bumped whenever the contents are replaced, discarding what is held.
+    uint64_t mGeneration {0};
+};
+
+}}
+
+#endif
@@ -0,0 +1,455 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * A secret backing store decorator that persists mutations on a background
+ * writer thread.
+ *
+ * Mutations are placed into a bounded queue and return to the caller
+ * immediately. Repeated updates to the same secret that are still waiting
+ * in the queue are merged, so they result in a single write to the wrapped
+ * backing store. Callers block when the queue is full, and can use flush()
+ * as a durability barrier.
+ *
+ * An optional coalescing window holds mutations back for a while before
+ * writing them, so that bursts of updates to the same secret, such as
+ * setting several items of metadata, are folded into one write.
+ */
+
+#ifndef _NCHAIN_SDK_WRITE_BEHIND_SECRET_BACKING_STORE_H_
+#define _NCHAIN_SDK_WRITE_BEHIND_SECRET_BACKING_STORE_H_
+
+#include <interface/SecretBackingStore.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace nakasendo { namespace impl {
+
+/// Forward declaration of WriteBehindSecretBackingStore pointer type
+class WriteBehindSecretBackingStore;
+/// Unique pointer type
+using WriteBehindSecretBackingStorePtr = std::unique_ptr<WriteBehindSecretBackingStore>;
+/// Shared pointer type
+using WriteBehindSecretBackingStoreSPtr = std::shared_ptr<WriteBehindSecretBackingStore>;
+
+/// Asynchronous write-behind wrapper around another secret backing store.
+class WriteBehindSecretBackingStore : public SecretBackingStore
+{
+  public:
+
+    /// Default maximum number of queued mutations before callers block.
+    static constexpr size_t DEFAULT_QUEUE_CAPACITY { 1024 };
+
+    /**
+    * Constructor.
+    * @param store The backing store to persist to.
+    * @param capacity Maximum number of queued mutations. Once reached, callers
+    * block until the writer thread has caught up.
+    * @param window How long to hold back the first of a batch of mutations
+    * before writing, to give later updates a chance to be merged with it.
+    * Zero writes as soon as possible.
+    */
+    WriteBehindSecretBackingStore(const SecretBackingStoreSPtr& store,
+                                  size_t capacity = DEFAULT_QUEUE_CAPACITY,
+                                  std::chrono::milliseconds window = std::chrono::milliseconds::zero())
+    : mStore{store}, mCapacity{capacity ? capacity : 1}, mWindow{window}
+    {
+        if(!mStore)
+        {
+            throw std::runtime_error("Write-behind store requires a backing store to wrap");
+        }
+
+        mWriter = std::thread { &WriteBehindSecretBackingStore::writerLoop, this };
+    }
+
+    /// Forbid copying and assignment.
+    WriteBehindSecretBackingStore(const WriteBehindSecretBackingStore&) = delete;
+    WriteBehindSecretBackingStore(WriteBehindSecretBackingStore&&) = delete;
+    WriteBehindSecretBackingStore& operator=(const WriteBehindSecretBackingStore&) = delete;
+    WriteBehindSecretBackingStore& operator=(WriteBehindSecretBackingStore&&) = delete;
+
+    /// Destructor. Writes out anything still queued before returning.
+    ~WriteBehindSecretBackingStore() override
+    {
+        {
+            std::lock_guard<std::mutex> lck { mMtx };
+            mStopping = true;
+        }
+        mWorkCv.notify_all();
+        mSpaceCv.notify_all();
+        mWriter.join();
+    }
+
+    /**
+    * Queue a new secret for saving.
+    * @param secret The new secret to persist.
+    */
+    void saveSecret(const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        enqueue(lck, OpType::SAVE, secret->getName(), secret);
+    }
+
+    /**
+    * Queue a list of new secrets for saving. Consecutive queued saves are
+    * handed to the wrapped store as a single saveSecrets() call.
+    * @param secrets The new secrets to persist.
+    */
+    void saveSecrets(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        for(const SecretSPtr& secret : secrets)
+        {
+            enqueue(lck, OpType::SAVE, secret->getName(), secret);
+        }
+    }
+
+    /**
+    * Queue an update to a changed secret.
+    * @param name The name of the changed secret.
+    * @param secret New details of the changed secret.
+    */
+    void updateSecret(const std::string& name, const SecretSPtr& secret) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        enqueue(lck, OpType::UPDATE, name, secret);
+    }
+
+    /**
+    * Queue the removal of a secret.
+    * @param name The name of the secret to remove.
+    */
+    void removeSecret(const std::string& name) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        enqueue(lck, OpType::REMOVE, name, nullptr);
+    }
+
+    /**
+    * Load all stored secrets. Any queued mutations are written out first.
+    */
+    void loadAll() override
+    {
+        flush();
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        mStore->loadAll();
+    }
+
+    /**
+    * Replace the contents of the backing store. Queued mutations are
+    * superseded by the new contents and so are discarded. This call is
+    * synchronous.
+    * @param secrets The required new contents of the backing store.
+    */
+    void replaceAll(const std::vector<SecretSPtr>& secrets) override
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        mQueue.clear();
+        mPending.clear();
+        mSpaceCv.notify_all();
+        mIdleCv.notify_all();
+
+        // Taking the store mutex waits for any in-flight batch, and holding
+        // our own mutex until then stops new mutations overtaking us.
+        std::lock_guard<std::mutex> storeLck { mStoreMtx };
+        lck.unlock();
+        mStore->replaceAll(secrets);
+    }
+
+    /**
+    * Durability barrier. Blocks until every mutation queued before the call
+    * has been handed to the wrapped backing store, cutting short any
+    * coalescing window. If any write failed since the last flush, the first
+    * failure is rethrown.
+    */
+    void flush()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        ++mFlushWaiters;
+        mWorkCv.notify_one();
+        mIdleCv.wait(lck, [this]{ return mQueue.empty() && !mWriting; });
+        --mFlushWaiters;
+
+        if(mFailure)
+        {
+            std::exception_ptr failure { mFailure };
+            mFailure = nullptr;
+            std::rethrow_exception(failure);
+        }
+    }
+
+    /**
+    * Get the number of mutations currently waiting to be written.
+    * @return The queue depth.
+    */
+    size_t pendingWrites() const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        return mQueue.size();
+    }
+
+  private:
+
+    /// Types of queued mutation.
+    enum class OpType
+    {
+        SAVE,
+        UPDATE,
+        REMOVE,
+        NONE    // Cancelled by a later mutation
+    };
+
+    /// A queued mutation.
+    struct Op
+    {
+        OpType mType;
+        std::string mName;
+        SecretSPtr mSecret;
+    };
+    using OpSPtr = std::shared_ptr<Op>;
+
+    /**
+    * Add a mutation to the queue, merging it with a still queued mutation
+    * for the same secret where possible. Called with our mutex held.
+    */
+    void enqueue(std::unique_lock<std::mutex>& lck, OpType type, const std::string& name, const SecretSPtr& secret)
+    {
+        // A rename touches two names, so don't merge across it.
+        if(type == OpType::UPDATE && secret->getName() != name)
+        {
+            mPending.erase(name);
+            mPending.erase(secret->getName());
+            push(lck, type, name, secret, false);
+            return;
+        }
+
+        const auto it = mPending.find(name);
+        if(it == mPending.end())
+        {
+            push(lck, type, name, secret, true);
+            return;
+        }
+
+        Op& pending { *it->second };
+        switch(pending.mType)
+        {
+            case OpType::SAVE:
+                if(type == OpType::REMOVE)
+                {
+                    // Never reached the store, so nothing to remove
+                    pending.mType = OpType::NONE;
+                    pending.mSecret = nullptr;
+                    mPending.erase(it);
+                }
+                else
+                {
+                    pending.mSecret = secret;
+                }
+                break;
+
+            case OpType::UPDATE:
+                if(type == OpType::SAVE)
+                {
+                    push(lck, type, name, secret, true);
+                }
+                else
+                {
+                    pending.mType = type;
+                    pending.mSecret = secret;
+                }
+                break;
+
+            case OpType::REMOVE:
+                if(type == OpType::SAVE)
+                {
+                    // Remove followed by save is an update
+                    pending.mType = OpType::UPDATE;
+                    pending.mSecret = secret;
+                }
+                else if(type == OpType::UPDATE)
+                {
+                    push(lck, type, name, secret, true);
+                }
+                break;
+
+            default:
+                push(lck, type, name, secret, true);
+                break;
+        }
+    }
+
+    /// Append a new mutation to the queue, waiting for space if required.
+    void push(std::unique_lock<std::mutex>& lck, OpType type, const std::string& name, const SecretSPtr& secret, bool mergeable)
+    {
+        mSpaceCv.wait(lck, [this]{ return mQueue.size() < mCapacity || mStopping; });
+
+        OpSPtr op { std::make_shared<Op>(Op{type, name, secret}) };
+        if(mQueue.empty())
+        {
+            mFirstQueued = std::chrono::steady_clock::now();
+        }
+        mQueue.push_back(op);
+        if(mergeable)
+        {
+            mPending[name] = op;
+        }
+        mWorkCv.notify_one();
+    }
+
+    /// Body of the background writer thread.
+    void writerLoop()
+    {
+        std::unique_lock<std::mutex> lck { mMtx };
+        while(true)
+        {
+            mWorkCv.wait(lck, [this]{ return mStopping || !mQueue.empty(); });
+            if(mQueue.empty())
+            {
+                // Stopping and fully drained
+                break;
+            }
+
+            // Let updates gather, unless someone is waiting on them
+            if(mWindow > std::chrono::milliseconds::zero())
+            {
+                mWorkCv.wait_until(lck, mFirstQueued + mWindow, [this]{
+                    return mStopping || mFlushWaiters || mQueue.size() >= mCapacity; });
+            }
+
+            // Take the whole queue as one batch
+            std::deque<OpSPtr> batch {};
+            batch.swap(mQueue);
+            mPending.clear();
+            mWriting = true;
+            mSpaceCv.notify_all();
+
+            std::unique_lock<std::mutex> storeLck { mStoreMtx };
+            lck.unlock();
+            std::exception_ptr failure { apply(batch) };
+            storeLck.unlock();
+            lck.lock();
+
+            if(failure && !mFailure)
+            {
+                mFailure = failure;
+            }
+            mWriting = false;
+            mIdleCv.notify_all();
+        }
+    }
+
+    /**
+    * Write a batch of mutations to the wrapped store, in order.
+    * @return The first failure seen, if any.
+    */
+    std::exception_ptr apply(const std::deque<OpSPtr>& batch)
+    {
+        std::exception_ptr failure {};
+        std::vector<SecretSPtr> saves {};
+
+        auto attempt = [&failure](const std::function<void()>& write)
+        {
+            try
+            {
+                write();
+            }
+            catch(...)
+            {
+                if(!failure)
+                {
+                    failure = std::current_exception();
+                }
+            }
+        };
+
+        auto flushSaves = [&]()
+        {
+            if(!saves.empty())
+            {
+                attempt([&]{ mStore->saveSecrets(saves); });
+                saves.clear();
+            }
+        };
+
+        for(const OpSPtr& op : batch)
+        {
+            switch(op->mType)
+            {
+                case OpType::SAVE:
+                    saves.push_back(op->mSecret);
+                    break;
+                case OpType::UPDATE:
+                    flushSaves();
+                    attempt([&]{ mStore->updateSecret(op->mName, op->mSecret); });
+                    break;
+                case OpType::REMOVE:
+                    flushSaves();
+                    attempt([&]{ mStore->removeSecret(op->mName); });
+                    break;
+                default:
+                    break;
+            }
+        }
+        flushSaves();
+
+        return failure;
+    }
+
+    /// A mutex for our queue state.
+    mutable std::mutex mMtx {};
+
+    /// Serialises access to the wrapped store between the writer and callers.
+    std::mutex mStoreMtx {};
+
+    /// Signalled when there is work for the writer.
+    std::condition_variable mWorkCv {};
+    /// Signalled when space becomes available in the queue.
+    std::condition_variable mSpaceCv {};
+    /// Signalled when the writer finishes a batch.
+    std::condition_variable mIdleCv {};
+
+    /// The backing store we write to.
+    SecretBackingStoreSPtr mStore {};
+
+    /// Maximum queue depth.
+    size_t mCapacity {};
+
+    /// How long to let mutations gather before writing them.
+    std::chrono::milliseconds mWindow {};
+
+    /// When the oldest mutation in the queue was queued.
+    std::chrono::steady_clock::time_point mFirstQueued {};
+
+    /// Number of callers waiting in flush().
+    size_t mFlushWaiters {0};
+
+    /// Mutations waiting to be written, in order.
+    std::deque<OpSPtr> mQueue {};
+
+    /// The latest mergeable queued mutation for each secret name.
+    std::unordered_map<std::string, OpSPtr> mPending {};
+
+    /// Whether the writer currently has a batch in flight.
+    bool mWriting {false};
+
+    /// Set when we are shutting down.
+    bool mStopping {false};
+
+    /// First write failure since the last flush.
+    std::exception_ptr mFailure {};
+
+    /// The background writer thread.
+    std::thread mWriter {};
+};
+
+}}
+
+#endif
@@ -10,7 +10,10 @@
 
 #include "UInt.h"
 
+#include <istream>
 #include <iterator>
+#include <stdexcept>
+#include <vector>
 
 #include <cryptopp/sha.h>
 #include <cryptopp/ripemd.h>
@@ -58,6 +61,81 @@ uint160 Hash160(const T begin, const T end)
     return uint160 {hash2};
 }
 
+/// Incremental Bitcoin cash style double SHA-256, for messages that arrive
+/// in pieces or are too big to hold in memory.
+class Hash256Writer
+{
+  public:
+
+    /// Size of the blocks we read streams in.
+    static constexpr size_t STREAM_BLOCK_SIZE { 64 * 1024 };
+
+    /**
+    * Add some bytes to the message.
+    * @param data The bytes to add.
+    * @param size Number of bytes.
+    * @return Ourselves, so calls can be chained.
+    */
+    Hash256Writer& write(const uint8_t* data, size_t size)
+    {
+        mHash.Update(data, size);
+        return *this;
+    }
+
+    /// Add a range of bytes to the message.
+    template<typename T>
+    Hash256Writer& write(const T begin, const T end)
+    {
+        // Make sure we never dereference an end() iterator
+        auto dist = std::distance(begin, end);
+        if(dist)
+        {
+            write(reinterpret_cast<const uint8_t*>(&begin[0]), dist);
+        }
+        return *this;
+    }
+
+    /**
+    * Add everything remaining in a stream to the message.
+    * @param stream The stream to read.
+    * @return Ourselves, so calls can be chained.
+    */
+    Hash256Writer& write(std::istream& stream)
+    {
+        std::vector<char> buffer(STREAM_BLOCK_SIZE);
+        while(stream.read(buffer.data(), buffer.size()) || stream.gcount())
+        {
+            write(reinterpret_cast<const uint8_t*>(buffer.data()), static_cast<size_t>(stream.gcount()));
+        }
+        if(stream.bad())
+        {
+            throw std::runtime_error("Failed reading stream to hash");
+        }
+        return *this;
+    }
+
+    /**
+    * Get the double SHA-256 of everything written, and start again.
+    * @return The same as Hash256 over the whole message.
+    */
+    uint256 finalise()
+    {
+        // Finish first round, which also resets us
+        std::vector<uint8_t> hash1(CryptoPP::SHA256::DIGESTSIZE, 0);
+        mHash.Final(hash1.data());
+
+        // Hash twice
+        std::vector<uint8_t> hash2(CryptoPP::SHA256::DIGESTSIZE, 0);
+        CryptoPP::SHA256().CalculateDigest(hash2.data(), hash1.data(), hash1.size());
+        return uint256 {hash2};
+    }
+
+  private:
+
+    /// First round hash state.
+    CryptoPP::SHA256 mHash {};
+};
+
 }}}
 
 #endif
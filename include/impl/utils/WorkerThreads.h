@@ -0,0 +1,70 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Running a worker function on a few threads at once.
+ *
+ * The parallel batch operations share work out by having each thread claim
+ * chunks from a common counter until none are left, so they still finish
+ * if fewer threads run than were asked for. If the system won't start
+ * another thread we therefore carry on with the ones we have, rather than
+ * let std::thread's exception escape with threads still running.
+ */
+
+#ifndef _NCHAIN_SDK_WORKER_THREADS_H_
+#define _NCHAIN_SDK_WORKER_THREADS_H_
+
+#include <cstddef>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+namespace nakasendo { namespace impl { namespace utils {
+
+/**
+* Run a worker function on up to numThreads threads, the calling thread
+* being one of them, and wait for them all to finish.
+* @param numThreads Number of threads to run on, including the caller.
+* @param worker Called once on each thread. Must share the work out among
+* however many threads call it.
+*/
+template<typename Worker>
+void runOnThreads(size_t numThreads, const Worker& worker)
+{
+    std::vector<std::thread> threads {};
+    threads.reserve(numThreads ? numThreads - 1 : 0);
+    for(size_t i = 1; i < numThreads; ++i)
+    {
+        try
+        {
+            threads.emplace_back(std::cref(worker));
+        }
+        catch(const std::system_error&)
+        {
+            // Out of threads; the ones we have share the rest
+            break;
+        }
+    }
+
+    try
+    {
+        worker();
+    }
+    catch(...)
+    {
+        for(std::thread& thread : threads)
+        {
+            thread.join();
+        }
+        throw;
+    }
+    for(std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+}}}
+
+#endif
@@ -16,6 +16,7 @@
 #include "Secret.h"
 
 #include <impl/memory/SecureString.h>
+#include <impl/utils/UInt.h>
 
 #include <vector>
 #include <memory>
@@ -122,6 +123,39 @@ namespace nakasendo
                                        const std::vector<uint8_t>& message,
                                        const std::string&          secretName = {}) const = 0;
 
+        /**
+        * Sign a message digest with this key. The digest is signed as given,
+        * so sign(message) is the same as signDigest(Hash256(message)).
+        * Use a Hash256Writer to get the digest of a message too big to
+        * hold in memory.
+        * @param digest The 32 byte digest to sign.
+        * @return The signature.
+        */
+        virtual std::vector<uint8_t> signDigest(const impl::utils::uint256& digest) const = 0;
+
+        /**
+        * Sign a batch of messages with this key. Equivalent to calling
+        * sign() on each, but shares the per call setup across the batch and
+        * can spread the work over several threads.
+        * @param messages The messages to sign.
+        * @param numWorkers Number of threads to use, including the calling
+        * thread. 0 means one per hardware thread.
+        * @return A signature for each message, in the same order.
+        */
+        virtual std::vector<std::vector<uint8_t>> signBatch(const std::vector<std::vector<uint8_t>>& messages,
+                                                            size_t numWorkers = 1) const = 0;
+
+        /**
+        * Sign a batch of message digests with this key. The digests are
+        * signed as given, without hashing them again.
+        * @param digests The 32 byte digests to sign.
+        * @param numWorkers Number of threads to use, including the calling
+        * thread. 0 means one per hardware thread.
+        * @return A signature for each digest, in the same order.
+        */
+        virtual std::vector<std::vector<uint8_t>> signDigestBatch(const std::vector<impl::utils::uint256>& digests,
+                                                                  size_t numWorkers = 1) const = 0;
+
     };
 
 }
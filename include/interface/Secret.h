@@ -54,7 +54,10 @@ class Secret : public JSONSerialisable
            const std::string&           name = {},
            const MetaDataCollectionSPtr& metaData = nullptr);
 
-    /// Copy constructor
+    /// Copy constructor. Copies are deep: the secret, encrypted secret and
+    /// password each get a new locked allocation, and the metadata is
+    /// copied too. Share a SecretSPtr, move, or use withSecret() where a
+    /// copy isn't really needed.
     Secret(const Secret& that);
 
     /// Move constructor
@@ -77,6 +80,21 @@ class Secret : public JSONSerialisable
     void getSecret(impl::memory::SecureByteVec& secret)const;
     void getSecret(impl::memory::SecureArray<uint8_t>& secret) const;
 
+    /**
+    * Borrow our secret without copying it. The function is called with our
+    * lock held, and the bytes it is given are only valid for the duration of
+    * the call; it must not call back into this Secret.
+    * @param fn Called as fn(const uint8_t* data, size_t size) with the
+    * unencrypted secret contents.
+    * @return Whatever fn returns.
+    */
+    template<typename Func>
+    decltype(auto) withSecret(Func&& fn) const
+    {
+        std::lock_guard<std::mutex> lck { mMtx };
+        return fn(static_cast<const uint8_t*>(mSecretData.data()), mSecretData.size());
+    }
+
     /**
     * Set our secret.
     * @param secret A new secret value to use.
@@ -205,7 +223,11 @@ class Secret : public JSONSerialisable
     /// Decrypt (without taking lock)
     void decryptSecretNL(const uint8_t* passwd, const size_t size);
 
-    /// Setup AES key
+    /// Setup AES key. The password is used directly as the 32 byte AES key,
+    /// truncated or zero padded as required. There is no key derivation step,
+    /// so nothing is gained by caching the result across secrets; the per
+    /// secret cost of a bulk encrypt or decrypt is the AES key schedule and
+    /// the cipher itself.
     CryptoPP::SecByteBlock setupAESKey(const uint8_t* passwd, const size_t size);
 
     /// Pick a random name for this Secret.
@@ -2,11 +2,20 @@
 // See LICENSE.txt in project root for licensing information.
 
 /*
- * An in-memory registry for storing secrets. Implemented as a singleton.
+ * An in-memory registry for storing secrets.
  *
  * The store should have a master password set for encryption/decryption
  * and be hooked up with a pluggable backend for persisting secrets before
  * being used.
+ *
+ * A default instance is available through get(). Further independent
+ * instances, each with their own backing store, master password and lock,
+ * can be created as impl::SecretStoreImpl objects to spread unrelated
+ * secrets across stores. A backing store belongs to a single instance and
+ * the header only backing stores take the instance to load into when they
+ * are constructed. Secret::setMetaData() and JSONSecretBackingStore only
+ * work with the default instance; after changing the metadata of a secret
+ * held elsewhere, call secretUpdated() on its store.
  */
 
 #ifndef _NCHAIN_SDK_SECRET_STORE_H_
@@ -18,7 +27,14 @@
 namespace nakasendo
 {
 
-/// An in-memory store of secrets. Implemented as a singleton.
+/// Forward declaration of SecretStore pointer type
+class SecretStore;
+/// Unique pointer type
+using SecretStorePtr = std::unique_ptr<SecretStore>;
+/// Shared pointer type
+using SecretStoreSPtr = std::shared_ptr<SecretStore>;
+
+/// An in-memory store of secrets, with a default instance.
 class SecretStore
 {
   public:
@@ -35,8 +51,8 @@ class SecretStore
     virtual ~SecretStore() = default;
 
     /**
-    * Accessor for the singleton instance.
-    * @return A reference to the SecretStore.
+    * Accessor for the default instance.
+    * @return A reference to the default SecretStore.
     */
     static SecretStore& get();
 
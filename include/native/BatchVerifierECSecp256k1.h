@@ -0,0 +1,203 @@
+// Powered by nChain's Nakasendo libraries.
+// See LICENSE.txt in project root for licensing information.
+
+/*
+ * Batch verification of ECSecp256k1 signatures.
+ *
+ * Verifying through PubKeyECSecp256k1::verify needs a public key object,
+ * and a lock, per signature. A batch verifier works directly from the
+ * serialised public key, message and signature bytes: each worker hashes,
+ * parses and verifies a chunk of the batch at a time, claiming chunks from
+ * a shared counter so that threads which finish early take on more of the
+ * work. The result is one bit per signature.
+ */
+
+#ifndef _NCHAIN_SDK_BATCH_VERIFIER_ECSECP256K1_H_
+#define _NCHAIN_SDK_BATCH_VERIFIER_ECSECP256K1_H_
+
+#include "EccontextSecp256k1.h"
+
+#include <impl/utils/Hashers.h>
+#include <impl/utils/UInt.h>
+#include <impl/utils/WorkerThreads.h>
+
+#include <secp256k1/include/secp256k1.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nakasendo { namespace native
+{
+
+/// A signature to check against a message.
+struct SignedMessageECSecp256k1
+{
+    /// Serialised public key, compressed or uncompressed.
+    std::vector<uint8_t> mPubKey {};
+    /// The message that was signed.
+    std::vector<uint8_t> mMessage {};
+    /// DER encoded signature.
+    std::vector<uint8_t> mSignature {};
+};
+
+/// A signature to check against a message digest.
+struct SignedDigestECSecp256k1
+{
+    /// Serialised public key, compressed or uncompressed.
+    std::vector<uint8_t> mPubKey {};
+    /// Double SHA-256 digest of the message that was signed.
+    impl::utils::uint256 mDigest { std::vector<uint8_t>(32, 0) };
+    /// DER encoded signature.
+    std::vector<uint8_t> mSignature {};
+};
+
+/// Verifies batches of ECSecp256k1 signatures over a pool of threads.
+class BatchVerifierECSecp256k1 : public EccontextSecp256k1
+{
+  public:
+
+    /// Default number of signatures a worker claims at a time.
+    static constexpr size_t DEFAULT_CHUNK_SIZE { 64 };
+
+    /**
+    * Constructor.
+    * @param numWorkers Number of threads to use, including the calling
+    * thread. 0 means one per hardware thread.
+    * @param chunkSize Number of signatures a worker claims at a time.
+    */
+    BatchVerifierECSecp256k1(size_t numWorkers = 0, size_t chunkSize = DEFAULT_CHUNK_SIZE)
+    : m_numWorkers{numWorkers ? numWorkers : std::max(1u, std::thread::hardware_concurrency())},
+      m_chunkSize{chunkSize ? chunkSize : 1}
+    {}
+
+    /// Forbid copying and assignment.
+    BatchVerifierECSecp256k1(const BatchVerifierECSecp256k1&) = delete;
+    BatchVerifierECSecp256k1(BatchVerifierECSecp256k1&&) = delete;
+    BatchVerifierECSecp256k1& operator=(const BatchVerifierECSecp256k1&) = delete;
+    BatchVerifierECSecp256k1& operator=(BatchVerifierECSecp256k1&&) = delete;
+
+    /**
+    * Verify a batch of signatures of messages. Each entry gives the same
+    * answer as PubKeyECSecp256k1::verify, except that an unparseable public
+    * key or an empty signature just fails that entry rather than throwing.
+    * @param batch The signatures to check.
+    * @return A bit per entry, set if its signature verified.
+    */
+    std::vector<bool> verify(const std::vector<SignedMessageECSecp256k1>& batch) const
+    {
+        return verifyAll(batch, [](const SignedMessageECSecp256k1& entry) {
+            return impl::utils::Hash256(entry.mMessage.begin(), entry.mMessage.end());
+        });
+    }
+
+    /**
+    * Verify a batch of signatures of message digests, as for
+    * PubKeyECSecp256k1::verifyDigest.
+    * @param batch The signatures to check.
+    * @return A bit per entry, set if its signature verified.
+    */
+    std::vector<bool> verify(const std::vector<SignedDigestECSecp256k1>& batch) const
+    {
+        return verifyAll(batch, [](const SignedDigestECSecp256k1& entry) -> const impl::utils::uint256& {
+            return entry.mDigest;
+        });
+    }
+
+  private:
+
+    /// Verify every entry of a batch, getting each digest from digestFor.
+    template<typename Entry, typename DigestFunc>
+    std::vector<bool> verifyAll(const std::vector<Entry>& batch, const DigestFunc& digestFor) const
+    {
+        // A byte per entry while we work, so threads never share a word
+        std::vector<uint8_t> results(batch.size(), 0);
+
+        std::atomic<size_t> next {0};
+        std::mutex failureMtx {};
+        std::exception_ptr failure {};
+        auto worker = [&]()
+        {
+            try
+            {
+                // Entries signed by the same key are often adjacent, so
+                // keep the last key we parsed
+                const std::vector<uint8_t>* lastPubKeyBytes { nullptr };
+                secp256k1_pubkey lastPubKey {};
+                bool lastPubKeyValid { false };
+
+                size_t start {};
+                while((start = next.fetch_add(m_chunkSize)) < batch.size())
+                {
+                    const size_t stop { std::min(start + m_chunkSize, batch.size()) };
+                    for(size_t i = start; i < stop; ++i)
+                    {
+                        const Entry& entry { batch[i] };
+                        if(entry.mSignature.empty())
+                        {
+                            continue;
+                        }
+
+                        if(!lastPubKeyBytes || *lastPubKeyBytes != entry.mPubKey)
+                        {
+                            lastPubKeyBytes = &entry.mPubKey;
+                            lastPubKeyValid = secp256k1_ec_pubkey_parse(getEccContext(), &lastPubKey,
+                                                                        entry.mPubKey.data(), entry.mPubKey.size());
+                        }
+                        if(!lastPubKeyValid)
+                        {
+                            continue;
+                        }
+
+                        // Accept any valid DER signature, normalised to lower-S as for verify()
+                        secp256k1_ecdsa_signature sig {};
+                        if(!secp256k1_ecdsa_signature_parse_der(getEccContext(), &sig,
+                                                                entry.mSignature.data(), entry.mSignature.size()))
+                        {
+                            continue;
+                        }
+                        secp256k1_ecdsa_signature_normalize(getEccContext(), &sig, &sig);
+
+                        const auto& digest = digestFor(entry);
+                        results[i] = secp256k1_ecdsa_verify(getEccContext(), &sig, digest.begin(), &lastPubKey) == 1;
+                    }
+                }
+            }
+            catch(...)
+            {
+                // Stop everyone else claiming more work
+                next = batch.size();
+                std::lock_guard<std::mutex> lck { failureMtx };
+                if(!failure)
+                {
+                    failure = std::current_exception();
+                }
+            }
+        };
+
+        // No more threads than there are chunks, and we are one of them
+        const size_t numChunks { (batch.size() + m_chunkSize - 1) / m_chunkSize };
+        const size_t numThreads { std::min(m_numWorkers, numChunks) };
+        impl::utils::runOnThreads(numThreads, worker);
+
+        if(failure)
+        {
+            std::rethrow_exception(failure);
+        }
+        return std::vector<bool>(results.begin(), results.end());
+    }
+
+    /// Number of threads to use.
+    size_t m_numWorkers {};
+
+    /// Number of signatures claimed at a time.
+    size_t m_chunkSize {};
+};
+
+}}
+
+#endif
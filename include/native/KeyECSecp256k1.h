@@ -21,6 +21,7 @@
 
 #include <vector>
 #include <atomic>
+#include <memory>
 
 namespace nakasendo
 {
@@ -100,6 +101,35 @@ namespace nakasendo
             */
             void makeNewKey();
 
+            /// Public key state computed from our secret.
+            struct PubKeyCache
+            {
+                /// The secret it was computed from, in locked memory that is
+                /// wiped when freed.
+                impl::memory::SecureByteVec mSecret {};
+                /// Serialised compressed public key.
+                std::vector<uint8_t> mCompressed {};
+                /// Serialised uncompressed public key.
+                std::vector<uint8_t> mUncompressed {};
+            };
+
+            /**
+            * Get our public key state, computing it first if we don't have
+            * it for our current secret.
+            * @return Our public key state.
+            */
+            std::shared_ptr<const PubKeyCache> getPubKeyCache() const;
+
+            /**
+            * Sign a number of digests, spread over a pool of threads.
+            * @param count Number of digests.
+            * @param digestFor Called from any thread to get digest i.
+            * @param numWorkers Number of threads to use. 0 means one per hardware thread.
+            * @return A DER signature for each digest.
+            */
+            template<typename DigestFunc>
+            std::vector<std::vector<uint8_t>> signAll(size_t count, const DigestFunc& digestFor, size_t numWorkers) const;
+
             /// A source of pseudo-random sequence of data (mutable because we don't
             /// want consuming entropy to mean our methods have to be non-const)
             mutable Seeder m_seeder;
@@ -111,6 +141,14 @@ namespace nakasendo
             /// The default ECSECP256K1 network all new keys are made for.
             static std::atomic<impl::MetaDataDefinitions::NetworkType> cDefaultNetworkType;
 
+            /// Cached public key state. Accessed atomically, and checked against
+            /// our secret on use so it is never stale whichever way the secret
+            /// was changed. Note this keeps a second copy of the private key,
+            /// in locked memory, from the first getPubKey() until the key is
+            /// destroyed; after the secret changes, the old copy is kept until
+            /// the cache is next refreshed.
+            mutable std::shared_ptr<const PubKeyCache> m_pubKeyCache {};
+
         public:
             // Key interface
             /**
@@ -145,6 +183,25 @@ namespace nakasendo
             */
             std::vector<uint8_t> sign(const std::vector<uint8_t>& message) const override;
 
+            /**
+            * Sign a message digest with this key. Reading our secret takes
+            * its lock, but only for the time it takes to copy it, not for
+            * the signature.
+            */
+            std::vector<uint8_t> signDigest(const impl::utils::uint256& digest) const override;
+
+            /**
+            * Sign a batch of messages with this key.
+            */
+            std::vector<std::vector<uint8_t>> signBatch(const std::vector<std::vector<uint8_t>>& messages,
+                                                        size_t numWorkers = 1) const override;
+
+            /**
+            * Sign a batch of message digests with this key.
+            */
+            std::vector<std::vector<uint8_t>> signDigestBatch(const std::vector<impl::utils::uint256>& digests,
+                                                              size_t numWorkers = 1) const override;
+
             /**
             * Decrypt a message previously encrypted by our public key.
             * @param message An encrypted message.
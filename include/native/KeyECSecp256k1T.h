@@ -16,15 +16,23 @@
 #include <impl/utils/Utils.h>
 #include <impl/utils/HexToBytes.h>
 #include <impl/utils/Hashers.h>
+#include <impl/utils/WorkerThreads.h>
 
 #include <cryptopp/eccrypto.h>
 #include <cryptopp/channels.h>
 #include <cryptopp/ida.h>
 #include <cryptopp/files.h>
+#include <cryptopp/misc.h>
 #include <cryptopp/oids.h>
+#include <cryptopp/secblock.h>
 
 #include <secp256k1/include/secp256k1.h>
 
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+
 namespace pt = boost::property_tree;
 using namespace nakasendo;
 using namespace nakasendo::impl;
@@ -106,10 +114,12 @@ memory::SecureByteVec KeyECSecp256k1<Seeder>::getSerializedKey() const
     using namespace contrib;
     memory::SecureByteVec vSerializedKey(SERIALIZED_KEY_ECSECP256K1_SIZE);
     size_t serializedKeyLen = SERIALIZED_KEY_ECSECP256K1_SIZE;
-    const memory::SecureByteVec& secret = getSecret();
     /// Export the key in DER format.
-    if (!ec_privkey_export_der(getEccContext(), (unsigned char*) vSerializedKey.data(), &serializedKeyLen, 
-                               (const unsigned char*) secret.data(), SECP256K1_EC_UNCOMPRESSED)) {
+    const bool exported = withSecret([&](const uint8_t* secret, size_t) {
+        return ec_privkey_export_der(getEccContext(), (unsigned char*) vSerializedKey.data(), &serializedKeyLen,
+                                     (const unsigned char*) secret, SECP256K1_EC_UNCOMPRESSED);
+    });
+    if (!exported) {
         throw std::runtime_error("Serialization has failed.");
     }
     vSerializedKey.resize(serializedKeyLen);
@@ -255,17 +265,62 @@ PubKeyPtr KeyECSecp256k1<Seeder>::getPubKey() const
 template <class Seeder>
 PubKeyPtr KeyECSecp256k1<Seeder>::getPubKey(PubKey::Type pkType) const
 {
-    /// Check if private key is valid.
-	if(!isValidSecpKey()) {
-        throw std::runtime_error("Private key is not secp256k1 compliant key.");
-    }
+    /// Get our public key, which also checks the private key is valid.
+    const std::shared_ptr<const PubKeyCache> cache { getPubKeyCache() };
 
     /// Create an instance of ECSECP256K1 public key.
     const MetaDataDefinitions::NetworkType& networkType {
         enum_cast<MetaDataDefinitions::NetworkType>(getMetaDataCollection()->getMetaValue(
             enum_cast<std::string>(MetaDataDefinitions::KeyType::NETWORK_TYPE)))
     };
-    return std::make_unique<PubKeyECSecp256k1>(networkType, pkType, getSecret());
+    return std::make_unique<PubKeyECSecp256k1>(
+        pkType == PubKey::Type::COMPRESSED ? cache->mCompressed : cache->mUncompressed, networkType);
+}
+
+// Get our public key state, computing it if our secret has changed.
+template <class Seeder>
+std::shared_ptr<const typename KeyECSecp256k1<Seeder>::PubKeyCache> KeyECSecp256k1<Seeder>::getPubKeyCache() const
+{
+    // Still good? Compare against our secret in place, without copying it
+    std::shared_ptr<const PubKeyCache> cache { std::atomic_load(&m_pubKeyCache) };
+    if(cache && withSecret([&cache](const uint8_t* secret, size_t size) {
+           return size == cache->mSecret.size() && CryptoPP::VerifyBufsEqual(secret, cache->mSecret.data(), size);
+       }))
+    {
+        return cache;
+    }
+
+    // Keep a copy of the secret we compute from, to check against next time
+    std::shared_ptr<PubKeyCache> newCache { std::make_shared<PubKeyCache>() };
+    const bool copied { withSecret([&newCache](const uint8_t* secret, size_t size) {
+        if(size != KEY_ECSECP256K1_SIZE)
+        {
+            return false;
+        }
+        newCache->mSecret.assign(secret, secret + size);
+        return true;
+    }) };
+
+    // Compute our public key once, in both forms
+    secp256k1_pubkey secpPubKey {};
+    if(!copied || !checkSecKey(newCache->mSecret.data()) ||
+       !secp256k1_ec_pubkey_create(getEccContext(), &secpPubKey, newCache->mSecret.data()))
+    {
+        throw std::runtime_error("Private key is not secp256k1 compliant key.");
+    }
+    auto serialise = [this, &secpPubKey](unsigned int flags, size_t len)
+    {
+        std::vector<uint8_t> bytes(len, 0x0);
+        secp256k1_ec_pubkey_serialize(getEccContext(), bytes.data(), &len, &secpPubKey, flags);
+        bytes.resize(len);
+        return bytes;
+    };
+
+    newCache->mCompressed = serialise(SECP256K1_EC_COMPRESSED, 33);
+    newCache->mUncompressed = serialise(SECP256K1_EC_UNCOMPRESSED, 65);
+    cache = newCache;
+    std::atomic_store(&m_pubKeyCache, cache);
+    return cache;
 }
 
 /**
@@ -354,7 +409,9 @@ std::vector<KeyFragmentPtr> KeyECSecp256k1<Seeder>::split(const int nSplitShares
 template <class Seeder>
 bool KeyECSecp256k1<Seeder>::isValidSecpKey() const
 {
-    return checkSecKey(getSecret().data());
+    return withSecret([this](const uint8_t* secret, size_t size) {
+        return size == KEY_ECSECP256K1_SIZE && checkSecKey(secret);
+    });
 }
 
 // Export ourselves in wallet import format (WIF).
@@ -408,16 +465,38 @@ template <class Seeder>
 std::vector<uint8_t> KeyECSecp256k1<Seeder>::sign(const std::vector<uint8_t>& message) const
 {
     // We have to sign a 32 byte block, so sign a hash
-    uint256 hash { Hash256(message.begin(), message.end()) };
+    return signDigest(Hash256(message.begin(), message.end()));
+}
 
+// Sign a message digest with this key.
+template <class Seeder>
+std::vector<uint8_t> KeyECSecp256k1<Seeder>::signDigest(const uint256& hash) const
+{
     // Seed signature generator
     memory::SecureByteVec seed(32);
     m_seeder.generate(seed);
 
+    // Take a copy of our secret on the stack, wiped when we're done. Reading
+    // the secret still takes its lock, which lives in the library, but we
+    // hold it only for the copy and not while signing, so concurrent signers
+    // just contend briefly rather than queueing for a whole signature
+    CryptoPP::FixedSizeSecBlock<uint8_t, KEY_ECSECP256K1_SIZE> privBytes {};
+    const bool copied { withSecret([&privBytes](const uint8_t* secret, size_t size) {
+        if(size != privBytes.size())
+        {
+            return false;
+        }
+        std::copy(secret, secret + size, privBytes.begin());
+        return true;
+    }) };
+    if(!copied)
+    {
+        throw std::runtime_error("Private key is not secp256k1 compliant key.");
+    }
+
     // Do the signing
-    memory::SecureByteVec privBytes { getSecret() };
     secp256k1_ecdsa_signature sig {};
-    if(!secp256k1_ecdsa_sign(getEccContext(), &sig, hash.begin(), privBytes.data(),
+    if(!secp256k1_ecdsa_sign(getEccContext(), &sig, hash.begin(), privBytes.begin(),
                              secp256k1_nonce_function_rfc6979, seed.data()))
     {
         throw std::runtime_error("secp256k1 signing failed");
@@ -432,6 +511,115 @@ std::vector<uint8_t> KeyECSecp256k1<Seeder>::sign(const std::vector<uint8_t>& me
     return sigBytes;
 }
 
+// Sign a batch of messages with this key.
+template <class Seeder>
+std::vector<std::vector<uint8_t>> KeyECSecp256k1<Seeder>::signBatch(const std::vector<std::vector<uint8_t>>& messages,
+                                                                    size_t numWorkers) const
+{
+    // Sign hashes, as for sign(), hashing in the workers
+    return signAll(messages.size(), [&messages](size_t i) {
+        return Hash256(messages[i].begin(), messages[i].end());
+    }, numWorkers);
+}
+
+// Sign a batch of message digests with this key.
+template <class Seeder>
+std::vector<std::vector<uint8_t>> KeyECSecp256k1<Seeder>::signDigestBatch(const std::vector<uint256>& digests,
+                                                                          size_t numWorkers) const
+{
+    return signAll(digests.size(), [&digests](size_t i) -> const uint256& { return digests[i]; }, numWorkers);
+}
+
+// Sign a number of digests, spread over a pool of threads.
+template <class Seeder>
+template <typename DigestFunc>
+std::vector<std::vector<uint8_t>> KeyECSecp256k1<Seeder>::signAll(size_t count, const DigestFunc& digestFor,
+                                                                  size_t numWorkers) const
+{
+    std::vector<std::vector<uint8_t>> sigs(count);
+    if(!count)
+    {
+        return sigs;
+    }
+
+    // Borrow our secret once for the whole batch
+    CryptoPP::FixedSizeSecBlock<uint8_t, KEY_ECSECP256K1_SIZE> privBytes {};
+    const bool copied { withSecret([&privBytes](const uint8_t* secret, size_t size) {
+        if(size != privBytes.size())
+        {
+            return false;
+        }
+        std::copy(secret, secret + size, privBytes.begin());
+        return true;
+    }) };
+    if(!copied || !checkSecKey(privBytes.begin()))
+    {
+        throw std::runtime_error("Private key is not secp256k1 compliant key.");
+    }
+
+    // Seed every signature generator with a single draw
+    const size_t seedSize {32};
+    memory::SecureByteVec seeds(count * seedSize);
+    m_seeder.generate(seeds);
+
+    // Workers claim chunks of the batch in turn
+    const size_t chunkSize {16};
+    std::atomic<size_t> next {0};
+    std::mutex failureMtx {};
+    std::exception_ptr failure {};
+    auto worker = [&]()
+    {
+        try
+        {
+            size_t start {};
+            while((start = next.fetch_add(chunkSize)) < count)
+            {
+                const size_t stop { std::min(start + chunkSize, count) };
+                for(size_t i = start; i < stop; ++i)
+                {
+                    const auto& digest = digestFor(i);
+                    secp256k1_ecdsa_signature sig {};
+                    if(!secp256k1_ecdsa_sign(getEccContext(), &sig, digest.begin(), privBytes.begin(),
+                                             secp256k1_nonce_function_rfc6979, seeds.data() + i * seedSize))
+                    {
+                        throw std::runtime_error("secp256k1 signing failed");
+                    }
+
+                    // DER format, straight into the result
+                    uint8_t der[72];
+                    size_t sigLen { sizeof(der) };
+                    secp256k1_ecdsa_signature_serialize_der(getEccContext(), der, &sigLen, &sig);
+                    sigs[i].assign(der, der + sigLen);
+                }
+            }
+        }
+        catch(...)
+        {
+            // Stop everyone else claiming more work
+            next = count;
+            std::lock_guard<std::mutex> lck { failureMtx };
+            if(!failure)
+            {
+                failure = std::current_exception();
+            }
+        }
+    };
+
+    // No more threads than there are chunks, and we are one of them
+    if(!numWorkers)
+    {
+        numWorkers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    const size_t numThreads { std::min(numWorkers, (count + chunkSize - 1) / chunkSize) };
+    impl::utils::runOnThreads(numThreads, worker);
+
+    if(failure)
+    {
+        std::rethrow_exception(failure);
+    }
+    return sigs;
+}
+
 // Decrypt the given message
 template <class Seeder>
 memory::SecureByteVec KeyECSecp256k1<Seeder>::decrypt(const std::vector<uint8_t>& message) const
@@ -18,6 +18,7 @@
 #include <secp256k1/include/secp256k1.h>
 #include <array>
 #include <mutex>
+#include <stdexcept>
 
 namespace nakasendo 
 {
@@ -113,6 +114,42 @@ namespace nakasendo
             virtual bool verify(const std::vector<uint8_t>& message,
                                 const std::vector<uint8_t>& signature) const override;
 
+            /**
+            * Verify a signature of a message digest. The digest is checked as
+            * given, so verify(message, sig) is the same as
+            * verifyDigest(Hash256(message), sig).
+            * @param digest The 32 byte digest the signature should be for.
+            * @param signature The DER encoded signature.
+            * @return True if we can verify the signature.
+            */
+            bool verifyDigest(const impl::utils::uint256& digest,
+                              const std::vector<uint8_t>& signature) const
+            {
+                if(signature.empty())
+                {
+                    throw std::invalid_argument("Empty signature");
+                }
+
+                secp256k1_pubkey secpPubKey {};
+                {
+                    std::lock_guard<std::mutex> lck { m_mtx };
+                    if(!secp256k1_ec_pubkey_parse(getEccContext(), &secpPubKey,
+                                                  m_vSerializedPubKey.data(), m_vSerializedPubKey.size()))
+                    {
+                        throw std::runtime_error("secp256k1_ec_pubkey_parse failed");
+                    }
+                }
+
+                // Accept any valid DER signature, normalised to lower-S as for verify()
+                secp256k1_ecdsa_signature sig {};
+                if(!secp256k1_ecdsa_signature_parse_der(getEccContext(), &sig, signature.data(), signature.size()))
+                {
+                    return false;
+                }
+                secp256k1_ecdsa_signature_normalize(getEccContext(), &sig, &sig);
+                return secp256k1_ecdsa_verify(getEccContext(), &sig, digest.begin(), &secpPubKey) == 1;
+            }
+
             /**
             * Encrypt the given message so it may only be decrypted by our
             * corresponding private key.